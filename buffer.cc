@@ -44,7 +44,7 @@ void BufferClear(Buffer * buffer)
     buffer->size = 0;
 }
 
-bool BufferWrite(Buffer * buffer, void * data, size_t size)
+bool BufferWrite(Buffer * buffer, const void * data, size_t size)
 {
     BufferGrowIfNeeded(buffer, size);
     memcpy(buffer->data + buffer->size, data, size);
@@ -9,6 +9,8 @@
 #define buffer_hh
 
 #include <stdlib.h>
+#include <string.h>
+#include <type_traits>
 
 struct Buffer {
     char * data;
@@ -20,13 +22,70 @@ void BufferInit(Buffer * buffer, size_t size);
 
 /// Append `data` of `size` bytes to buffer.
 /// - returns: Returns `false` if the write would result in an overflow.
-bool BufferWrite(Buffer * buffer, void * data, size_t size);
+bool BufferWrite(Buffer * buffer, const void * data, size_t size);
 
 /// Remove `size` bytes of data from the beginning of the buffer.
+/// This moves the rest of the buffer down, so use a `BufferReader` to read
+/// several fields in a row.
 /// - returns: Returns `false` if the read would result in an underflow.
 bool BufferRead(Buffer * buffer, void * data, size_t size);
 
 void BufferGrowIfNeeded(Buffer * buffer, size_t needed);
 void BufferClear(Buffer * buffer);
 
+// MARK: - Reader
+
+/// Reads fields in order from a span of memory without modifying it. Reading
+/// past the end fails and sets `is_overflow`, which stays set, so a run of
+/// reads can be checked once at the end.
+struct BufferReader {
+    const char * data;
+    size_t size;
+    size_t offset;
+    bool is_overflow;
+};
+
+inline BufferReader MakeReader(const void * data, size_t size)
+{
+    BufferReader reader = {
+        .data = (const char *)data,
+        .size = size,
+        .offset = 0,
+        .is_overflow = false,
+    };
+
+    return reader;
+}
+
+inline size_t ReaderRemaining(const BufferReader * reader)
+{
+    return reader->size - reader->offset;
+}
+
+/// Copy the next `size` bytes into `data`, or skip them if `data` is null.
+/// - returns: `false` if fewer than `size` bytes remain.
+inline bool ReaderRead(BufferReader * reader, void * data, size_t size)
+{
+    if ( reader->is_overflow || ReaderRemaining(reader) < size ) {
+        reader->is_overflow = true;
+        return false;
+    }
+
+    if ( data ) {
+        memcpy(data, reader->data + reader->offset, size);
+    }
+
+    reader->offset += size;
+    return true;
+}
+
+/// Read one fixed-size value. The copy size is a constant, so the compiler
+/// turns it into a plain load.
+template <typename T>
+inline bool ReaderGet(BufferReader * reader, T * value)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "ReaderGet: not a POD");
+    return ReaderRead(reader, value, sizeof(T));
+}
+
 #endif /* buffer_hh */
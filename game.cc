@@ -15,48 +15,34 @@
 
 #include "beeper.hh"
 #include "buffer.hh"
+#include "jitter.hh"
+#include "lobby.hh"
 #include "net.hh"
 #include "packet.hh"
 #include "random.hh"
+#include "match.hh"
+#include "rollback.hh"
+#include "scheduler.hh"
+#include "snapshot.hh"
 
+#include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
 #include <SDL3/SDL.h>
 
 #define HUD_LINE_HEIGHT (CHAR_HEIGHT + 2)
+#define INPUT_HISTORY 64 // Inputs kept for replay. Must divide 65536.
 #define HUD_LINE(n) (HUD_LINE_HEIGHT * ((n) - 1))
+#define VIEW_TILES 25 // Most map tiles shown across or down.
+#define JOIN_TIMEOUT_SEC 10.0 // How long the server has to seat us.
 
 // -----------------------------------------------------------------------------
 // Constants
 
-static const char _tile_map[MAP_SIZE][MAP_SIZE + 1 /* = null term. */] = {
-    "XVXXXXX...XXVVX...XXXXXXX",
-    "XsSSSSS...SXVsS...SSSSSSX",
-    "V..........SsX..........X",
-    "X..A.........S.......C..X",
-    "X.aSc....XGW........gSi.X",
-    "X..b...XGXGWG..XVX...h..X",
-    "X.....0XWSWWG..SsV2.....X",
-    "S....XXXWWWG.....sXX....S",
-    ".....VSSGGG.......SX.....",
-    ".....XT...........TX.....",
-    "X....S.......W.....S....X",
-    "XX.......G.GWW.........XX",
-    "XX.......GGWWWW........XX",
-    "XS......GGGoWW.........XX",
-    "X........GYGGGG........SX",
-    "S....X...GGGYG.....X....S",
-    ".....XT....GG.....TX.....",
-    ".....XXX.........VXS.....",
-    "X....SSX........GVS.....X",
-    "X.....3XXX.....VXX1.....X",
-    "X..D...SSS.....sSS...B..X",
-    "X.jSl.......LL......dSf.X",
-    "X..k.......LLLL......e..X",
-    "X..........XXXLL........X",
-    "XXXXXXX...XXXXX...XXXXXXX",
-};
-
 static const Color _player_colors[MAX_PLAYERS] = {
     BRIGHT_WHITE,
     BRIGHT_MAGENTA,
@@ -123,10 +109,8 @@ static void UpdateGame(Action action, float dt);
 static void RenderGame(void);
 static bool DoGameInput(void);
 static void RenderMatchOver(void);
-void TryMovePlayer(Player * player, int x, int y);
-void DisposeRing(void * data);
-void UpdatePoints(void * data);
-void SpawnRing(void * data);
+static void UpdateConnections(void);
+static bool ConnectToServer(void);
 
 // -----------------------------------------------------------------------------
 // Public Data
@@ -134,28 +118,22 @@ void SpawnRing(void * data);
 bool is_running_g = true;
 Session session_g;
 int nplayers_g = 1;
+Transport transport_g = TRANSPORT_TCP;
+int nmatches_g = 1;
+float tick_rate_g = 60.0f;
+float send_rate_g = 60.0f;
+int nthreads_g = 0;
+bool rollback_g = false;
+const char * record_dir_g = NULL;
 
 // -----------------------------------------------------------------------------
 // Private Data
 
-#define             NUM_SOCKETS_PER_PLAYER 3
-#define             NUM_SOCKETS ((NUM_SOCKETS_PER_PLAYER) * (MAX_PLAYERS))
-#define             MAX_RINGS 4 // Number of rings that can appear at once
-#define             MAX_POINTS 100
-static GameState    _curr_state;
-static Player       _players[MAX_PLAYERS];
 static int          _player_idx; // Which player[] we are.
 static Action       _curr_action; // Current player action from input.
-static u8           _sockets[NUM_SOCKETS]; // Corresponds to tiles 'a' to 'l'
-static Ring         _rings[MAX_RINGS]; // Rings on the board
-static u8           _nrings; // Number of rings in the rings array
-static u8           _disposal; // Type of ring inside.
-static enum Sound   _curr_sound; // Which sound to output at end of frame.
-
-static Timer        _ring_timer = InitTimer(3.0f, 15.0f, SpawnRing);
-static Timer        _dispose_timer = InitTimer(0, 0, DisposeRing);
-static Timer        _point_timer = InitTimer(5.0f, 5.0f, UpdatePoints);
 static Timer        _key_timer = InitTimer(0.0f, 0.0f, NULL);
+static Rng          _cosmetic_rng; // Flicker and the like. Never the simulation.
+static SDL_Point    _camera; // Map pixel at the top left of the view.
 
 static const GameStateHandler _state_handlers[] = {
     [GS_PLAY] = {
@@ -170,10 +148,31 @@ static const GameStateHandler _state_handlers[] = {
     }
 };
 
+// Matches this process runs. A client has one, mirrored from snapshots.
+static Match *      _matches;
+static int          _nmatches;
+static MatchState * _state; // The match that's displayed.
+static MatchState _view; // A client's _state, with remote players interpolated.
+
 // Net
-static Socket _connections[MAX_PLAYERS]; // Server connections.
+static Lobby _lobby; // Where server connections come in.
+static Poller _poller; // Readiness of server connections.
+static Scheduler _scheduler; // Worker threads of a dedicated server.
+static volatile sig_atomic_t _is_stopping; // Set by SIGINT or SIGTERM.
 static Socket _client;
+static const char * _server_ip;
+static const char * _server_port;
+static u64 _token; // Our seat on the server, to get it back after a drop.
+static PlayerInput _inputs[INPUT_HISTORY]; // Inputs sent, by seq.
+static u16 _input_seq = 1; // Next input's seq.
+static u16 _acked_seq; // Newest input the server has simulated.
+static Timer _reconnect_timer;
 static Buffer _net_buf;
+static PacketBatch _batch;
+static SnapshotHistory _history; // Snapshots received.
+static u32 _tick; // Newest snapshot applied.
+static JitterBuffer _jitter; // When to show remote players.
+static Rollback _rollback; // Rollback mode's inputs and saved states.
 
 // -----------------------------------------------------------------------------
 #pragma mark - Misc Functions
@@ -184,26 +183,55 @@ static void QuitGame(void)
         CloseSocket(&_client);
     }
 
-    for ( int i = 0; i < nplayers_g; i++ ) {
-        if ( _connections[i].is_init ) {
-            CloseSocket(&_connections[i]);
-        }
+    for ( int i = 0; i < _nmatches; i++ ) {
+        CloseMatch(&_matches[i]);
+    }
+
+    if ( _poller.is_init ) {
+        ClosePoller(&_poller);
+    }
+
+    CloseScheduler(&_scheduler);
+    CloseLobby(&_lobby);
+
+    if ( _rollback.is_started ) {
+        printf("Rolled back %d times, re-simulating %d frames "
+               "(at most %.3f ms before one frame)\n",
+               _rollback.nrollbacks,
+               _rollback.nresimulated,
+               _rollback.max_resim_sec * 1000.0);
     }
 }
 
-constexpr SDL_Rect GetMapRect(void)
+/// Where the map is drawn: all of it, or a VIEW_TILES square of a big one.
+static SDL_Rect GetMapRect(void)
 {
-    constexpr int map_pix_size = MAP_SIZE * TILE_SIZE;
-    constexpr SDL_Rect map_rect = {
-        .x = (GAME_WIDTH - map_pix_size) / 2,
-        .y = (GAME_HEIGHT - map_pix_size) / 2,
-        .w = map_pix_size,
-        .h = map_pix_size,
+    int w = min(map_g.width, VIEW_TILES) * TILE_SIZE;
+    int h = min(map_g.height, VIEW_TILES) * TILE_SIZE;
+    SDL_Rect map_rect = {
+        .x = (GAME_WIDTH - w) / 2,
+        .y = (GAME_HEIGHT - h) / 2,
+        .w = w,
+        .h = h,
     };
 
     return map_rect;
 }
 
+/// Keep our player in the middle of the view, short of showing past the
+/// map's edges.
+static void MoveCamera(const SDL_Rect * map_rect)
+{
+    const Player * p = &_state->players[_player_idx];
+    int max_x = map_g.width * TILE_SIZE - map_rect->w;
+    int max_y = map_g.height * TILE_SIZE - map_rect->h;
+
+    _camera.x = p->x * TILE_SIZE + p->offx + TILE_SIZE / 2 - map_rect->w / 2;
+    _camera.y = p->y * TILE_SIZE + p->offy + TILE_SIZE / 2 - map_rect->h / 2;
+    _camera.x = CLAMP(_camera.x, 0, max_x);
+    _camera.y = CLAMP(_camera.y, 0, max_y);
+}
+
 void GetHUDRects(SDL_Rect rects[])
 {
     const SDL_Rect map_rect = GetMapRect();
@@ -246,7 +274,7 @@ static bool DoGameInput(void)
         }
 
         if ( _curr_action != A_NONE ) {
-            if ( _players[_player_idx].held == RING_RAINBOW ) {
+            if ( _state->players[_player_idx].held == RING_RAINBOW ) {
                 _key_timer.sec = 0.0f;
             } else {
                 _key_timer.sec = 0.25f;
@@ -269,7 +297,7 @@ static Color RingColor(u8 ring_type)
         case RING_MAGENTA: return BRIGHT_MAGENTA;
         case RING_YELLOW: return YELLOW;
         case RING_WHITE: return BRIGHT_WHITE;
-        case RING_RAINBOW: return (Color)Rand(BRIGHT_BLUE, BRIGHT_WHITE);
+        case RING_RAINBOW: return (Color)Rand(&_cosmetic_rng, BRIGHT_BLUE, BRIGHT_WHITE);
 
         case NUM_RING_TYPES:
         default:
@@ -278,97 +306,6 @@ static Color RingColor(u8 ring_type)
     }
 }
 
-static int RingValue(u8 ring_type, int player_index)
-{
-    if ( ring_type == RING_RAINBOW ) {
-        return 3;
-    } else if ( RingColor(ring_type) == _player_colors[player_index] ) {
-        return 2;
-    } else if ( ring_type == RING_NONE ) {
-        return 0;
-    } else {
-        return 1;
-    }
-}
-
-static bool Unoccupied(int x, int y)
-{
-    for ( int i = 0; i < nplayers_g; i++ ) {
-        Player * p = &_players[i];
-        if ( p->x == x && p->y == y ) {
-            return false;
-        }
-    }
-
-    for ( int i = 0; i < _nrings; i++ ) {
-        Ring * r = &_rings[i];
-        if ( r->x == x && r->y == y ) {
-            return false;
-        }
-    }
-
-    return _tile_map[y][x] == '.' || _tile_map[y][x] == 'G';
-}
-
-RingType GetRandomRingType(void)
-{
-    int weights[] = {
-        [RING_BLUE]     = 10,
-        [RING_GREEN]    = 10,
-        [RING_CYAN]     = 10,
-        [RING_MAGENTA]  = 10,
-        [RING_YELLOW]   = 10,
-        [RING_WHITE]    = 10,
-        [RING_RED]      = 5,
-        [RING_RAINBOW]  = 2,
-    };
-
-    int total = 0;
-    for ( int i = 1; i < NUM_RING_TYPES; i++ ) {
-        total += weights[i];
-    }
-
-    int value = Rand(0, total - 1);
-
-    int weight = 0;
-    for ( int i = 1; 1 < NUM_RING_TYPES; i++ ) {
-        weight += weights[i];
-        if ( value < weight ) {
-            return (RingType)i;
-        }
-    }
-}
-
-Ranking GetRanking(void)
-{
-    Ranking ranking = { 0 };
-
-    // Find the highest points value.
-    int max_pts = _players[0].pts;
-
-    for ( int i = 1; i < nplayers_g; i++ ) {
-        if ( _players[i].pts > max_pts ) {
-            max_pts = _players[i].pts;
-        }
-    }
-
-    // Assign first place.
-    for ( int i = 0; i < nplayers_g; i++ ) {
-        if ( _players[i].pts == max_pts ) {
-            ranking.is_in_first[i] = true;
-            ranking.in_first_indices[ranking.num_in_first++] = i;
-        }
-    }
-
-    if ( ranking.num_in_first == nplayers_g ) {
-        // All players are tied, remove in first status
-        ranking.num_in_first = 0;
-        memset(ranking.is_in_first, 0, sizeof(ranking.is_in_first));
-    }
-
-    return ranking;
-}
-
 #pragma mark - Draw Functions
 
 void DrawTile(char ch, int tile_x, int tile_y)
@@ -381,26 +318,28 @@ void DrawTile(char ch, int tile_x, int tile_y)
 
     // Choose socket color
     if ( ch >= 'a' && ch <= 'l' ) {
-        RingType ring_type = (RingType)_sockets[ch - 'a'];
+        RingType ring_type = (RingType)_state->sockets[ch - 'a'];
         if ( ring_type ) {
             fg = RingColor(ring_type);
         }
     }
 
-    if ( ch == 'o' && _disposal ) {
-        bg = RingColor(_disposal);
+    if ( ch == 'o' && _state->disposal ) {
+        bg = RingColor(_state->disposal);
     }
 
-    DrawChar(tile_x * TILE_SIZE, tile_y * TILE_SIZE, 219, bg);
-    DrawChar(tile_x * TILE_SIZE, tile_y * TILE_SIZE, tile.ch[i], fg);
+    int x = tile_x * TILE_SIZE - _camera.x;
+    int y = tile_y * TILE_SIZE - _camera.y;
+    DrawChar(x, y, 219, bg);
+    DrawChar(x, y, tile.ch[i], fg);
 }
 
 void DrawPlayer(int i)
 {
-    Player * p  = &_players[i];
+    Player * p  = &_state->players[i];
 
-    int x = (p->x * TILE_SIZE) + p->offx;
-    int y = (p->y * TILE_SIZE) + p->offy;
+    int x = (p->x * TILE_SIZE) + p->offx - _camera.x;
+    int y = (p->y * TILE_SIZE) + p->offy - _camera.y;
 
     Color fg;
     Color bg = BLACK;
@@ -408,7 +347,7 @@ void DrawPlayer(int i)
 
     switch ( p->held ) {
         case RING_RAINBOW:
-            fg = (Color)Rand(BRIGHT_BLUE, BRIGHT_WHITE);
+            fg = (Color)Rand(&_cosmetic_rng, BRIGHT_BLUE, BRIGHT_WHITE);
             break;
         case RING_RED:
             fg = (SDL_GetTicks() / 100) & 1 ? BRIGHT_RED : RED;
@@ -444,10 +383,10 @@ void RenderGame(void)
 
     // Player HUD
 
-    Ranking ranking = GetRanking();
+    Ranking ranking = GetRanking(_state);
 
     // Render HUD for each player
-    for ( int i = 0; i < nplayers_g; i++ ) {
+    for ( int i = 0; i < _state->nplayers; i++ ) {
 
 #if 0
         float progress = (float)point_timer_i.sec / point_timer_i.reset_sec;
@@ -462,17 +401,17 @@ void RenderGame(void)
 
         // Health
         for ( int j = 0; j < MAX_PLAYER_HEALTH; j++ ) {
-            Color fg = j < _players[i].health ? _player_colors[i] : GRAY;
+            Color fg = j < _state->players[i].health ? _player_colors[i] : GRAY;
             DrawChar(j * CHAR_WIDTH, HUD_LINE(1), 3, fg);
         }
 
         // Held Ring
 //        if ( players_i[i].held ) {
-            DrawChar(0, HUD_LINE(2), 0x09, RingColor(_players[i].held));
+            DrawChar(0, HUD_LINE(2), 0x09, RingColor(_state->players[i].held));
 //        }
 
         // Socket Points
-        u8 * sock = &_sockets[i * NUM_SOCKETS_PER_PLAYER];
+        u8 * sock = &_state->sockets[i * NUM_SOCKETS_PER_PLAYER];
         DrawText(0, HUD_LINE(2), RingColor(*sock), "  %d  ",
                  RingValue(*sock, i));
         sock++;
@@ -495,28 +434,34 @@ void RenderGame(void)
         }
 
         // Points
-        DrawText(0, HUD_LINE(3), _player_colors[i], "  %3d", _players[i].pts);
+        DrawText(0, HUD_LINE(3), _player_colors[i], "  %3d", _state->players[i].pts);
     }
 
     SetViewport(&map_rect);
+    MoveCamera(&map_rect);
 
-    // Tile map
-    for ( int y = 0; y < MAP_SIZE; y++ ) {
-        for ( int x = 0; x < MAP_SIZE; x++ ) {
-            DrawTile(_tile_map[y][x], x, y);
+    // Tile map, what's in view of it
+    int left = _camera.x / TILE_SIZE;
+    int top = _camera.y / TILE_SIZE;
+    int right = min((_camera.x + map_rect.w - 1) / TILE_SIZE, map_g.width - 1);
+    int bottom = min((_camera.y + map_rect.h - 1) / TILE_SIZE, map_g.height - 1);
+
+    for ( int y = top; y <= bottom; y++ ) {
+        for ( int x = left; x <= right; x++ ) {
+            DrawTile(MapTile(&map_g, x, y), x, y);
         }
     }
 
     // Rings
-    for ( int i = 0; i < _nrings; i++ ) {
-        DrawChar(_rings[i].x * TILE_SIZE,
-                 _rings[i].y * TILE_SIZE,
+    for ( int i = 0; i < _state->nrings; i++ ) {
+        DrawChar(_state->rings[i].x * TILE_SIZE - _camera.x,
+                 _state->rings[i].y * TILE_SIZE - _camera.y,
                  0x09,
-                 RingColor(_rings[i].type));
+                 RingColor(_state->rings[i].type));
     }
 
     // Players
-    for ( int i = 0; i < nplayers_g; i++ ) {
+    for ( int i = 0; i < _state->nplayers; i++ ) {
         DrawPlayer(i);
     }
 
@@ -530,9 +475,9 @@ void RenderMatchOver(void)
 
     int winner_idx = -1;
     int max_pts = 0;
-    for ( int p = 0; p < nplayers_g; p++ ) {
-        if ( _players[p].pts > max_pts ) {
-            max_pts = _players[p].pts;
+    for ( int p = 0; p < _state->nplayers; p++ ) {
+        if ( _state->players[p].pts > max_pts ) {
+            max_pts = _state->players[p].pts;
             winner_idx = p;
         }
     }
@@ -541,9 +486,9 @@ void RenderMatchOver(void)
     DrawCenteredText(y, _player_colors[winner_idx], "%c Wins!", 2);
     y += 32;
 
-    for ( int p = 0; p < nplayers_g; p++ ) {
+    for ( int p = 0; p < _state->nplayers; p++ ) {
         DrawCenteredText(y, _player_colors[p], "%d. %c %3d points",
-                         p + 1, 2, _players[p].pts);
+                         p + 1, 2, _state->players[p].pts);
         y += CHAR_HEIGHT * 1.5;
     }
 
@@ -552,401 +497,284 @@ void RenderMatchOver(void)
 
 #pragma mark - Update Functions
 
-bool CollideWithPlayer(Player * self, int x, int y, int dx, int dy)
+void ClientUpdate(Action action, float dt)
 {
-    for ( int i = 0; i < nplayers_g; i++ ) {
-
-        Player * hit = &_players[i];
+    if ( !_client.is_init || _client.is_hungup ) {
+        if ( _client.is_init ) {
+            printf("Lost the server, reconnecting...\n");
+            CloseSocket(&_client);
+            _client.is_init = false;
+            _reconnect_timer = InitTimer(1.0f, 0.0f, NULL);
+        }
 
-        if ( hit != self && x == hit->x && y == hit->y ) {
-            // Collision:
+        if ( RunTimer(&_reconnect_timer, dt) && !ConnectToServer() ) {
+            _reconnect_timer = InitTimer(1.0f, 0.0f, NULL);
+        }
 
-            // Set up bump animation.
-            self->offx = dx * TILE_SIZE * 0.5;
-            self->offy = dy * TILE_SIZE * 0.5;
+        return;
+    }
 
-            // Do damage.
-            if ( self->held == RING_RED ) {
-                hit->health = 0;
-            } else if ( self->held
-                       && RingColor(self->held) == _player_colors[_player_idx] ) {
-                hit->health -= 2;
-            } else if ( self->held == RING_RAINBOW ) {
-                hit->health -= 2;
-            } else {
-                hit->health--;
-            }
+    // Receive game state.
 
-            if ( hit->health <= 0 ) {
-                // TODO: killed
-            }
+    int count = PacketReadBatch(&_client, &_batch);
+    enum Sound sound = S_NONE;
+    u32 applied_tick = _tick;
+    u16 acked_seq = 0;
+    double now = NetTime();
 
-            printf("health: %d\n", hit->health);
-            _curr_sound = S_ATTACK;
+    for ( int i = 0; i < count; i++ ) {
+        BitReader reader = MakeBitReader(_batch.packets[i].data,
+                                         _batch.packets[i].size);
+        Snapshot snapshot;
+        if ( !DecodeSnapshot(&reader, &_history, &snapshot) ) {
+            fprintf(stderr, "ClientUpdate: could not decode snapshot\n");
+            continue;
+        }
 
-            // Move the hit player.
-            int pdx = hit->x - self->x;
-            int pdy = hit->y - self->y;
-            TryMovePlayer(hit, hit->x + pdx, hit->y + pdy);
+        // Keep it as a possible baseline even if it's arrived out of order.
+        StoreSnapshot(&_history, &snapshot);
+        JitterArrival(&_jitter, snapshot.tick, now);
 
-            return true;
+        if ( snapshot.tick <= applied_tick ) {
+            continue;
         }
-    }
 
-    return false;
-}
+        LoadSnapshot(_state, &snapshot);
+        applied_tick = snapshot.tick;
+        acked_seq = snapshot.input_seqs[_player_idx];
 
-void TeleportPlayer(Player * player, int from_x, int from_y)
-{
-    for ( int y = 0; y < MAP_SIZE; y++ ) {
-        for ( int x = 0; x < MAP_SIZE; x++ ) {
-            if ( _tile_map[y][x] == 'T'
-                && x != from_x
-                && y != from_y )
-            {
-                player->x = x;
-                player->y = y;
-                _curr_sound = S_TELEPORT;
-                return;
-            }
+        // Don't miss a sound from a snapshot that's already been superseded.
+        if ( _state->sound ) {
+            sound = _state->sound;
         }
     }
-}
 
-void TryMovePlayer(Player * player, int try_x, int try_y)
-{
-    int dx = try_x - player->x;
-    int dy = try_y - player->y;
-
-    // Wrap position
-    if ( try_x < 0 ) try_x += MAP_SIZE;
-    if ( try_y < 0 ) try_y += MAP_SIZE;
-    if ( try_x >= MAP_SIZE ) try_x -= MAP_SIZE;
-    if ( try_y >= MAP_SIZE ) try_y -= MAP_SIZE;
-
-    switch ( _tile_map[try_y][try_x] ) {
-        case '.': // Empty
-        case '0': case '1': case '2': case '3': // Player spawn platforms
-        case 'a': case 'b': case 'c': // Player 1 Ring sockets
-        case 'd': case 'e': case 'f': // Player 2 Ring sockets
-        case 'g': case 'h': case 'i': // Player 3 Ring sockets
-        case 'j': case 'k': case 'l': // Player 4 Ring sockets
-        case 'G': // Grass
-        case 'o': // Ring Disposer
-        case 'T': // Teleporter
-        {
-            // No tile collision.
-            char tile = _tile_map[try_y][try_x];
-
-            // TODO: refactor
-            // if ( !CollideWithPlayer ) {
-            //      StepOntoEmptyTile(type)
-            // }
-
-            // Check for a player:
-            if ( CollideWithPlayer(player, try_x, try_y, dx, dy) ) {
-                return;
-            }
+    if ( applied_tick != _tick ) {
+        _state->sound = sound;
+        _tick = applied_tick;
 
-            // No collision with a player, move and check for pick-ups:
-
-            player->x = try_x;
-            player->y = try_y;
-            player->offx = -dx * TILE_SIZE; // Step animation
-            player->offy = -dy * TILE_SIZE;
-
-            // Check if the player stepped onto a ring.
-            if ( !player->held ) {
-                for ( int i = 0; i < _nrings; i++ ) {
-                    if ( player->x == _rings[i].x && player->y == _rings[i].y ) {
-                        player->held = _rings[i].type; // Pick it up.
-                        _rings[i] = _rings[--_nrings]; // Remove from board.
-                        _curr_sound = S_RING_COLLECT;
-                    }
-                }
-            }
-
-            // Stepped onto a socket.
-            if ( tile >= 'a' && tile <= 'l' ) {
-
-                u8 * socket = &_sockets[_tile_map[try_y][try_x] - 'a'];
-
-                if ( !(*socket) && player->held ) {
-                    // Place a held ring into the empty socket.
-                    *socket = player->held;
-                    player->held = 0;
-                    _curr_sound = S_PLACE_IN_SOCKET;
-                } else if ( *socket && !player->held ) {
-                    // Pick up the item in the socket.
-                    player->held = *socket;
-                    *socket = 0;
-                    _curr_sound = S_REMOVE_FROM_SOCKET;
-                }
-            }
-
-            // Stepped onto the ring disposer.
-            if ( tile == 'o' ) {
-                if ( player->held && !_disposal ) {
-                    _disposal = player->held;
-                    player->held = RING_NONE;
-                    _dispose_timer.sec = 5.0f;
-                    _curr_sound = S_DISPOSER_PLACE;
-                } else if ( !player->held && _disposal ) {
-                    player->held = _disposal;
-                    _disposal = RING_NONE;
-                    _dispose_timer.sec = 0.0f;
-                    _curr_sound = S_RING_COLLECT;
-                }
-            }
-
-            break;
+        // The snapshot put us back where the server has us. Replay the inputs
+        // it hasn't simulated yet to get back to where we predicted.
+        _acked_seq = acked_seq;
+        u16 unacked = _input_seq - acked_seq - 1;
+        if ( unacked > INPUT_HISTORY ) {
+            unacked = INPUT_HISTORY;
         }
-        case 'W':
-            // Blocking and no bump animation: do nothing.
-            break;
-        default:
-            // Bump into:
-            player->offx = dx * TILE_SIZE * 0.5;
-            player->offy = dy * TILE_SIZE * 0.5;
-            _curr_sound = S_BUMP;
-            break;
-    }
-}
 
-void UpdatePlayer(Player * player, Action action)
-{
-    if ( player->offx || player->offy ) {
-        player->offx -= SIGN(player->offx);
-        player->offy -= SIGN(player->offy);
-
-        if ( player->offx == 0 && player->offy == 0 ) {
-            // Arrive, check if on teleporter.
-            if ( _tile_map[player->y][player->x] == 'T' ) {
-                TeleportPlayer(player, player->x, player->x);
-            }
+        for ( u16 seq = _input_seq - unacked; seq != _input_seq; seq++ ) {
+            PredictPlayer(_state, _player_idx, _inputs[seq % INPUT_HISTORY].action);
         }
-    } else if ( action != A_NONE ) {
 
-        int dx = 0;
-        int dy = 0;
+        // Tell the server which baseline it can delta against. Only the
+        // newest ack matters, so it can be dropped.
+        u8 type = CM_ACK;
+        BufferClear(&_net_buf);
+        BufferWrite(&_net_buf, &type, sizeof(type));
+        BufferWrite(&_net_buf, &_tick, sizeof(_tick));
+        if ( !PacketWrite(&_client, &_net_buf, DELIVERY_UNRELIABLE) ) {
+            fprintf(stderr, "ClientUpdate: packetwrite failed\n");
+        }
+    }
 
-        if ( action & A_MOVE_UP ) dy--;
-        if ( action & A_MOVE_DOWN) dy++;
-        if ( action & A_MOVE_LEFT) dx--;
-        if ( action & A_MOVE_RIGHT) dx++;
+    // Move right away rather than wait a round trip for the server, and send
+    // the input along to be simulated there too.
+    PlayerInput input = { .seq = _input_seq++, .action = action };
+    _inputs[input.seq % INPUT_HISTORY] = input;
+    PredictPlayer(_state, _player_idx, action);
 
-        TryMovePlayer(player, player->x + dx, player->y + dy);
+    // Repeat the inputs the server hasn't simulated yet, so that one getting
+    // through is enough and a lost packet needs no resend.
+    u16 unacked = _input_seq - _acked_seq - 1;
+    u8 ninputs = unacked < INPUT_REDUNDANCY ? (u8)unacked : INPUT_REDUNDANCY;
+    if ( ninputs == 0 ) {
+        ninputs = 1;
     }
-}
 
-void SpawnRing(void * data)
-{
-    if ( _nrings >= MAX_RINGS ) {
-        return;
+    u8 type = CM_INPUTS;
+    BufferClear(&_net_buf);
+    BufferWrite(&_net_buf, &type, sizeof(type));
+    BufferWrite(&_net_buf, &input.seq, sizeof(input.seq));
+    BufferWrite(&_net_buf, &ninputs, sizeof(ninputs));
+    for ( u16 seq = _input_seq - ninputs; seq != _input_seq; seq++ ) {
+        BufferWrite(&_net_buf, &_inputs[seq % INPUT_HISTORY].action, sizeof(Action));
     }
 
-    // Find free map spots
-    u8 free_x[MAP_SIZE * MAP_SIZE];
-    u8 free_y[MAP_SIZE * MAP_SIZE];
-    int npts = 0;
-
-    for ( int y = 0; y < MAP_SIZE; y++ ) {
-        for ( int x = 0; x < MAP_SIZE; x++ ) {
-            if ( Unoccupied(x, y) ) {
-                free_x[npts] = x;
-                free_y[npts] = y;
-                npts++;
-            }
-        }
+    if ( !PacketWrite(&_client, &_net_buf, DELIVERY_UNRELIABLE) ) {
+        fprintf(stderr, "ClientUpdate: packetwrite failed\n");
     }
 
-    // Select a random free spot
-    int rand_i = Rand(0, npts - 1);
-
-    _rings[_nrings].x = free_x[rand_i];
-    _rings[_nrings].y = free_y[rand_i];
-    _rings[_nrings].type = GetRandomRingType();
-    _nrings++;
-
-    _curr_sound = S_RING_SPAWN;
+    if ( !PacketFlush(&_client) ) {
+        fprintf(stderr, "ClientUpdate: packet flush failed\n");
+    }
 }
 
-void DisposeRing(void * data)
+void UpdateGame(Action action, float dt)
 {
-    _curr_sound = S_RING_DISPOSED;
-    _disposal = RING_NONE;
-}
+    RunTimer(&_key_timer, dt);
 
-void UpdatePoints(void * data)
-{
-    // Update points based on rings in sockets.
-    bool match_over = false;
-
-    for ( int s = 0; s < NUM_SOCKETS; s++ ) {
-        if ( _sockets[s] ) {
-            int player_index = s / NUM_SOCKETS_PER_PLAYER;
-            int points = RingValue(_sockets[s], player_index);
-            _players[player_index].pts += points;
-            if ( _players[player_index].pts > MAX_POINTS ) {
-                match_over = true;
-            }
+    if ( session_g == SN_CLIENT && rollback_g ) {
+        if ( _client.is_hungup ) {
+            // The match can't be picked up again, so there's no reconnecting.
+            printf("Lost the host.\n");
+            is_running_g = false;
+            return;
         }
-    }
-
-    Ranking ranking = GetRanking();
-    if ( ranking.num_in_first == 1 && match_over ) {
-        _curr_state = GS_MATCH_OVER;
-        _curr_sound = S_MATCH_OVER;
-        return;
-    }
 
-    // Increase health for those standing on their spawn platform
-    for ( int p = 0; p < nplayers_g; p++ ) {
-        int spawn_x = -1;
-        int spawn_y = -1;
-        bool scan = true;
-
-        for ( int y = 0; y < MAP_SIZE && scan; y++ ) {
-            for ( int x = 0; x < MAP_SIZE && scan; x++ ) {
-                if ( _tile_map[y][x] == p + '0' ) {
-                    spawn_x = x;
-                    spawn_y = y;
-                    scan = false;
-                }
-            }
-        }
+        RollbackClientUpdate(&_client, &_rollback, _state, _player_idx, action);
+    } else if ( session_g == SN_CLIENT ) {
+        ClientUpdate(action, dt);
+    } else {
+        UpdateConnections();
 
-        if ( spawn_x == -1 || spawn_y == -1 ) {
-            ERROR("Programmer effed up big");
+        NetEvent events[MAX_PLAYERS];
+        if ( PollerWait(&_poller, events, MAX_PLAYERS, 0) == -1 ) {
+            fprintf(stderr, "UpdateGame: PollerWait failed: %s\n", GetNetError());
         }
 
-        if ( _players[p].x == spawn_x && _players[p].y == spawn_y ) {
-            if ( _players[p].health < MAX_PLAYER_HEALTH ) {
-                _players[p].health++;
-                _curr_sound = S_REGEN;
-            }
+        if ( rollback_g ) {
+            RollbackServerUpdate(&_matches[0], &_rollback, action);
+        } else {
+            ServerUpdate(&_matches[0], action, dt);
         }
     }
 }
 
-void ServerUpdate(Action action, float dt)
-{
-    Action actions[MAX_PLAYERS] = { [0] = action };
-    for ( int i = 1; i < nplayers_g; i++ ) {
-        actions[i] = A_NONE;
-    }
+#pragma mark - Init Functions
 
-    // Read client actions.
-    for ( int i = 1; i < nplayers_g; i++ ) {
-        BufferClear(&_net_buf);
-        if ( _connections[i].is_init ) {
-            if ( PacketRead(&_connections[i], &_net_buf) ) {
-                BufferRead(&_net_buf, &actions[i], sizeof(Action));
-            }
-        }
+bool InitServer(const char * port)
+{
+    if ( session_g != SN_DEDICATED ) {
+        SetWindowTitle("Server");
+        SetWindowPosition(0, 0);
     }
 
-    // Update Game
-    RunTimer(&_dispose_timer, dt);
-    RunTimer(&_ring_timer, dt);
-    RunTimer(&_point_timer, dt);
-
-    for ( int i = 0; i < nplayers_g; i++ ) {
-        UpdatePlayer(&_players[i], actions[i]);
+    int first_remote = session_g == SN_DEDICATED ? 0 : 1;
+    if ( !InitLobby(&_lobby, port, transport_g,
+                    _nmatches, nplayers_g, first_remote) ) {
+        return false;
     }
 
-    // Serialize and send game state.
-
-    BufferClear(&_net_buf);
-    BufferWrite(&_net_buf, _players, sizeof(_players));
-    BufferWrite(&_net_buf, &_nrings, sizeof(_nrings));
-    BufferWrite(&_net_buf, _rings, sizeof(_rings));
-    BufferWrite(&_net_buf, &_curr_sound, sizeof(_curr_sound));
-    BufferWrite(&_net_buf, _sockets, sizeof(_sockets));
-    BufferWrite(&_net_buf, &_disposal, sizeof(_disposal));
-
-    for ( int i = 1; i < nplayers_g; i++ ) {
-        if ( _connections[i].is_init ) {
-            if ( !PacketWrite(&_connections[i], &_net_buf) ) {
-                fprintf(stderr, "ServerUpdate: packet write failed\n");
-            }
+    // A player who leaves can come back, or be replaced. A rollback match
+    // can't take in someone new partway through, so it keeps its seats.
+    if ( !rollback_g ) {
+        for ( int i = 0; i < _nmatches; i++ ) {
+            _matches[i].lobby = &_lobby;
+            _matches[i].lobby_index = i;
         }
     }
-}
 
-void ClientUpdate(Action action)
-{
-    Player * player = &_players[_player_idx];
+    if ( session_g == SN_DEDICATED ) {
+        int nworkers = nthreads_g;
+        if ( nworkers == 0 ) {
+            nworkers = (int)std::thread::hardware_concurrency();
+        }
+        nworkers = CLAMP(nworkers, 1, _nmatches);
 
-    // Send action, if any.
-    if ( action != A_NONE && player->offx == 0 && player->offy == 0 ) {
-        BufferClear(&_net_buf);
-        BufferWrite(&_net_buf, &action, sizeof(action));
-        if ( !PacketWrite(&_client, &_net_buf) ) {
-            fprintf(stderr, "ClientUpdate: packetwrite failed\n");
+        if ( !InitScheduler(&_scheduler, _matches, _nmatches, nworkers, 1.0f / tick_rate_g) ) {
+            return false;
+        }
+    } else {
+        _poller = CreatePoller();
+        if ( !_poller.is_init ) {
+            fprintf(stderr, "CreatePoller failed: %s\n", GetNetError());
+            return false;
         }
     }
 
-    // Receive game state.
+    // Matches start right away. Players are seated as they connect, and can
+    // come back to their seat if they drop.
+    printf("Listening on port %s for %d matches\n", port, _nmatches);
 
-    BufferClear(&_net_buf);
-    if ( PacketRead(&_client, &_net_buf) ) {
-        // Deserialize:
-        BufferRead(&_net_buf, _players, sizeof(_players));
-        BufferRead(&_net_buf, &_nrings, sizeof(_nrings));
-        BufferRead(&_net_buf, _rings, sizeof(_rings));
-        BufferRead(&_net_buf, &_curr_sound, sizeof(_curr_sound));
-        BufferRead(&_net_buf, _sockets, sizeof(_sockets));
-        BufferRead(&_net_buf, &_disposal, sizeof(_disposal));
-    }
+    return true;
 }
 
-void UpdateGame(Action action, float dt)
+/// Seat new connections. A dedicated server hands each one to the worker
+/// that runs its match.
+static void UpdateConnections(void)
 {
-    RunTimer(&_key_timer, dt);
+    LobbyJoin joins[LOBBY_MAX_PENDING];
+    int count = UpdateLobby(&_lobby, joins, LOBBY_MAX_PENDING);
 
-    if ( session_g == SN_CLIENT ) {
-        ClientUpdate(action);
-    } else {
-        ServerUpdate(action, dt);
+    for ( int i = 0; i < count; i++ ) {
+        const LobbyJoin * join = &joins[i];
+        printf("Match %d: player %d connected.\n",
+               join->match_index + 1, join->player_index + 1);
+
+        if ( session_g == SN_DEDICATED ) {
+            SchedulerJoin(&_scheduler, join);
+            continue;
+        }
+
+        if ( !AddConnection(&_matches[join->match_index],
+                            join->player_index,
+                            join->socket,
+                            join->token,
+                            &_poller) ) {
+            fprintf(stderr, "Could not add player %d: %s\n",
+                    join->player_index + 1, GetNetError());
+        }
+        free(join->socket);
     }
 }
 
-#pragma mark - Init Functions
-
-bool InitServer(void)
+/// Connect and say hello with our session token, then wait for the server to
+/// seat us.
+/// - returns: `false` if the server couldn't be reached or turned us away.
+static bool ConnectToServer(void)
 {
-    SetWindowTitle("Server");
-    SetWindowPosition(0, 0);
+    _client = CreateClient(_server_ip, _server_port, transport_g);
 
-    Socket server = CreateServer("5555");
-    if ( !server.is_init ) {
-        fprintf(stderr, "CreateServer failed: %s", GetNetError());
+    if ( !_client.is_init ) {
+        fprintf(stderr, "CreateClient failed: %s\n", GetNetError());
         return false;
     }
 
-    // Wait for all clients to connect before starting
-    for ( int i = 1; i < nplayers_g; i++ ) {
-        printf("Waiting for player %d to connect...\n", i + 1);
+    u8 type = CM_HELLO;
+    BufferClear(&_net_buf);
+    BufferWrite(&_net_buf, &type, sizeof(type));
+    BufferWrite(&_net_buf, &_token, sizeof(_token));
+    PacketWrite(&_client, &_net_buf);
 
-        while ( !_connections[i].is_init ) {
-            if ( !AcceptConnection(&server, &_connections[i]) ) {
-                fprintf(stderr, "AcceptConnection failed: %s\n", GetNetError());
-                return false;
-            }
+    // Wait for the server to assign our player_index and send how many
+    // players there are.
+    BufferClear(&_net_buf);
+    double start = NetTime();
+    while ( !PacketRead(&_client, &_net_buf) ) {
+        bool is_timed_out = NetTime() - start > JOIN_TIMEOUT_SEC;
+
+        if ( _client.is_hungup || is_timed_out ) {
+            fprintf(stderr, "%s\n", is_timed_out
+                    ? "Server didn't seat us in time"
+                    : "Server turned us away");
+            CloseSocket(&_client);
+            _client.is_init = false;
+            return false;
         }
 
-        printf("Player %d connected.\n", i + i);
+        PacketFlush(&_client);
+        SDL_Delay(1);
     }
 
-    CloseSocket(&server);
+    BufferReader reader = MakeReader(_net_buf.data, _net_buf.size);
+    ReaderGet(&reader, &_player_idx);
+    ReaderGet(&reader, &nplayers_g);
+    ReaderGet(&reader, &_token);
+    u32 map_hash = 0;
+    ReaderGet(&reader, &map_hash);
+    BufferClear(&_net_buf);
 
-    // Send clients the number of players and their index
-    for ( int i = 1; i < nplayers_g; i++ ) {
-        NetWriteAll(&_connections[i], &i, sizeof(i));
-        NetWriteAll(&_connections[i], &nplayers_g, sizeof(nplayers_g));
+    if ( reader.is_overflow || nplayers_g < 1 || nplayers_g > MAX_PLAYERS ) {
+        fprintf(stderr, "Bad handshake from server\n");
+        exit(1);
+    }
+
+    if ( map_hash != map_g.hash ) {
+        fprintf(stderr, "The server is playing a different map (see -map)\n");
+        exit(1);
     }
 
+    printf("Connected as player %d\n", _player_idx);
+
     return true;
 }
 
@@ -955,74 +783,96 @@ void InitClient(const char * ip, const char * port)
     SetWindowTitle("Client");
     SetWindowPosition(_player_idx * (GAME_WIDTH / 2) * SCALE, 0);
 
-    _client = CreateClient(ip, port);
-
-    if ( !_client.is_init ) {
-        fprintf(stderr, "CreateClient failed: %s", GetNetError());
-        exit(1);
-    }
-
-    // Wait for the server to assign our player_index.
-    if ( !NetReadAll(&_client, &_player_idx, sizeof(_player_idx)) ) {
-        fprintf(stderr, "Could not read player index: %s\n", GetNetError());
-        exit(1);
-    }
+    _server_ip = ip;
+    _server_port = port;
 
-    // Wait for the server to send how many players there are.
-    if ( !NetReadAll(&_client, &nplayers_g, sizeof(nplayers_g)) ) {
-        fprintf(stderr, "Could not read number of players: %s\n", GetNetError());
+    if ( !ConnectToServer() ) {
         exit(1);
     }
-
-    printf("Connected as player %d\n", _player_idx);
 }
 
 bool InitGame(const char * ip, const char * port)
 {
     atexit(QuitGame);
     Randomize();
+    _cosmetic_rng = InitRng(Rand32());
     BufferInit(&_net_buf, 1024);
 
-    if ( session_g == SN_SERVER ) {
-        InitNetwork("log_server.txt");
-        if ( !InitServer() ) {
-            fprintf(stderr, "InitServer failed: %s\n", GetNetError());
-            return false;
-        }
-    } else if ( session_g == SN_CLIENT) {
+    _nmatches = session_g == SN_DEDICATED ? nmatches_g : 1;
+    _matches = (Match *)calloc(_nmatches, sizeof(*_matches));
+    if ( _matches == NULL ) {
+        fprintf(stderr, "Could not allocate %d matches\n", _nmatches);
+        return false;
+    }
+
+    for ( int i = 0; i < _nmatches; i++ ) {
+        _matches[i].has_local_player = session_g != SN_DEDICATED;
+    }
+
+    _state = &_matches[0].state;
+
+    if ( session_g == SN_CLIENT ) {
+        // The player count comes from the server.
         InitNetwork("log_client.txt");
         InitClient(ip, port);
+        InitMatch(_state, nplayers_g, 0);
+        return true;
     }
 
-    // Find player spawn spots.
-    int spawn_x[MAX_PLAYERS];
-    int spawn_y[MAX_PLAYERS];
+    for ( int i = 0; i < _nmatches; i++ ) {
+        u32 seed = Rand32();
+        InitMatch(&_matches[i].state, nplayers_g, seed);
 
-    for ( int y = 0; y < MAP_SIZE; y++ ) {
-        for ( int x = 0; x < MAP_SIZE; x++ ) {
-            char t = _tile_map[y][x];
-            if ( t >= '0' && t <= '3' ) {
-                spawn_x[t - '0'] = x;
-                spawn_y[t - '0'] = y;
-            }
+        if ( record_dir_g ) {
+            char path[1024];
+            snprintf(path, sizeof(path), "%s/%ld-%d.replay",
+                     record_dir_g, (long)time(NULL), i + 1);
+            OpenReplay(&_matches[i].replay, path, nplayers_g, 1.0f / tick_rate_g, seed);
         }
     }
 
-    // Init players
-    for ( int i = 0; i < nplayers_g; i++ ) {
-        _players[i].x = spawn_x[i];
-        _players[i].y = spawn_y[i];
-        _players[i].health = MAX_PLAYER_HEALTH;
+    if ( session_g == SN_SERVER || session_g == SN_DEDICATED ) {
+        InitNetwork("log_server.txt");
+        if ( !InitServer(port) ) {
+            fprintf(stderr, "InitServer failed: %s\n", GetNetError());
+            return false;
+        }
     }
 
-    _curr_state = GS_PLAY;
-
     return true;
 }
 
 #pragma mark -
 
-void DoFrame(float dt)
+/// Only sets a flag: worker 0 stops the server at its next tick. Another
+/// signal kills the process as usual, in case shutdown hangs.
+static void StopDedicatedServer(int sig)
+{
+    _is_stopping = 1;
+    signal(sig, SIG_DFL);
+}
+
+/// Worker 0's work, besides running matches.
+static void UpdateDedicatedServer(void)
+{
+    if ( _is_stopping ) {
+        is_running_g = false;
+        return;
+    }
+
+    UpdateConnections();
+}
+
+void RunDedicatedServer(void)
+{
+    signal(SIGINT, StopDedicatedServer);
+    signal(SIGTERM, StopDedicatedServer);
+
+    RunScheduler(&_scheduler, UpdateDedicatedServer);
+    printf("Server stopped.\n");
+}
+
+void DoTick(float dt)
 {
     SDL_Event event;
     while ( SDL_PollEvent(&event) ) {
@@ -1042,18 +892,102 @@ void DoFrame(float dt)
         }
     }
 
-    if ( _state_handlers[_curr_state].do_input) {
-        _state_handlers[_curr_state].do_input();
+    if ( _state_handlers[_state->game_state].do_input) {
+        _state_handlers[_state->game_state].do_input();
+    }
+
+    if ( _state_handlers[_state->game_state].update ) {
+        _state_handlers[_state->game_state].update(_curr_action, dt);
+    } else if ( rollback_g ) {
+        // Keep trading inputs after the match ends: the other peers need ours
+        // to get there too, and a late input may yet take the ending back.
+        UpdateGame(A_NONE, dt);
     }
+}
+
+/// Where `a` is drawn `t` of the way to `b`.
+static Player InterpolatePlayer(const Player * a, const Player * b, float t)
+{
+    Player result = t < 0.5f ? *a : *b;
+
+    int ax = a->x * TILE_SIZE + a->offx;
+    int ay = a->y * TILE_SIZE + a->offy;
+    int bx = b->x * TILE_SIZE + b->offx;
+    int by = b->y * TILE_SIZE + b->offy;
+
+    // A teleport or a wrap around the edge of the map: don't slide across.
+    if ( abs(bx - ax) > TILE_SIZE * 2 || abs(by - ay) > TILE_SIZE * 2 ) {
+        return result;
+    }
+
+    // Keep the tile from `b` and put the difference in the draw offset.
+    result.x = b->x;
+    result.y = b->y;
+    result.offx = (s8)(lroundf(Lerp(ax, bx, t)) - bx + b->offx);
+    result.offy = (s8)(lroundf(Lerp(ay, by, t)) - by + b->offy);
+
+    return result;
+}
+
+/// Show remote players a little in the past, between the snapshots on either
+/// side of the jitter buffer's render time, so late snapshots don't stutter.
+/// Our own player stays where we predicted it.
+static void InterpolateRemotePlayers(MatchState * view)
+{
+    double render_tick = JitterRenderTick(&_jitter, NetTime());
+    u32 tick = (u32)render_tick;
+
+    // The nearest snapshots on either side, skipping any that were lost.
+    const Snapshot * from = NULL;
+    const Snapshot * to = NULL;
+
+    for ( u32 i = 0; i < SNAPSHOT_HISTORY && i <= tick && from == NULL; i++ ) {
+        from = FindSnapshot(&_history, tick - i);
+    }
+
+    for ( u32 i = 1; i < SNAPSHOT_HISTORY && tick + i <= _tick && to == NULL; i++ ) {
+        to = FindSnapshot(&_history, tick + i);
+    }
+
+    if ( from == NULL || to == NULL ) {
+        // Nothing newer yet, or nothing older left: show what we have.
+        from = from ? from : to;
+        to = from;
+    }
+
+    if ( from == NULL ) {
+        return;
+    }
+
+    float t = 0.0f;
+    if ( to->tick != from->tick ) {
+        t = (float)((render_tick - from->tick) / (to->tick - from->tick));
+    }
+
+    for ( int i = 0; i < view->nplayers; i++ ) {
+        if ( i != _player_idx ) {
+            view->players[i] = InterpolatePlayer(&from->players[i],
+                                                 &to->players[i],
+                                                 t);
+        }
+    }
+}
+
+void DoRender(void)
+{
+    MatchState * state = _state;
 
-    if ( _state_handlers[_curr_state].update ) {
-        _state_handlers[_curr_state].update(_curr_action, dt);
+    if ( session_g == SN_CLIENT && !rollback_g ) {
+        _view = *_state;
+        InterpolateRemotePlayers(&_view);
+        _state = &_view;
     }
 
-    _state_handlers[_curr_state].render();
+    _state_handlers[_state->game_state].render();
+    _state = state;
 
-    if ( _curr_sound ) {
-        Play(_sounds[_curr_sound]);
-        _curr_sound = S_NONE; // Don't wait for the server to reset the sound.
+    if ( _state->sound ) {
+        Play(_sounds[_state->sound]);
+        _state->sound = S_NONE; // Don't wait for the server to reset the sound.
     }
 }
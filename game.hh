@@ -9,6 +9,7 @@
 #define game_hh
 
 #include "misc.hh"
+#include "net.hh"
 #include "video.hh"
 
 #define GAME_WIDTH 320
@@ -16,9 +17,11 @@
 #define SCALE 3
 
 #define TILE_SIZE (CHAR_WIDTH)
-#define MAP_SIZE 25
 #define MAX_PLAYERS 4
 #define MAX_PLAYER_HEALTH 5
+#define MAX_RINGS 4 // Number of rings that can appear at once
+#define NUM_SOCKETS_PER_PLAYER 3
+#define NUM_SOCKETS ((NUM_SOCKETS_PER_PLAYER) * (MAX_PLAYERS))
 
 typedef u8 Action;
 #define A_NONE         0x00
@@ -51,7 +54,8 @@ enum RingType {
 enum Session {
     SN_SINGLE_PLAYER,
     SN_SERVER,
-    SN_CLIENT
+    SN_CLIENT,
+    SN_DEDICATED, // Server with no local player, window or audio.
 };
 
 // TODO: order based on priority and write SetSound() that only sets a sound
@@ -85,8 +89,8 @@ struct Glyph {
 };
 
 struct Player {
-    s8 x;
-    s8 y;
+    s16 x;
+    s16 y;
     s8 offx; // Horizontal draw offset in pixels
     s8 offy; // Vertical draw offset in pixels
     s8 health;
@@ -102,8 +106,8 @@ struct Ranking {
 };
 
 struct Ring {
-    u8 x;
-    u8 y;
+    u16 x;
+    u16 y;
     u8 type;
     u8 unused;
 };
@@ -111,10 +115,26 @@ struct Ring {
 extern bool is_running_g;
 extern Session session_g;
 extern int nplayers_g;
+extern Transport transport_g;
+extern int nmatches_g; // Matches a dedicated server hosts.
+extern float tick_rate_g; // Simulation steps per second.
+extern float send_rate_g; // Server snapshots per second.
+extern int nthreads_g; // Dedicated server worker threads, 0: one per core.
+extern bool rollback_g; // Peers trade inputs and roll back (rollback.hh).
+extern const char * record_dir_g; // Where servers save replays, or NULL.
 
 bool InitGame(const char * ip, const char * port);
-bool InitServer(void);
+bool InitServer(const char * port);
 void InitClient(const char * ip, const char * port);
-void DoFrame(float dt);
+
+/// Run every match on worker threads until SIGINT or SIGTERM, or until
+/// `is_running_g` is cleared. Dedicated servers only.
+void RunDedicatedServer(void);
+
+/// Handle events and input, and run the simulation one fixed step.
+void DoTick(float dt);
+
+/// Draw the current state and play its sound.
+void DoRender(void);
 
 #endif /* game_hh */
@@ -0,0 +1,77 @@
+//
+//  jitter.cc
+//  NetTest2
+//
+
+#include "jitter.hh"
+#include "snapshot.hh"
+
+#define DEFAULT_INTERVAL (1.0 / 60.0)
+#define MIN_INTERVAL (1.0 / 240.0)
+#define MAX_INTERVAL 0.5
+#define MAX_DELAY 0.3
+#define JITTER_MARGIN 2.5 // The delay covers this many times the jitter.
+
+void JitterArrival(JitterBuffer * buffer, u32 tick, double now)
+{
+    // Start over on the first snapshot, or when the ticks jump back because
+    // we've reconnected to a restarted server.
+    if ( !buffer->is_init || tick + SNAPSHOT_HISTORY < buffer->last_tick ) {
+        buffer->interval = DEFAULT_INTERVAL;
+        buffer->base_tick = tick;
+        buffer->base_time = now;
+        buffer->jitter = 0.0;
+        buffer->delay = buffer->interval;
+        buffer->last_tick = tick;
+        buffer->last_arrival = now;
+        buffer->nsamples = 0;
+        buffer->is_init = true;
+        return;
+    }
+
+    if ( tick > buffer->last_tick ) {
+        double sample = (now - buffer->last_arrival) / (tick - buffer->last_tick);
+        sample = CLAMP(sample, MIN_INTERVAL, MAX_INTERVAL);
+        // Average the first few evenly, then smooth.
+        buffer->nsamples++;
+        double weight = max(1.0 / buffer->nsamples, 0.05);
+        buffer->interval += (sample - buffer->interval) * weight;
+        buffer->last_tick = tick;
+        buffer->last_arrival = now;
+    }
+
+    // Move the line to this tick. An early arrival means the line was too
+    // late. A late one nudges it later, slowly, to follow clock drift.
+    s32 ticks = (s32)(tick - buffer->base_tick);
+    double expected = buffer->base_time + ticks * buffer->interval;
+    double lateness = now - expected;
+
+    buffer->base_tick = tick;
+    buffer->base_time = expected + (lateness < 0.0 ? lateness : lateness * 0.01);
+    buffer->jitter += (max(lateness, 0.0) - buffer->jitter) * 0.1;
+
+    // Grow the delay at once when the link gets worse, so the next late
+    // snapshot is covered. Shrink it slowly when it gets better.
+    double target = buffer->interval + JITTER_MARGIN * buffer->jitter;
+
+    if ( target > buffer->delay ) {
+        buffer->delay = target;
+    } else {
+        buffer->delay += (target - buffer->delay) * 0.01;
+    }
+
+    buffer->delay = CLAMP(buffer->delay, buffer->interval, MAX_DELAY);
+}
+
+double JitterRenderTick(const JitterBuffer * buffer, double now)
+{
+    if ( !buffer->is_init ) {
+        return 0.0;
+    }
+
+    double render_time = now - buffer->delay;
+    double tick = buffer->base_tick
+        + (render_time - buffer->base_time) / buffer->interval;
+
+    return max(tick, 0.0);
+}
@@ -0,0 +1,42 @@
+//
+//  jitter.hh
+//  NetTest2
+//
+
+#ifndef jitter_hh
+#define jitter_hh
+
+#include "misc.hh"
+
+// Decides which moment of the server's timeline a client shows.
+//
+// Snapshots are numbered one per send, so the arrival times of the least
+// delayed ones trace a line through `base_tick` at `base_time`, rising by
+// `interval` per tick. Anything arriving later than that line was held up by
+// jitter. The client renders `delay` seconds behind the line, where `delay` is
+// a snapshot interval plus a margin for the jitter seen lately, so the
+// snapshots on either side of the render time have usually arrived. The delay
+// grows at once when the link gets worse and shrinks slowly when it gets
+// better.
+
+struct JitterBuffer {
+    double interval; // Seconds between snapshots.
+    u32 base_tick;
+    double base_time; // When `base_tick` arrived, or would have with no delay.
+    double jitter; // Smoothed lateness relative to the line, in seconds.
+    double delay; // How far behind the line to render, in seconds.
+
+    u32 last_tick;
+    double last_arrival;
+    int nsamples; // Intervals measured so far.
+    bool is_init;
+};
+
+/// Record that snapshot `tick` arrived at `now` (NetTime()).
+void JitterArrival(JitterBuffer * buffer, u32 tick, double now);
+
+/// - returns: The snapshot tick to show at `now`, with a fractional part for
+///   how far to interpolate toward the next one. 0 before any snapshot.
+double JitterRenderTick(const JitterBuffer * buffer, double now);
+
+#endif /* jitter_hh */
@@ -0,0 +1,263 @@
+//
+//  lobby.cc
+//  NetTest2
+//
+
+#include "lobby.hh"
+
+#include "match.hh"
+#include "packet.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+bool InitLobby(Lobby * lobby,
+               const char * port,
+               Transport transport,
+               int nmatches,
+               int nplayers,
+               int first_remote)
+{
+    lobby->nmatches = nmatches;
+    lobby->nplayers = nplayers;
+    lobby->first_remote = first_remote;
+    lobby->npending = 0;
+
+    lobby->tokens = (u64 *)calloc(nmatches * MAX_PLAYERS, sizeof(u64));
+    lobby->left_times = (double *)calloc(nmatches * MAX_PLAYERS, sizeof(double));
+    if ( lobby->tokens == NULL || lobby->left_times == NULL ) {
+        fprintf(stderr, "InitLobby: out of memory\n");
+        return false;
+    }
+
+    BufferInit(&lobby->buffer, 64);
+
+    lobby->server = CreateServer(port, transport);
+    if ( !lobby->server.is_init ) {
+        fprintf(stderr, "CreateServer failed: %s\n", GetNetError());
+        return false;
+    }
+
+    lobby->poller = CreatePoller();
+    if ( !lobby->poller.is_init ) {
+        fprintf(stderr, "CreatePoller failed: %s\n", GetNetError());
+        return false;
+    }
+
+    if ( !PollerAdd(&lobby->poller, &lobby->server) ) {
+        fprintf(stderr, "PollerAdd failed: %s\n", GetNetError());
+        return false;
+    }
+
+    // Anything already waiting was there before the poller started watching.
+    lobby->server.is_readable = true;
+
+    return true;
+}
+
+/// A token that can't be worked out from when the server started, since it
+/// lets whoever has it take the seat.
+/// - returns: 0 on error.
+static u64 NewToken(void)
+{
+    u64 token = 0;
+    while ( token == 0 ) {
+        if ( !NetRandomBytes(&token, sizeof(token)) ) {
+            fprintf(stderr, "NewToken failed: %s\n", GetNetError());
+            return 0;
+        }
+    }
+
+    return token;
+}
+
+/// Find the seat for `token`, or take a free one if it's 0. A seat is free if
+/// it never had a player, or its player left more than LOBBY_REJOIN_SEC ago.
+/// - returns: The seat's index in `tokens`, or -1 if there isn't one.
+static int FindSeat(Lobby * lobby, u64 * token, double now)
+{
+    // Read from the system before taking the lock, which matches need too.
+    u64 new_token = 0;
+    if ( *token == 0 ) {
+        new_token = NewToken();
+        if ( new_token == 0 ) {
+            return -1;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lobby->seats_lock);
+
+    for ( int m = 0; m < lobby->nmatches; m++ ) {
+        for ( int i = lobby->first_remote; i < lobby->nplayers; i++ ) {
+            int seat = m * MAX_PLAYERS + i;
+            double left_time = lobby->left_times[seat];
+            bool is_free = lobby->tokens[seat] == 0
+                || (left_time > 0.0 && now - left_time > LOBBY_REJOIN_SEC);
+
+            if ( *token == 0 && is_free ) {
+                *token = lobby->tokens[seat] = new_token;
+                lobby->left_times[seat] = 0.0;
+                return seat;
+            }
+
+            if ( *token != 0 && lobby->tokens[seat] == *token ) {
+                lobby->left_times[seat] = 0.0;
+                return seat;
+            }
+        }
+    }
+
+    return -1;
+}
+
+static void RemovePending(Lobby * lobby, int i)
+{
+    lobby->npending--;
+    lobby->pending[i] = lobby->pending[lobby->npending];
+    lobby->pending_times[i] = lobby->pending_times[lobby->npending];
+}
+
+static void DropPending(Lobby * lobby, int i)
+{
+    Socket * socket = lobby->pending[i];
+
+    PollerRemove(&lobby->poller, socket);
+    CloseSocket(socket);
+    free(socket);
+    RemovePending(lobby, i);
+}
+
+// Take connections off the listen queue until it's empty.
+static void AcceptAll(Lobby * lobby)
+{
+    while ( lobby->server.is_readable && lobby->npending < LOBBY_MAX_PENDING ) {
+        Socket * socket = (Socket *)calloc(1, sizeof(*socket));
+        if ( socket == NULL ) {
+            fprintf(stderr, "AcceptAll: out of memory\n");
+            return;
+        }
+
+        if ( !AcceptConnection(&lobby->server, socket) ) {
+            fprintf(stderr, "AcceptConnection failed: %s\n", GetNetError());
+            free(socket);
+            return;
+        }
+
+        if ( !socket->is_init ) {
+            lobby->server.is_readable = false; // Drained.
+            free(socket);
+            return;
+        }
+
+        if ( !PollerAdd(&lobby->poller, socket) ) {
+            fprintf(stderr, "PollerAdd failed: %s\n", GetNetError());
+            CloseSocket(socket);
+            free(socket);
+            continue;
+        }
+
+        socket->is_readable = true; // It may have sent its hello already.
+        lobby->pending[lobby->npending] = socket;
+        lobby->pending_times[lobby->npending] = NetTime();
+        lobby->npending++;
+    }
+}
+
+int UpdateLobby(Lobby * lobby, LobbyJoin * joins, int max_joins)
+{
+    NetEvent events[NET_MAX_EVENTS];
+    int count;
+    do {
+        count = PollerWait(&lobby->poller, events, NET_MAX_EVENTS, 0);
+        if ( count == -1 ) {
+            fprintf(stderr, "UpdateLobby: PollerWait failed: %s\n", GetNetError());
+        }
+    } while ( count == NET_MAX_EVENTS );
+
+    AcceptAll(lobby);
+
+    int njoins = 0;
+    double now = NetTime();
+
+    for ( int i = lobby->npending - 1; i >= 0 && njoins < max_joins; i-- ) {
+        Socket * socket = lobby->pending[i];
+
+        BufferClear(&lobby->buffer);
+        if ( !PacketRead(socket, &lobby->buffer) ) {
+            if ( socket->is_hungup
+                || now - lobby->pending_times[i] > LOBBY_HELLO_TIMEOUT_SEC ) {
+                DropPending(lobby, i);
+            }
+            continue;
+        }
+
+        BufferReader reader = MakeReader(lobby->buffer.data, lobby->buffer.size);
+        u8 type = 0;
+        u64 token = 0;
+        ReaderGet(&reader, &type);
+        ReaderGet(&reader, &token);
+
+        if ( reader.is_overflow || type != CM_HELLO ) {
+            fprintf(stderr, "Turned away a client: bad hello\n");
+            DropPending(lobby, i);
+            continue;
+        }
+
+        int seat = FindSeat(lobby, &token, now);
+        if ( seat == -1 ) {
+            fprintf(stderr, "Turned away a client: %s\n",
+                    token ? "unknown session" : "no free seats");
+            DropPending(lobby, i);
+            continue;
+        }
+
+        // The socket is about to move into a match, which polls it at its
+        // new address.
+        PollerRemove(&lobby->poller, socket);
+        RemovePending(lobby, i);
+
+        LobbyJoin * join = &joins[njoins++];
+        join->socket = socket;
+        join->match_index = seat / MAX_PLAYERS;
+        join->player_index = seat % MAX_PLAYERS;
+        join->token = token;
+    }
+
+    return njoins;
+}
+
+void ReleaseSeat(Lobby * lobby, int match_index, int player_index)
+{
+    std::lock_guard<std::mutex> guard(lobby->seats_lock);
+    lobby->left_times[match_index * MAX_PLAYERS + player_index] = NetTime();
+}
+
+void OccupySeat(Lobby * lobby, int match_index, int player_index)
+{
+    std::lock_guard<std::mutex> guard(lobby->seats_lock);
+    lobby->left_times[match_index * MAX_PLAYERS + player_index] = 0.0;
+}
+
+void CloseLobby(Lobby * lobby)
+{
+    while ( lobby->npending > 0 ) {
+        DropPending(lobby, lobby->npending - 1);
+    }
+
+    if ( lobby->server.is_init ) {
+        CloseSocket(&lobby->server);
+        lobby->server.is_init = false;
+    }
+
+    if ( lobby->poller.is_init ) {
+        ClosePoller(&lobby->poller);
+        lobby->poller.is_init = false;
+    }
+
+    free(lobby->tokens);
+    lobby->tokens = NULL;
+    free(lobby->left_times);
+    lobby->left_times = NULL;
+    free(lobby->buffer.data);
+    lobby->buffer.data = NULL;
+}
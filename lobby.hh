@@ -0,0 +1,79 @@
+//
+//  lobby.hh
+//  NetTest2
+//
+
+#ifndef lobby_hh
+#define lobby_hh
+
+#include "buffer.hh"
+#include "net.hh"
+
+#include <mutex>
+
+// Accepts connections without blocking and seats them in matches.
+//
+// A new connection must send CM_HELLO with a session token within
+// LOBBY_HELLO_TIMEOUT_SEC. A token of 0 asks for the first free seat in any
+// match, which is then reserved for a freshly made token. A known token puts
+// the client back in the seat it had, replacing the old connection if the
+// server hasn't noticed it's gone yet. Matches run from the start, so players
+// can join late; the match sends the welcome when it takes the connection.
+//
+// When a match closes a player's connection it gives the seat back. The old
+// token can still reclaim it for LOBBY_REJOIN_SEC, after which it goes to
+// the next client that asks for a free seat.
+
+#define LOBBY_MAX_PENDING 64 // Connections that haven't said hello yet.
+#define LOBBY_HELLO_TIMEOUT_SEC 5.0
+#define LOBBY_REJOIN_SEC 30.0
+
+/// A connection that has been given a seat.
+struct LobbyJoin {
+    Socket * socket; // Allocated with malloc. The receiver takes ownership.
+    int match_index;
+    int player_index;
+    u64 token;
+};
+
+struct Lobby {
+    Socket server;
+    Poller poller; // The server socket and pending connections.
+
+    Socket * pending[LOBBY_MAX_PENDING];
+    double pending_times[LOBBY_MAX_PENDING]; // When each was accepted.
+    int npending;
+
+    int nmatches;
+    int nplayers;
+    int first_remote; // Seats before this are played on the server.
+    u64 * tokens; // nmatches * MAX_PLAYERS seats, 0 if free.
+    double * left_times; // When each seat's player left, 0 while it's taken.
+    std::mutex seats_lock; // Matches give seats back from their own threads.
+
+    Buffer buffer;
+};
+
+/// Start listening on `port`.
+/// - returns: `false` on error.
+bool InitLobby(Lobby * lobby,
+               const char * port,
+               Transport transport,
+               int nmatches,
+               int nplayers,
+               int first_remote);
+
+/// Accept every waiting connection and read hellos. Doesn't block.
+/// - returns: The number of connections seated, written to `joins`.
+int UpdateLobby(Lobby * lobby, LobbyJoin * joins, int max_joins);
+
+/// Give back a seat whose connection was closed. Any thread may call this.
+void ReleaseSeat(Lobby * lobby, int match_index, int player_index);
+
+/// Mark a seat as taken again, once its match has the new connection. Any
+/// thread may call this.
+void OccupySeat(Lobby * lobby, int match_index, int player_index);
+
+void CloseLobby(Lobby * lobby);
+
+#endif /* lobby_hh */
@@ -7,16 +7,34 @@
 
 #include "beeper.hh"
 #include "game.hh"
+#include "map.hh"
 #include "net.hh"
+#include "udp.hh"
 #include "video.hh"
 
 static const char * program_name;
+static float render_rate; // 0 means every display refresh.
 
 static int ArgumentError(const char * message)
 {
     puts(message);
-    printf("usage: %s -s [port] [player count (1-4)]\n", program_name);
-    printf("usage: %s -c [IP] [port]\n", program_name);
+    printf("usage: %s -s [port] [player count (1-4)] [options]\n", program_name);
+    printf("usage: %s -c [IP] [port] [options]\n", program_name);
+    printf("usage: %s -d [port] [player count (1-4)] [options]\n", program_name);
+    printf("options:\n");
+    printf("  -udp          use UDP instead of TCP (server and clients must match)\n");
+    printf("  -loss [pct]   drop this percent of outgoing UDP datagrams\n");
+    printf("  -tick [hz]    simulation rate (default 60)\n");
+    printf("  -send [hz]    server snapshot rate (default: tick rate)\n");
+    printf("  -render [hz]  render rate (default: display refresh)\n");
+    printf("  -matches [n]  matches a dedicated server hosts (default 1)\n");
+    printf("  -threads [n]  dedicated server worker threads (default: one per core)\n");
+    printf("  -rollback     trade inputs and roll back instead of sending snapshots\n");
+    printf("                (server and clients must match, not with -d)\n");
+    printf("  -record [dir] servers save a replay of each match in dir\n");
+    printf("  -map [file]   play on the map in this text file, up to %d x %d\n",
+           MAP_MAX_SIZE, MAP_MAX_SIZE);
+    printf("                (server and clients must match)\n");
     
     return EXIT_FAILURE;
 }
@@ -34,12 +52,12 @@ int main(int argc, char ** argv)
         nplayers_g = 2; // Single player testing
         session_g = SN_SINGLE_PLAYER;
 #endif
-    } else if ( argc == 4 ) {
-        if ( strcmp(argv[1], "-s") == 0 ) {
-            session_g = SN_SERVER;
+    } else if ( argc >= 4 ) {
+        if ( strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "-d") == 0 ) {
+            session_g = argv[1][1] == 'd' ? SN_DEDICATED : SN_SERVER;
             port = argv[2];
             nplayers_g = atoi(argv[3]);
-            if ( nplayers_g == 0 ) {
+            if ( nplayers_g < 1 || nplayers_g > MAX_PLAYERS ) {
                 return ArgumentError("Invalid player count (expected 1-4)\n");
             }
         } else if ( strcmp(argv[1], "-c") == 0 ) {
@@ -47,39 +65,127 @@ int main(int argc, char ** argv)
             ip = argv[2];
             port = argv[3];
         } else {
-            return ArgumentError("Expected -s or -c");
+            return ArgumentError("Expected -s, -c or -d");
+        }
+
+        bool has_send_rate = false;
+
+        for ( int i = 4; i < argc; i++ ) {
+            if ( strcmp(argv[i], "-udp") == 0 ) {
+                transport_g = TRANSPORT_UDP;
+            } else if ( strcmp(argv[i], "-loss") == 0 && i + 1 < argc ) {
+                UdpSimulateLoss(atof(argv[++i]) / 100.0f);
+            } else if ( strcmp(argv[i], "-tick") == 0 && i + 1 < argc ) {
+                tick_rate_g = atof(argv[++i]);
+            } else if ( strcmp(argv[i], "-send") == 0 && i + 1 < argc ) {
+                send_rate_g = atof(argv[++i]);
+                has_send_rate = true;
+            } else if ( strcmp(argv[i], "-render") == 0 && i + 1 < argc ) {
+                render_rate = atof(argv[++i]);
+            } else if ( strcmp(argv[i], "-matches") == 0 && i + 1 < argc ) {
+                nmatches_g = atoi(argv[++i]);
+                if ( nmatches_g < 1 ) {
+                    return ArgumentError("Invalid match count");
+                }
+            } else if ( strcmp(argv[i], "-threads") == 0 && i + 1 < argc ) {
+                nthreads_g = atoi(argv[++i]);
+                if ( nthreads_g < 1 ) {
+                    return ArgumentError("Invalid thread count");
+                }
+            } else if ( strcmp(argv[i], "-rollback") == 0 ) {
+                rollback_g = true;
+            } else if ( strcmp(argv[i], "-record") == 0 && i + 1 < argc ) {
+                record_dir_g = argv[++i];
+            } else if ( strcmp(argv[i], "-map") == 0 && i + 1 < argc ) {
+                if ( !LoadMap(&map_g, argv[++i]) ) {
+                    return EXIT_FAILURE;
+                }
+            } else {
+                return ArgumentError("Unknown option");
+            }
+        }
+
+        if ( rollback_g && session_g == SN_DEDICATED ) {
+            return ArgumentError("Rollback needs a hosting player");
+        }
+
+        if ( record_dir_g && (rollback_g || session_g == SN_CLIENT) ) {
+            // A rollback host picks the seed when the match starts.
+            return ArgumentError("Only snapshot servers record replays");
+        }
+
+        if ( !has_send_rate ) {
+            send_rate_g = tick_rate_g;
+        }
+
+        if ( tick_rate_g <= 0.0f || send_rate_g <= 0.0f || render_rate < 0.0f ) {
+            return ArgumentError("Rates must be positive");
         }
     } else {
         return ArgumentError("Bad arguments");
     }
 
-    InitVideo(GAME_WIDTH, GAME_HEIGHT, SCALE);
-    SDL_Delay(1000); // This stops weird errors from happening
-    InitBeeper();
+    // A dedicated server has no window or audio device.
+    bool is_headless = session_g == SN_DEDICATED;
+
+    if ( !is_headless ) {
+        InitVideo(GAME_WIDTH, GAME_HEIGHT, SCALE);
+        SDL_Delay(1000); // This stops weird errors from happening
+        InitBeeper();
+    }
 
     if ( !InitGame(ip, port) ) {
         return EXIT_FAILURE;
     }
 
+    if ( is_headless ) {
+        RunDedicatedServer();
+        return 0;
+    }
+
+    // The simulation always advances in steps of exactly tick_sec, however
+    // often the loop runs. Rendering runs on its own clock, or every pass
+    // when it's paced by vsync.
     u64 frequency = SDL_GetPerformanceFrequency();
     u64 last = SDL_GetPerformanceCounter();
-    float target_frame_sec = 1.0f / 60.0f;
+    float tick_sec = 1.0f / tick_rate_g;
+    float render_sec = render_rate > 0.0f ? 1.0f / render_rate : 0.0f;
+    float tick_accumulator = 0.0f;
+    float render_accumulator = 0.0f;
 
     while ( is_running_g ) {
         u64 now = SDL_GetPerformanceCounter();
-        float dt = ((float)(now - last) / (float)frequency);
+        float elapsed = ((float)(now - last) / (float)frequency);
+        last = now;
 
-        if ( dt > 0.05f ) {
-            dt = 0.05f;
-        } else if ( dt < target_frame_sec ) {
-            SDL_Delay(1);
-            continue;
+        // After a stall, drop the lost time rather than run a burst of ticks.
+        if ( elapsed > 0.25f ) {
+            elapsed = 0.25f;
         }
 
-        dt = target_frame_sec;
-        last = now;
+        tick_accumulator += elapsed;
+        render_accumulator += elapsed;
+
+        bool did_work = false;
 
-        DoFrame(dt);
+        while ( tick_accumulator >= tick_sec && is_running_g ) {
+            DoTick(tick_sec);
+            tick_accumulator -= tick_sec;
+            did_work = true;
+        }
+
+        if ( render_accumulator >= render_sec ) {
+            DoRender();
+            render_accumulator -= render_sec;
+            if ( render_accumulator > render_sec ) {
+                render_accumulator = 0.0f;
+            }
+            did_work = true;
+        }
+
+        if ( !did_work ) {
+            SDL_Delay(1);
+        }
     }
 
     return 0;
@@ -0,0 +1,391 @@
+//
+//  map.cc
+//  NetTest2
+//
+
+#include "map.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUILT_IN_SIZE 25
+
+static const char _built_in_tiles[BUILT_IN_SIZE][BUILT_IN_SIZE + 1] = {
+    "XVXXXXX...XXVVX...XXXXXXX",
+    "XsSSSSS...SXVsS...SSSSSSX",
+    "V..........SsX..........X",
+    "X..A.........S.......C..X",
+    "X.aSc....XGW........gSi.X",
+    "X..b...XGXGWG..XVX...h..X",
+    "X.....0XWSWWG..SsV2.....X",
+    "S....XXXWWWG.....sXX....S",
+    ".....VSSGGG.......SX.....",
+    ".....XT...........TX.....",
+    "X....S.......W.....S....X",
+    "XX.......G.GWW.........XX",
+    "XX.......GGWWWW........XX",
+    "XS......GGGoWW.........XX",
+    "X........GYGGGG........SX",
+    "S....X...GGGYG.....X....S",
+    ".....XT....GG.....TX.....",
+    ".....XXX.........VXS.....",
+    "X....SSX........GVS.....X",
+    "X.....3XXX.....VXX1.....X",
+    "X..D...SSS.....sSS...B..X",
+    "X.jSl.......LL......dSf.X",
+    "X..k.......LLLL......e..X",
+    "X..........XXXLL........X",
+    "XXXXXXX...XXXXX...XXXXXXX",
+};
+
+static Map BuiltInMap(void);
+
+Map map_g = BuiltInMap();
+
+// -----------------------------------------------------------------------------
+#pragma mark - Compiling
+
+static bool IsWalkableTile(char tile)
+{
+    switch ( tile ) {
+        case '.': // Empty
+        case '0': case '1': case '2': case '3': // Player spawn platforms
+        case 'a': case 'b': case 'c': // Player 1 Ring sockets
+        case 'd': case 'e': case 'f': // Player 2 Ring sockets
+        case 'g': case 'h': case 'i': // Player 3 Ring sockets
+        case 'j': case 'k': case 'l': // Player 4 Ring sockets
+        case 'G': // Grass
+        case 'o': // Ring Disposer
+        case 'T': // Teleporter
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int PopCount(u64 bits)
+{
+    bits = bits - ((bits >> 1) & 0x5555555555555555ull);
+    bits = (bits & 0x3333333333333333ull) + ((bits >> 2) & 0x3333333333333333ull);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((bits * 0x0101010101010101ull) >> 56);
+}
+
+static u32 HashTiles(const Map * map)
+{
+    u32 hash = 2166136261u;
+    const u8 * bytes[3] = {
+        (const u8 *)&map->width, (const u8 *)&map->height, (const u8 *)map->tiles
+    };
+    size_t sizes[3] = { sizeof(map->width), sizeof(map->height), (size_t)map->ncells };
+
+    for ( int i = 0; i < 3; i++ ) {
+        for ( size_t j = 0; j < sizes[i]; j++ ) {
+            hash = (hash ^ bytes[i][j]) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+/// Fill in everything but the tiles, which are already in place.
+/// - returns: `false` if the map can't be played on.
+static bool CompileMap(Map * map, const char * name)
+{
+    int nwords = (map->ncells + 63) / 64;
+
+    map->walkable = (u64 *)calloc(nwords, sizeof(u64));
+    map->open = (u64 *)calloc(nwords, sizeof(u64));
+    map->open_before = (u32 *)calloc(nwords, sizeof(u32));
+
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        map->spawn_x[i] = -1;
+        map->spawn_y[i] = -1;
+    }
+
+    for ( int cell = 0; cell < map->ncells; cell++ ) {
+        char tile = map->tiles[cell];
+        u64 bit = (u64)1 << (cell % 64);
+
+        if ( tile >= '0' && tile < '0' + MAX_PLAYERS ) {
+            map->spawn_x[tile - '0'] = CellX(map, cell);
+            map->spawn_y[tile - '0'] = CellY(map, cell);
+        }
+
+        if ( tile == 'T' ) {
+            map->nteleporters++;
+        }
+
+        if ( IsWalkableTile(tile) ) {
+            map->walkable[cell / 64] |= bit;
+        }
+
+        if ( tile == '.' || tile == 'G' ) {
+            map->open[cell / 64] |= bit;
+            map->nopen++;
+        }
+    }
+
+    for ( int w = 1; w < nwords; w++ ) {
+        map->open_before[w] = map->open_before[w - 1] + PopCount(map->open[w - 1]);
+    }
+
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        if ( map->spawn_x[i] == -1 ) {
+            fprintf(stderr, "%s: no spawn platform for player %d\n", name, i + 1);
+            return false;
+        }
+    }
+
+    if ( map->nopen <= MAX_PLAYERS + MAX_RINGS ) {
+        fprintf(stderr,
+                "%s: needs more than %d empty or grass tiles\n",
+                name,
+                MAX_PLAYERS + MAX_RINGS);
+        return false;
+    }
+
+    int nteleporters = 0;
+    map->teleporters = (u32 *)malloc((map->nteleporters + 1) * sizeof(u32));
+    map->teleporter_dests = (u32 *)malloc((map->nteleporters + 1) * sizeof(u32));
+
+    for ( int cell = 0; cell < map->ncells; cell++ ) {
+        if ( map->tiles[cell] == 'T' ) {
+            map->teleporters[nteleporters++] = cell;
+        }
+    }
+
+    // A teleporter sends players to the first one in neither its row nor its
+    // column, or nowhere if there isn't one.
+    for ( int i = 0; i < map->nteleporters; i++ ) {
+        int from_x = CellX(map, map->teleporters[i]);
+        int from_y = CellY(map, map->teleporters[i]);
+
+        map->teleporter_dests[i] = map->teleporters[i];
+        for ( int j = 0; j < map->nteleporters; j++ ) {
+            if ( CellX(map, map->teleporters[j]) != from_x
+                && CellY(map, map->teleporters[j]) != from_y )
+            {
+                map->teleporter_dests[i] = map->teleporters[j];
+                break;
+            }
+        }
+    }
+
+    map->hash = HashTiles(map);
+
+    return true;
+}
+
+/// Make a map from `height` rows of `width` tiles. The unused part of the
+/// chunks along the right and bottom edges is filled with blocking tiles.
+/// - returns: `false` if the map can't be played on.
+static bool BuildMap(Map * map,
+                     const char * const * rows,
+                     int width,
+                     int height,
+                     const char * name)
+{
+    memset(map, 0, sizeof(*map));
+
+    if ( width < 1 || height < 1 || width > MAP_MAX_SIZE || height > MAP_MAX_SIZE ) {
+        fprintf(stderr,
+                "%s: %d x %d tiles is outside 1 x 1 to %d x %d\n",
+                name,
+                width,
+                height,
+                MAP_MAX_SIZE,
+                MAP_MAX_SIZE);
+        return false;
+    }
+
+    int chunks_high = (height + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+
+    map->width = width;
+    map->height = height;
+    map->chunks_wide = (width + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+    map->ncells = map->chunks_wide * chunks_high * MAP_CHUNK_SIZE * MAP_CHUNK_SIZE;
+    map->tiles = (char *)malloc(map->ncells);
+    memset(map->tiles, ' ', map->ncells);
+
+    for ( int y = 0; y < height; y++ ) {
+        for ( int x = 0; x < width; x++ ) {
+            map->tiles[MapCell(map, x, y)] = rows[y][x];
+        }
+    }
+
+    if ( !CompileMap(map, name) ) {
+        FreeMap(map);
+        return false;
+    }
+
+    return true;
+}
+
+static Map BuiltInMap(void)
+{
+    const char * rows[BUILT_IN_SIZE];
+    for ( int y = 0; y < BUILT_IN_SIZE; y++ ) {
+        rows[y] = _built_in_tiles[y];
+    }
+
+    Map map;
+    if ( !BuildMap(&map, rows, BUILT_IN_SIZE, BUILT_IN_SIZE, "built-in map") ) {
+        abort();
+    }
+
+    return map;
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark -
+
+bool LoadMap(Map * map, const char * path)
+{
+    FILE * file = fopen(path, "rb");
+    if ( file == NULL ) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if ( size < 0 || size > (long)(MAP_MAX_SIZE + 2) * MAP_MAX_SIZE ) {
+        fprintf(stderr, "%s is too large to be a map\n", path);
+        fclose(file);
+        return false;
+    }
+
+    char * text = (char *)malloc(size + 1);
+    size = fread(text, 1, size, file);
+    text[size] = '\0';
+    fclose(file);
+
+    // Split it into rows in place, dropping any '\r' and blank lines at the end.
+    const char ** rows = (const char **)malloc((size + 1) * sizeof(*rows));
+    int nrows = 0;
+    int width = 0;
+    bool ok = true;
+
+    for ( char * line = text; *line && ok; ) {
+        char * end = strchr(line, '\n');
+        char * next = end ? end + 1 : line + strlen(line);
+        if ( end == NULL ) {
+            end = next;
+        }
+
+        if ( end > line && end[-1] == '\r' ) {
+            end--;
+        }
+        *end = '\0';
+
+        int length = (int)(end - line);
+        if ( nrows == 0 ) {
+            width = length;
+        } else if ( length != width && length != 0 ) {
+            fprintf(stderr, "%s: row %d isn't %d tiles long\n", path, nrows + 1, width);
+            ok = false;
+        }
+
+        rows[nrows++] = line;
+        line = next;
+    }
+
+    while ( nrows > 0 && rows[nrows - 1][0] == '\0' ) {
+        nrows--;
+    }
+
+    for ( int y = 0; y < nrows && ok; y++ ) {
+        if ( rows[y][0] == '\0' ) {
+            fprintf(stderr, "%s: row %d is empty\n", path, y + 1);
+            ok = false;
+        }
+    }
+
+    Map loaded;
+    if ( ok ) {
+        ok = BuildMap(&loaded, rows, width, nrows, path);
+    }
+
+    free(rows);
+    free(text);
+
+    if ( ok ) {
+        FreeMap(map);
+        *map = loaded;
+    }
+
+    return ok;
+}
+
+void FreeMap(Map * map)
+{
+    free(map->tiles);
+    free(map->teleporters);
+    free(map->teleporter_dests);
+    free(map->walkable);
+    free(map->open);
+    free(map->open_before);
+    memset(map, 0, sizeof(*map));
+}
+
+int OpenIndex(const Map * map, int cell)
+{
+    u64 word = map->open[cell / 64];
+    u64 bit = (u64)1 << (cell % 64);
+
+    if ( (word & bit) == 0 ) {
+        return -1;
+    }
+
+    return map->open_before[cell / 64] + PopCount(word & (bit - 1));
+}
+
+int OpenCell(const Map * map, int index)
+{
+    // The last word with no more than `index` open cells before it.
+    int lo = 0;
+    int hi = (map->ncells + 63) / 64 - 1;
+    while ( lo < hi ) {
+        int mid = (lo + hi + 1) / 2;
+        if ( map->open_before[mid] <= (u32)index ) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    u64 word = map->open[lo];
+    for ( int i = map->open_before[lo]; i < index; i++ ) {
+        word &= word - 1; // Clear the lowest bit.
+    }
+
+    int bit = 0;
+    while ( (word & ((u64)1 << bit)) == 0 ) {
+        bit++;
+    }
+
+    return lo * 64 + bit;
+}
+
+int TeleporterDest(const Map * map, int cell)
+{
+    int lo = 0;
+    int hi = map->nteleporters - 1;
+
+    while ( lo <= hi ) {
+        int mid = (lo + hi) / 2;
+        if ( map->teleporters[mid] == (u32)cell ) {
+            return map->teleporter_dests[mid];
+        } else if ( map->teleporters[mid] < (u32)cell ) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,110 @@
+//
+//  map.hh
+//  NetTest2
+//
+
+#ifndef map_hh
+#define map_hh
+
+#include "game.hh"
+
+// A tile map, chosen at runtime and loaded once, before any match starts.
+//
+// Tiles are stored in square chunks of MAP_CHUNK_SIZE, each one contiguous, so
+// tiles that are near each other on the map are near each other in memory.
+// A cell is a tile's index in that storage. Everything the simulation looks
+// up per cell is indexed by it, and cell order is the order in which ring
+// spawns and teleporter links are worked out.
+//
+// The file format is one line of tiles per row, all the same length:
+//
+//   '.' empty         'G' grass        'W' wall (no bump)   'o' ring disposer
+//   '0'-'3' spawns    'a'-'l' sockets  'T' teleporter       anything else blocks
+
+#define MAP_MAX_SIZE 1024 // Most tiles across or down.
+#define MAP_COORD_BITS 10 // Enough for 0 to MAP_MAX_SIZE - 1.
+#define MAP_CHUNK_SHIFT 4
+#define MAP_CHUNK_SIZE (1 << MAP_CHUNK_SHIFT) // Tiles across a chunk.
+#define MAP_CHUNK_MASK (MAP_CHUNK_SIZE - 1)
+
+static_assert(MAP_MAX_SIZE <= (1 << MAP_COORD_BITS), "map coordinates don't fit");
+
+struct Map {
+    int width;
+    int height;
+    int chunks_wide;
+    int ncells; // Including the unused part of chunks on the right and bottom.
+    char * tiles; // By cell.
+    u32 hash; // Of the size and tiles, to check that peers have the same map.
+
+    // Worked out when the map is loaded, so nothing has to scan the tiles
+    // while a match runs.
+    s16 spawn_x[MAX_PLAYERS];
+    s16 spawn_y[MAX_PLAYERS];
+
+    int nteleporters;
+    u32 * teleporters; // Cells, in order.
+    u32 * teleporter_dests; // Where each one sends a player.
+
+    u64 * walkable; // Bit per cell: can be stepped onto.
+
+    // Bit per cell: a ring can spawn here. And the number of such cells in
+    // all the words before each word, for finding the nth one.
+    int nopen;
+    u64 * open;
+    u32 * open_before;
+};
+
+/// The map every match is played on. Starts as the built-in map.
+extern Map map_g;
+
+/// Replace `map` with the one in the text file at `path`.
+/// - returns: `false` if it can't be read or isn't a usable map, in which
+///   case `map` is left alone.
+bool LoadMap(Map * map, const char * path);
+
+void FreeMap(Map * map);
+
+inline int MapCell(const Map * map, int x, int y)
+{
+    int chunk = (y >> MAP_CHUNK_SHIFT) * map->chunks_wide + (x >> MAP_CHUNK_SHIFT);
+    return (chunk << (MAP_CHUNK_SHIFT * 2))
+        + ((y & MAP_CHUNK_MASK) << MAP_CHUNK_SHIFT)
+        + (x & MAP_CHUNK_MASK);
+}
+
+inline int CellX(const Map * map, int cell)
+{
+    int chunk = cell >> (MAP_CHUNK_SHIFT * 2);
+    return (chunk % map->chunks_wide) * MAP_CHUNK_SIZE + (cell & MAP_CHUNK_MASK);
+}
+
+inline int CellY(const Map * map, int cell)
+{
+    int chunk = cell >> (MAP_CHUNK_SHIFT * 2);
+    return (chunk / map->chunks_wide) * MAP_CHUNK_SIZE
+        + ((cell >> MAP_CHUNK_SHIFT) & MAP_CHUNK_MASK);
+}
+
+inline char MapTile(const Map * map, int x, int y)
+{
+    return map->tiles[MapCell(map, x, y)];
+}
+
+inline bool IsWalkable(const Map * map, int cell)
+{
+    return (map->walkable[cell / 64] >> (cell % 64)) & 1;
+}
+
+/// - returns: `cell`'s place among the cells a ring can spawn on, or -1 if
+///   it isn't one.
+int OpenIndex(const Map * map, int cell);
+
+/// - returns: The cell at `index` among those a ring can spawn on.
+int OpenCell(const Map * map, int index);
+
+/// - returns: Where the teleporter on `cell` sends a player, which is `cell`
+///   itself if it goes nowhere, or -1 if there isn't one.
+int TeleporterDest(const Map * map, int cell);
+
+#endif /* map_hh */
@@ -0,0 +1,907 @@
+//
+//  match.cc
+//  NetTest2
+//
+
+#include "match.hh"
+
+#include "buffer.hh"
+#include "lobby.hh"
+#include "packet.hh"
+
+#include <stdio.h>
+#include <string.h>
+
+// -----------------------------------------------------------------------------
+// Constants
+
+// The ring that matches each player's color.
+static const u8 _player_rings[MAX_PLAYERS] = {
+    RING_WHITE,
+    RING_MAGENTA,
+    RING_GREEN,
+    RING_CYAN,
+};
+
+static thread_local PacketBatch _batch;
+
+static void TryMovePlayer(MatchState * state, Player * player, int x, int y);
+
+// -----------------------------------------------------------------------------
+#pragma mark - Occupancy
+
+// Players on the same cell are listed in order of index, so a lookup finds the
+// one a search of the players array would.
+
+static u32 OccupantSlot(int cell)
+{
+    return ((u32)cell * 2654435769u) >> (32 - OCCUPANT_BITS);
+}
+
+/// - returns: What's on `cell`, or `NULL` if there's nothing there and `add`
+///   is `false`.
+static Occupant * GetOccupant(MatchState * state, int cell, bool add)
+{
+    // The table is never more than half full, so there's always a gap.
+    for ( u32 i = OccupantSlot(cell); ; i = (i + 1) % OCCUPANT_SLOTS ) {
+        Occupant * occupant = &state->occupants[i];
+
+        if ( occupant->cell == (u32)cell + 1 ) {
+            return occupant;
+        }
+
+        if ( occupant->cell == 0 ) {
+            if ( !add ) {
+                return NULL;
+            }
+            occupant->cell = cell + 1;
+            return occupant;
+        }
+    }
+}
+
+/// Free `occupant`'s slot if nothing's left on its cell, moving back any
+/// entries that probed past it.
+static void TidyOccupant(MatchState * state, Occupant * occupant)
+{
+    if ( occupant->player || occupant->ring ) {
+        return;
+    }
+
+    u32 hole = (u32)(occupant - state->occupants);
+    u32 i = (hole + 1) % OCCUPANT_SLOTS;
+
+    while ( state->occupants[i].cell ) {
+        u32 home = OccupantSlot(state->occupants[i].cell - 1);
+        u32 distance = (i - home) % OCCUPANT_SLOTS;
+
+        if ( distance >= (i - hole) % OCCUPANT_SLOTS ) {
+            state->occupants[hole] = state->occupants[i];
+            hole = i;
+        }
+
+        i = (i + 1) % OCCUPANT_SLOTS;
+    }
+
+    memset(&state->occupants[hole], 0, sizeof(state->occupants[hole]));
+}
+
+/// - returns: The player's new occupant entry.
+static Occupant * AddPlayerToCell(MatchState * state, int index)
+{
+    const Player * player = &state->players[index];
+    int cell = MapCell(&map_g, player->x, player->y);
+    Occupant * occupant = GetOccupant(state, cell, true);
+    u8 * link = &occupant->player;
+
+    while ( *link && *link - 1 < index ) {
+        link = &state->next_players[*link - 1];
+    }
+
+    state->next_players[index] = *link;
+    *link = index + 1;
+
+    return occupant;
+}
+
+static void RemovePlayerFromCell(MatchState * state, int index)
+{
+    const Player * player = &state->players[index];
+    Occupant * occupant = GetOccupant(state, MapCell(&map_g, player->x, player->y), false);
+    if ( occupant == NULL ) {
+        return;
+    }
+
+    u8 * link = &occupant->player;
+    while ( *link && *link != index + 1 ) {
+        link = &state->next_players[*link - 1];
+    }
+
+    if ( *link ) {
+        *link = state->next_players[index];
+        state->next_players[index] = 0;
+    }
+
+    TidyOccupant(state, occupant);
+}
+
+/// - returns: What's on the cell the player moved to.
+static const Occupant * MovePlayer(MatchState * state, Player * player, int x, int y)
+{
+    int index = (int)(player - state->players);
+
+    RemovePlayerFromCell(state, index);
+    player->x = x;
+    player->y = y;
+    return AddPlayerToCell(state, index);
+}
+
+/// Take ring `index` off the board. The last ring takes its place.
+static void RemoveRing(MatchState * state, int index)
+{
+    Ring * ring = &state->rings[index];
+    Occupant * occupant = GetOccupant(state, MapCell(&map_g, ring->x, ring->y), true);
+    occupant->ring = 0;
+    TidyOccupant(state, occupant);
+
+    *ring = state->rings[--state->nrings];
+    if ( index < state->nrings ) {
+        GetOccupant(state, MapCell(&map_g, ring->x, ring->y), true)->ring = index + 1;
+    }
+}
+
+/// Fill in who is on each cell from scratch.
+static void PlaceOccupants(MatchState * state)
+{
+    memset(state->occupants, 0, sizeof(state->occupants));
+    memset(state->next_players, 0, sizeof(state->next_players));
+
+    for ( int i = 0; i < state->nplayers; i++ ) {
+        AddPlayerToCell(state, i);
+    }
+
+    for ( int i = 0; i < state->nrings; i++ ) {
+        const Ring * ring = &state->rings[i];
+        GetOccupant(state, MapCell(&map_g, ring->x, ring->y), true)->ring = i + 1;
+    }
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - Misc Functions
+
+int RingValue(u8 ring_type, int player_index)
+{
+    if ( ring_type == RING_RAINBOW ) {
+        return 3;
+    } else if ( ring_type == _player_rings[player_index] ) {
+        return 2;
+    } else if ( ring_type == RING_NONE ) {
+        return 0;
+    } else {
+        return 1;
+    }
+}
+
+static RingType GetRandomRingType(Rng * rng)
+{
+    int weights[] = {
+        [RING_BLUE]     = 10,
+        [RING_GREEN]    = 10,
+        [RING_CYAN]     = 10,
+        [RING_RED]      = 5,
+        [RING_MAGENTA]  = 10,
+        [RING_YELLOW]   = 10,
+        [RING_RAINBOW]  = 2,
+        [RING_WHITE]    = 10,
+    };
+
+    int total = 0;
+    for ( int i = 1; i < NUM_RING_TYPES; i++ ) {
+        total += weights[i];
+    }
+
+    int value = Rand(rng, 0, total - 1);
+
+    int weight = 0;
+    for ( int i = 1; i < NUM_RING_TYPES; i++ ) {
+        weight += weights[i];
+        if ( value < weight ) {
+            return (RingType)i;
+        }
+    }
+
+    return RING_BLUE; // Not reached.
+}
+
+Ranking GetRanking(const MatchState * state)
+{
+    Ranking ranking = { 0 };
+
+    // Find the highest points value.
+    int max_pts = state->players[0].pts;
+
+    for ( int i = 1; i < state->nplayers; i++ ) {
+        if ( state->players[i].pts > max_pts ) {
+            max_pts = state->players[i].pts;
+        }
+    }
+
+    // Assign first place.
+    for ( int i = 0; i < state->nplayers; i++ ) {
+        if ( state->players[i].pts == max_pts ) {
+            ranking.is_in_first[i] = true;
+            ranking.in_first_indices[ranking.num_in_first++] = i;
+        }
+    }
+
+    if ( ranking.num_in_first == state->nplayers ) {
+        // All players are tied, remove in first status
+        ranking.num_in_first = 0;
+        memset(ranking.is_in_first, 0, sizeof(ranking.is_in_first));
+    }
+
+    return ranking;
+}
+
+#pragma mark - Update Functions
+
+static bool CollideWithPlayer(MatchState * state,
+                              Player * self,
+                              int x,
+                              int y,
+                              int dx,
+                              int dy)
+{
+    int self_index = (int)(self - state->players);
+
+    const Occupant * occupant = GetOccupant(state, MapCell(&map_g, x, y), false);
+    int hit_index = occupant ? occupant->player - 1 : -1;
+    if ( hit_index == self_index ) {
+        hit_index = state->next_players[hit_index] - 1;
+    }
+
+    if ( hit_index == -1 ) {
+        return false;
+    }
+
+    Player * hit = &state->players[hit_index];
+
+    // Collision:
+
+    // Set up bump animation.
+    self->offx = dx * TILE_SIZE * 0.5;
+    self->offy = dy * TILE_SIZE * 0.5;
+
+    // Do damage.
+    if ( self->held == RING_RED ) {
+        hit->health = 0;
+    } else if ( self->held
+               && self->held == _player_rings[self_index] ) {
+        hit->health -= 2;
+    } else if ( self->held == RING_RAINBOW ) {
+        hit->health -= 2;
+    } else {
+        hit->health--;
+    }
+
+    if ( hit->health <= 0 ) {
+        // TODO: killed
+    }
+
+    state->sound = S_ATTACK;
+
+    // Push the hit player the way we were going.
+    TryMovePlayer(state, hit, hit->x + dx, hit->y + dy);
+
+    return true;
+}
+
+static void TeleportPlayer(MatchState * state, Player * player)
+{
+    int cell = MapCell(&map_g, player->x, player->y);
+    int dest = TeleporterDest(&map_g, cell);
+
+    if ( dest != -1 && dest != cell ) {
+        MovePlayer(state, player, CellX(&map_g, dest), CellY(&map_g, dest));
+        state->sound = S_TELEPORT;
+    }
+}
+
+static void TryMovePlayer(MatchState * state, Player * player, int try_x, int try_y)
+{
+    int dx = try_x - player->x;
+    int dy = try_y - player->y;
+
+    // Wrap position
+    if ( try_x < 0 ) try_x += map_g.width;
+    if ( try_y < 0 ) try_y += map_g.height;
+    if ( try_x >= map_g.width ) try_x -= map_g.width;
+    if ( try_y >= map_g.height ) try_y -= map_g.height;
+
+    int cell = MapCell(&map_g, try_x, try_y);
+    char tile = map_g.tiles[cell];
+
+    if ( !IsWalkable(&map_g, cell) ) {
+        if ( tile != 'W' ) { // Walls block with no bump animation.
+            // Bump into:
+            player->offx = dx * TILE_SIZE * 0.5;
+            player->offy = dy * TILE_SIZE * 0.5;
+            state->sound = S_BUMP;
+        }
+        return;
+    }
+
+    // No tile collision.
+
+    // TODO: refactor
+    // if ( !CollideWithPlayer ) {
+    //      StepOntoEmptyTile(type)
+    // }
+
+    // Check for a player:
+    if ( CollideWithPlayer(state, player, try_x, try_y, dx, dy) ) {
+        return;
+    }
+
+    // No collision with a player, move and check for pick-ups:
+
+    const Occupant * occupant = MovePlayer(state, player, try_x, try_y);
+    player->offx = -dx * TILE_SIZE; // Step animation
+    player->offy = -dy * TILE_SIZE;
+
+    // Check if the player stepped onto a ring.
+    int ring_index = occupant->ring - 1;
+    if ( !player->held && ring_index != -1 ) {
+        player->held = state->rings[ring_index].type; // Pick it up.
+        RemoveRing(state, ring_index);
+        state->sound = S_RING_COLLECT;
+    }
+
+    // Stepped onto a socket.
+    if ( tile >= 'a' && tile <= 'l' ) {
+
+        u8 * socket = &state->sockets[tile - 'a'];
+
+        if ( !(*socket) && player->held ) {
+            // Place a held ring into the empty socket.
+            *socket = player->held;
+            player->held = 0;
+            state->sound = S_PLACE_IN_SOCKET;
+        } else if ( *socket && !player->held ) {
+            // Pick up the item in the socket.
+            player->held = *socket;
+            *socket = 0;
+            state->sound = S_REMOVE_FROM_SOCKET;
+        }
+    }
+
+    // Stepped onto the ring disposer.
+    if ( tile == 'o' ) {
+        if ( player->held && !state->disposal ) {
+            state->disposal = player->held;
+            player->held = RING_NONE;
+            state->dispose_timer.sec = 5.0f;
+            state->sound = S_DISPOSER_PLACE;
+        } else if ( !player->held && state->disposal ) {
+            player->held = state->disposal;
+            state->disposal = RING_NONE;
+            state->dispose_timer.sec = 0.0f;
+            state->sound = S_RING_COLLECT;
+        }
+    }
+}
+
+static void UpdatePlayer(MatchState * state, Player * player, Action action)
+{
+    if ( player->offx || player->offy ) {
+        player->offx -= SIGN(player->offx);
+        player->offy -= SIGN(player->offy);
+
+        if ( player->offx == 0 && player->offy == 0 ) {
+            // Arrive, check if on teleporter.
+            TeleportPlayer(state, player);
+        }
+    } else if ( action != A_NONE ) {
+
+        int dx = 0;
+        int dy = 0;
+
+        if ( action & A_MOVE_UP ) dy--;
+        if ( action & A_MOVE_DOWN) dy++;
+        if ( action & A_MOVE_LEFT) dx--;
+        if ( action & A_MOVE_RIGHT) dx++;
+
+        TryMovePlayer(state, player, player->x + dx, player->y + dy);
+    }
+}
+
+/// Add the open cell at `x`, `y`, if it is one, to `taken`, a sorted list of
+/// indices into the open cell list.
+/// - returns: The new length of `taken`.
+static int AddTakenCell(int * taken, int ntaken, int x, int y)
+{
+    int index = OpenIndex(&map_g, MapCell(&map_g, x, y));
+    if ( index == -1 ) {
+        return ntaken;
+    }
+
+    int i = ntaken;
+    while ( i > 0 && taken[i - 1] > index ) {
+        i--;
+    }
+
+    if ( i > 0 && taken[i - 1] == index ) {
+        return ntaken; // Two things on one cell.
+    }
+
+    memmove(&taken[i + 1], &taken[i], (ntaken - i) * sizeof(taken[0]));
+    taken[i] = index;
+
+    return ntaken + 1;
+}
+
+static void SpawnRing(MatchState * state)
+{
+    if ( state->nrings >= MAX_RINGS ) {
+        return;
+    }
+
+    // Open cells with a player or ring on them, by index in the open list.
+    int taken[MAX_PLAYERS + MAX_RINGS];
+    int ntaken = 0;
+
+    for ( int i = 0; i < state->nplayers; i++ ) {
+        const Player * p = &state->players[i];
+        ntaken = AddTakenCell(taken, ntaken, p->x, p->y);
+    }
+
+    for ( int i = 0; i < state->nrings; i++ ) {
+        const Ring * r = &state->rings[i];
+        ntaken = AddTakenCell(taken, ntaken, r->x, r->y);
+    }
+
+    // Select a random free spot, then step over the taken cells before it
+    // to find it in the open list. It's the one a scan of the map in cell
+    // order would pick.
+    int pick = Rand(&state->rng, 0, map_g.nopen - ntaken - 1);
+    for ( int i = 0; i < ntaken && taken[i] <= pick; i++ ) {
+        pick++;
+    }
+
+    int cell = OpenCell(&map_g, pick);
+    Ring * ring = &state->rings[state->nrings++];
+    ring->x = CellX(&map_g, cell);
+    ring->y = CellY(&map_g, cell);
+    ring->type = GetRandomRingType(&state->rng);
+    GetOccupant(state, cell, true)->ring = state->nrings;
+
+    state->sound = S_RING_SPAWN;
+}
+
+static void DisposeRing(MatchState * state)
+{
+    state->sound = S_RING_DISPOSED;
+    state->disposal = RING_NONE;
+}
+
+static void UpdatePoints(MatchState * state)
+{
+    // Update points based on rings in sockets.
+    bool match_over = false;
+
+    for ( int s = 0; s < NUM_SOCKETS; s++ ) {
+        if ( state->sockets[s] ) {
+            int player_index = s / NUM_SOCKETS_PER_PLAYER;
+            Player * player = &state->players[player_index];
+            player->pts += RingValue(state->sockets[s], player_index);
+            if ( player->pts > MAX_POINTS ) {
+                match_over = true;
+            }
+        }
+    }
+
+    Ranking ranking = GetRanking(state);
+    if ( ranking.num_in_first == 1 && match_over ) {
+        state->game_state = GS_MATCH_OVER;
+        state->sound = S_MATCH_OVER;
+        return;
+    }
+
+    // Increase health for those standing on their spawn platform
+    for ( int p = 0; p < state->nplayers; p++ ) {
+        Player * player = &state->players[p];
+        if ( player->x == map_g.spawn_x[p] && player->y == map_g.spawn_y[p] ) {
+            if ( player->health < MAX_PLAYER_HEALTH ) {
+                player->health++;
+                state->sound = S_REGEN;
+            }
+        }
+    }
+}
+
+void InitMatch(MatchState * state, int nplayers, u32 seed)
+{
+    memset(state, 0, sizeof(*state));
+
+    state->game_state = GS_PLAY;
+    state->nplayers = nplayers;
+    state->rng = InitRng(seed);
+
+    // The timers are run by UpdateMatch(), which checks whether they fired
+    // rather than using callbacks, so the state holds no pointers.
+    state->ring_timer = InitTimer(3.0f, 15.0f, NULL);
+    state->dispose_timer = InitTimer(0.0f, 0.0f, NULL);
+    state->point_timer = InitTimer(5.0f, 5.0f, NULL);
+
+    // Init players
+    for ( int i = 0; i < nplayers; i++ ) {
+        state->players[i].x = map_g.spawn_x[i];
+        state->players[i].y = map_g.spawn_y[i];
+        state->players[i].health = MAX_PLAYER_HEALTH;
+    }
+
+    PlaceOccupants(state);
+}
+
+void UpdateMatch(MatchState * state, const Action actions[MAX_PLAYERS], float dt)
+{
+    if ( state->game_state != GS_PLAY ) {
+        return;
+    }
+
+    if ( RunTimer(&state->dispose_timer, dt) ) {
+        DisposeRing(state);
+    }
+
+    if ( RunTimer(&state->ring_timer, dt) ) {
+        SpawnRing(state);
+    }
+
+    if ( RunTimer(&state->point_timer, dt) ) {
+        UpdatePoints(state);
+    }
+
+    for ( int i = 0; i < state->nplayers; i++ ) {
+        UpdatePlayer(state, &state->players[i], actions[i]);
+    }
+}
+
+void PredictPlayer(MatchState * state, int player_index, Action action)
+{
+    enum Sound sound = state->sound;
+    UpdatePlayer(state, &state->players[player_index], action);
+    state->sound = sound;
+}
+
+static u32 HashBytes(u32 hash, const void * data, size_t size)
+{
+    const u8 * bytes = (const u8 *)data;
+    for ( size_t i = 0; i < size; i++ ) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static u32 HashTimer(u32 hash, const Timer * timer)
+{
+    hash = HashBytes(hash, &timer->sec, sizeof(timer->sec));
+    return HashBytes(hash, &timer->reset_sec, sizeof(timer->reset_sec));
+}
+
+u32 HashMatchState(const MatchState * state)
+{
+    // Field by field: the struct's padding isn't guaranteed to be copied.
+    u32 hash = 2166136261u;
+    hash = HashBytes(hash, &state->game_state, sizeof(state->game_state));
+    hash = HashBytes(hash, &state->nplayers, sizeof(state->nplayers));
+    hash = HashBytes(hash, state->players, sizeof(state->players));
+    hash = HashBytes(hash, state->sockets, sizeof(state->sockets));
+    hash = HashBytes(hash, state->rings, sizeof(state->rings));
+    hash = HashBytes(hash, &state->nrings, sizeof(state->nrings));
+    hash = HashBytes(hash, &state->disposal, sizeof(state->disposal));
+    hash = HashTimer(hash, &state->ring_timer);
+    hash = HashTimer(hash, &state->dispose_timer);
+    hash = HashTimer(hash, &state->point_timer);
+    hash = HashBytes(hash, &state->rng, sizeof(state->rng));
+
+    return hash;
+}
+
+void SaveSnapshot(const MatchState * state, Snapshot * snapshot, u32 tick)
+{
+    snapshot->tick = tick;
+    memcpy(snapshot->players, state->players, sizeof(state->players));
+    snapshot->nrings = state->nrings;
+    memcpy(snapshot->rings, state->rings, sizeof(state->rings));
+    memcpy(snapshot->sockets, state->sockets, sizeof(state->sockets));
+    snapshot->disposal = state->disposal;
+    snapshot->sound = (u8)state->sound;
+    memset(snapshot->input_seqs, 0, sizeof(snapshot->input_seqs));
+}
+
+void LoadSnapshot(MatchState * state, const Snapshot * snapshot)
+{
+    memcpy(state->players, snapshot->players, sizeof(state->players));
+    state->nrings = snapshot->nrings;
+    memcpy(state->rings, snapshot->rings, sizeof(state->rings));
+    memcpy(state->sockets, snapshot->sockets, sizeof(state->sockets));
+    state->disposal = snapshot->disposal;
+    state->sound = (enum Sound)snapshot->sound;
+    PlaceOccupants(state);
+}
+
+#pragma mark - Server
+
+static int FirstRemotePlayer(const Match * match)
+{
+    return match->has_local_player ? 1 : 0;
+}
+
+static void DropConnection(Match * match, int i)
+{
+    PollerRemove(match->poller, &match->connections[i]);
+    CloseSocket(&match->connections[i]);
+    match->connections[i].is_init = false;
+}
+
+void CloseConnection(Match * match, int i)
+{
+    printf("Player %d disconnected.\n", i + 1);
+
+    DropConnection(match, i);
+
+    if ( match->lobby ) {
+        ReleaseSeat(match->lobby, match->lobby_index, i);
+    }
+}
+
+static void PushInput(InputQueue * queue, PlayerInput input, u32 step)
+{
+    if ( queue->has_newest ) {
+        if ( !SeqNewer(input.seq, queue->newest_seq) ) {
+            return; // Already have it.
+        }
+
+        // Every packet that had the ones in between was lost.
+        queue->nlost += (u16)(input.seq - queue->newest_seq - 1);
+    }
+
+    queue->newest_seq = input.seq;
+    queue->has_newest = true;
+
+    if ( queue->count == INPUT_QUEUE_SIZE ) {
+        // The client is running ahead of us: drop its oldest input.
+        queue->head = (queue->head + 1) % INPUT_QUEUE_SIZE;
+        queue->count--;
+    }
+
+    int tail = (queue->head + queue->count) % INPUT_QUEUE_SIZE;
+    queue->inputs[tail] = input;
+    queue->arrival_steps[tail] = step;
+    queue->count++;
+}
+
+/// Queue the new inputs in a CM_INPUTS message.
+static void ReadInputs(InputQueue * queue, BufferReader * reader, u32 step)
+{
+    u16 newest_seq;
+    u8 count;
+    if ( !ReaderGet(reader, &newest_seq) || !ReaderGet(reader, &count) ) {
+        return;
+    }
+
+    for ( int k = 0; k < count; k++ ) {
+        PlayerInput input;
+        input.seq = newest_seq - (count - 1 - k);
+        if ( !ReaderGet(reader, &input.action) ) {
+            return;
+        }
+
+        PushInput(queue, input, step);
+    }
+}
+
+/// Take the next input to simulate, or `A_NONE` if the client hasn't sent it
+/// yet.
+static Action PopInput(InputQueue * queue, u32 step)
+{
+    if ( queue->count == 0 ) {
+        return A_NONE;
+    }
+
+    PlayerInput input = queue->inputs[queue->head];
+    u32 waited = step - queue->arrival_steps[queue->head];
+    queue->head = (queue->head + 1) % INPUT_QUEUE_SIZE;
+    queue->count--;
+    queue->last_seq = input.seq;
+    queue->delay += ((float)waited - queue->delay) * 0.05f;
+
+    return input.action;
+}
+
+bool AddConnection(Match * match,
+                   int player_index,
+                   const Socket * socket,
+                   u64 token,
+                   const Poller * poller)
+{
+    Socket * connection = &match->connections[player_index];
+    int nplayers = match->state.nplayers;
+
+    if ( connection->is_init ) {
+        // The same player, back before we noticed they'd gone: the seat
+        // stays theirs.
+        printf("Player %d rejoined.\n", player_index + 1);
+        DropConnection(match, player_index);
+    }
+
+    *connection = *socket;
+    match->poller = poller;
+    match->acked_ticks[player_index] = 0; // Start over with a full snapshot.
+    memset(&match->inputs[player_index], 0, sizeof(match->inputs[0]));
+
+    Buffer buffer = { 0 };
+    BufferInit(&buffer, 0);
+    BufferWrite(&buffer, &player_index, sizeof(player_index));
+    BufferWrite(&buffer, &nplayers, sizeof(nplayers));
+    BufferWrite(&buffer, &token, sizeof(token));
+    BufferWrite(&buffer, &map_g.hash, sizeof(map_g.hash));
+
+    bool ok = PacketWrite(connection, &buffer) && PollerAdd(poller, connection);
+    free(buffer.data);
+
+    if ( !ok ) {
+        CloseSocket(connection);
+        connection->is_init = false;
+        if ( match->lobby ) {
+            ReleaseSeat(match->lobby, match->lobby_index, player_index);
+        }
+        return false;
+    }
+
+    if ( match->lobby ) {
+        OccupySeat(match->lobby, match->lobby_index, player_index);
+    }
+
+    // Whatever arrived before the poller started watching is still there.
+    connection->is_readable = true;
+
+    return true;
+}
+
+void ServerUpdate(Match * match, Action local_action, float dt)
+{
+    MatchState * state = &match->state;
+    int first_remote = FirstRemotePlayer(match);
+
+    Action actions[MAX_PLAYERS] = { [0] = local_action };
+
+    // Read client inputs.
+    for ( int i = first_remote; i < state->nplayers; i++ ) {
+        Socket * connection = &match->connections[i];
+
+        if ( !connection->is_init ) {
+            actions[i] = A_NONE;
+            continue;
+        }
+
+        // Everything that arrived since last tick.
+        int count = PacketReadBatch(connection, &_batch);
+        for ( int j = 0; j < count; j++ ) {
+            BufferReader reader = MakeReader(_batch.packets[j].data,
+                                             _batch.packets[j].size);
+            u8 type = 0;
+            ReaderGet(&reader, &type);
+
+            if ( type == CM_INPUTS ) {
+                ReadInputs(&match->inputs[i], &reader, match->step);
+            } else if ( type == CM_ACK ) {
+                u32 tick = 0;
+                if ( ReaderGet(&reader, &tick)
+                    && tick <= match->tick
+                    && tick > match->acked_ticks[i] ) {
+                    match->acked_ticks[i] = tick;
+                }
+            }
+        }
+
+        if ( connection->is_hungup && !connection->is_readable ) {
+            CloseConnection(match, i);
+        }
+
+        actions[i] = PopInput(&match->inputs[i], match->step);
+
+        if ( match->step % INPUT_REPORT_STEPS == 0 ) {
+            NetLog("Player %d: input delay %.1f steps, %d inputs lost",
+                   i + 1, match->inputs[i].delay, match->inputs[i].nlost);
+        }
+    }
+
+    RecordTick(&match->replay, actions, state->nplayers);
+    UpdateMatch(state, actions, dt);
+    match->step++;
+
+    if ( state->game_state != GS_PLAY ) {
+        CloseReplay(&match->replay, HashMatchState(state)); // Once it's over.
+    }
+
+    // Snapshots go out at send_rate_g, which can be lower than the tick rate.
+    float send_sec = 1.0f / send_rate_g;
+    match->send_accumulator += dt;
+    if ( match->send_accumulator < send_sec ) {
+        return;
+    }
+
+    match->send_accumulator -= send_sec;
+    if ( match->send_accumulator > send_sec ) {
+        match->send_accumulator = 0.0f; // Don't try to catch up.
+    }
+
+    Snapshot snapshot;
+    SaveSnapshot(state, &snapshot, ++match->tick);
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        snapshot.input_seqs[i] = match->inputs[i].last_seq;
+    }
+    StoreSnapshot(&match->history, &snapshot);
+
+    // Send each client what changed since the last snapshot it acked. Clients
+    // with the same baseline share one encoded frame.
+    Frame * frames[MAX_PLAYERS] = { NULL };
+    u32 frame_baselines[MAX_PLAYERS];
+    int nframes = 0;
+
+    for ( int i = first_remote; i < state->nplayers; i++ ) {
+        if ( !match->connections[i].is_init ) {
+            continue;
+        }
+
+        const Snapshot * baseline = FindSnapshot(&match->history,
+                                                 match->acked_ticks[i]);
+        u32 baseline_tick = baseline ? baseline->tick : 0;
+
+        Frame * frame = NULL;
+        for ( int j = 0; j < nframes; j++ ) {
+            if ( frame_baselines[j] == baseline_tick ) {
+                frame = frames[j];
+                break;
+            }
+        }
+
+        if ( frame == NULL ) {
+            frame = NewFrame();
+            EncodeSnapshot(&snapshot, baseline, &frame->payload);
+            frames[nframes] = frame;
+            frame_baselines[nframes] = baseline_tick;
+            nframes++;
+        }
+
+        // Snapshots go unreliable: a lost one is superseded by the next.
+        Socket * connection = &match->connections[i];
+        if ( !PacketWriteFrame(connection, frame, DELIVERY_UNRELIABLE) ) {
+            fprintf(stderr, "ServerUpdate: packet write failed\n");
+        }
+    }
+
+    for ( int i = 0; i < nframes; i++ ) {
+        ReleaseFrame(frames[i]);
+    }
+
+    // Without a local player nothing renders, which is where the sound is
+    // reset otherwise.
+    if ( !match->has_local_player ) {
+        state->sound = S_NONE;
+    }
+}
+
+void CloseMatch(Match * match)
+{
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        if ( match->connections[i].is_init ) {
+            CloseSocket(&match->connections[i]);
+            match->connections[i].is_init = false;
+        }
+    }
+
+    CloseReplay(&match->replay, HashMatchState(&match->state));
+}
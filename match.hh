@@ -0,0 +1,167 @@
+//
+//  match.hh
+//  NetTest2
+//
+
+#ifndef match_hh
+#define match_hh
+
+#include "game.hh"
+#include "map.hh"
+#include "net.hh"
+#include "random.hh"
+#include "replay.hh"
+#include "snapshot.hh"
+
+#define MAX_POINTS 100
+#define INPUT_QUEUE_SIZE 16 // Inputs a client can be ahead of the server.
+#define INPUT_REDUNDANCY 8 // Most inputs a client repeats in each packet.
+#define INPUT_REPORT_STEPS 600 // Steps between input delay reports.
+#define OCCUPANT_BITS 4
+#define OCCUPANT_SLOTS (1 << OCCUPANT_BITS)
+
+static_assert(OCCUPANT_SLOTS >= 2 * (MAX_PLAYERS + MAX_RINGS),
+              "occupant table too small");
+
+/// What's on one cell of the map.
+struct Occupant {
+    u32 cell; // + 1, or 0 for an unused slot.
+    u8 player; // First player here, + 1, or 0.
+    u8 ring; // Ring here, + 1, or 0.
+};
+
+/// Everything the simulation reads and writes. Plain data, so it can be
+/// copied and compared.
+struct MatchState {
+    GameState game_state;
+    int nplayers;
+    Player players[MAX_PLAYERS];
+    u8 sockets[NUM_SOCKETS]; // Corresponds to tiles 'a' to 'l'
+    Ring rings[MAX_RINGS]; // Rings on the board
+    u8 nrings; // Number of rings in the rings array
+    u8 disposal; // Type of ring inside.
+    enum Sound sound; // Which sound to output at end of frame.
+
+    Timer ring_timer;
+    Timer dispose_timer;
+    Timer point_timer;
+
+    Rng rng;
+
+    // Who is on each cell, kept up to date as things move so that nothing
+    // has to search the players and rings for it. Only cells with something
+    // on them are kept, in a hash table, so its size doesn't depend on the
+    // map's. Worked out from the rest of the state: it isn't hashed or sent
+    // in snapshots.
+    Occupant occupants[OCCUPANT_SLOTS]; // Linear probing, by cell.
+    u8 next_players[MAX_PLAYERS]; // Next player on the same cell, + 1, or 0.
+};
+
+/// One tick of a client's input.
+struct PlayerInput {
+    u16 seq;
+    Action action;
+};
+
+/// Inputs from a client that haven't been simulated yet. The server runs one
+/// per tick, in order, so its copy of the player moves the same way the
+/// client predicted it would.
+///
+/// Clients repeat their unacknowledged inputs in every packet, so the queue
+/// sees most inputs several times and keeps only those newer than any it has.
+struct InputQueue {
+    PlayerInput inputs[INPUT_QUEUE_SIZE]; // Ring, from `head`.
+    u32 arrival_steps[INPUT_QUEUE_SIZE]; // Match step each input arrived on.
+    int head;
+    int count;
+    u16 newest_seq; // Newest received.
+    u16 last_seq; // Newest simulated, reported back in snapshots.
+    bool has_newest;
+
+    float delay; // Smoothed steps an input waits before it's simulated.
+    int nlost; // Inputs that never arrived, in every copy.
+};
+
+struct Lobby;
+
+/// One match as the server runs it: the simulation plus a connection and
+/// snapshot bookkeeping for each remote player.
+struct Match {
+    MatchState state;
+
+    bool has_local_player; // Player 1 is played on the server itself.
+    Socket connections[MAX_PLAYERS];
+    const Poller * poller; // Where the connections are registered.
+
+    // Where seats go back when their players leave, or NULL to keep them.
+    Lobby * lobby;
+    int lobby_index; // This match's index in the lobby.
+
+    SnapshotHistory history; // Snapshots sent.
+    u32 tick; // Newest snapshot sent.
+    u32 acked_ticks[MAX_PLAYERS]; // Newest snapshot each client has.
+    float send_accumulator; // Time since the last snapshot was sent.
+
+    InputQueue inputs[MAX_PLAYERS];
+    u32 step; // Simulation steps run.
+
+    ReplayWriter replay; // Opened by the caller to record the match.
+};
+
+// First byte of a packet from a client.
+enum ClientMessage : u8 {
+    CM_INPUTS, // Every tick: the newest input's seq (u16), a count (u8), and
+               // that many actions, oldest first, ending with the newest.
+    CM_ACK, // Followed by the newest snapshot tick the client has.
+    CM_HELLO, // First message, followed by a session token (lobby.hh).
+    CM_ROLLBACK, // Rollback mode: how many of each player's inputs we have
+                 // (u32 each), ours the host doesn't have, then the frame
+                 // and hash of our newest final state (rollback.hh).
+};
+
+/// Put all players on their spawn platforms and start the timers.
+void InitMatch(MatchState * state, int nplayers, u32 seed);
+
+/// Advance the simulation one step, with one action per player.
+void UpdateMatch(MatchState * state, const Action actions[MAX_PLAYERS], float dt);
+
+/// Advance only player `player_index` one step, as UpdateMatch() would, for a
+/// client to predict its own movement. Leaves `sound` alone: the server's
+/// snapshots say which sounds play.
+void PredictPlayer(MatchState * state, int player_index, Action action);
+
+/// Points a ring in one of `player_index`'s sockets is worth.
+int RingValue(u8 ring_type, int player_index);
+Ranking GetRanking(const MatchState * state);
+
+/// FNV-1a of everything the simulation reads, for peers to check that their
+/// copies of a match still agree. Leaves out `sound`, which renderers clear.
+u32 HashMatchState(const MatchState * state);
+
+void SaveSnapshot(const MatchState * state, Snapshot * snapshot, u32 tick);
+void LoadSnapshot(MatchState * state, const Snapshot * snapshot);
+
+/// Move `socket` into player `player_index`'s seat, closing any connection
+/// already there. Sends the client their index, the player count, their
+/// session token and the hash of map_g, and starts polling the connection
+/// with `poller`. The caller frees `socket` itself but not what it refers to.
+/// - returns: `false` on error, in which case the seat is left empty.
+bool AddConnection(Match * match,
+                   int player_index,
+                   const Socket * socket,
+                   u64 token,
+                   const Poller * poller);
+
+/// Stop polling and close player `player_index`'s connection, and give the
+/// seat back to the lobby.
+void CloseConnection(Match * match, int player_index);
+
+/// Read client messages, run one simulation step, and send snapshots when
+/// they're due. `local_action` is used for player 1 if the match has a local
+/// player.
+void ServerUpdate(Match * match, Action local_action, float dt);
+
+/// Close every connection, and finish the replay if one is being recorded.
+void CloseMatch(Match * match);
+
+#endif /* match_hh */
@@ -35,16 +35,6 @@ float DistanceSquared(int ax, int ay, int bx, int by)
     return dx * dx + dy * dy;
 }
 
-void Shuffle(int * values, int count)
-{
-    for ( int i = count - 1; i > 0; i-- ) {
-        int j = rand() % (i + 1);
-        int temp = values[i];
-        values[i] = values[j];
-        values[j] = temp;
-    }
-}
-
 unsigned int WangHash(unsigned x, unsigned y)
 {
     unsigned seed = x * 73856093 ^ y * 19349663;
@@ -49,7 +49,6 @@ struct Timer {
 
 float       Lerp(float a, float b, float w);
 float       DistanceSquared(int ax, int ay, int bx, int by);
-void        Shuffle(int * values, int count);
 unsigned    WangHash(unsigned x, unsigned y);
 Timer       InitTimer(float sec,
                       float reset_sec,
@@ -67,4 +66,10 @@ constexpr const T& max(const T& a, const T& b) {
     return (a < b) ? b : a;
 }
 
+/// Whether sequence number `a` comes after `b`, allowing for wraparound.
+inline bool SeqNewer(u16 a, u16 b)
+{
+    return (s16)(a - b) > 0;
+}
+
 #endif /* misc_h */
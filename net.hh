@@ -2,35 +2,164 @@
 #define network_h
 
 #include "buffer.hh"
+#include "misc.hh"
 
 #include <stdbool.h>
 #include <stddef.h>
 
 #define NET_ERROR_MESSAGE_LEN 128
-#define SERVER_ACCEPT_QUEUE_LIMIT 4
-#define NET_BUFFER_SIZE 1024
+#define SERVER_ACCEPT_QUEUE_LIMIT 128
+#define NET_BUFFER_SIZE 8192 // Receive ring size. Must be a power of two.
+#define NET_MAX_EVENTS 64 // Most events returned by one PollerWait()
+#define NET_MAX_DATAGRAM 1200 // Largest UDP datagram we send (stays under MTU)
+#define NET_DATAGRAM_HELLO 0xFF // UDP connection request and reply
+
+enum Transport {
+    TRANSPORT_TCP,
+    TRANSPORT_UDP, // Sequenced datagrams with per-message reliability (udp.hh)
+};
+
+enum Delivery {
+    DELIVERY_RELIABLE, // Arrives exactly once and in order.
+    DELIVERY_UNRELIABLE, // May be lost. Never arrives after a newer one.
+};
+
+// Outgoing packets wait here until the socket has room for them.
+#define NET_SEND_QUEUE_LENGTH 64
+#define NET_SEND_QUEUE_LIMIT (64 * 1024) // Bytes. A peer this far behind is dropped.
+
+struct Frame;
+
+struct QueuedPacket {
+    Frame * frame; // Holds a reference (packet.hh).
+    int size; // Size header and payload.
+    bool is_droppable; // Unreliable: a newer packet makes this one stale.
+};
+
+struct SendQueue {
+    QueuedPacket packets[NET_SEND_QUEUE_LENGTH]; // Ring, from `head`.
+    int head;
+    int count;
+    int offset; // Bytes of the first packet already sent.
+    int bytes; // Bytes not yet sent.
+};
+
+#define NET_MAX_SLICES (NET_SEND_QUEUE_LENGTH * 2)
+
+/// One piece of data for a gather write.
+struct NetSlice {
+    const void * data;
+    int size;
+};
+
+struct UdpChannel;
 
 struct Socket {
-    Buffer write_buf;
+    SendQueue send_queue;
 
+    // Receive ring. The offsets only ever grow: index with them masked by
+    // NET_BUFFER_SIZE - 1. Unread data is [read_head, read_tail).
     char read_buf[NET_BUFFER_SIZE];
-    int read_size;
+    u32 read_head;
+    u32 read_tail;
+
+    // A frame too big for read_buf is reassembled here.
+    Buffer large_frame;
+    int large_frame_left; // Payload bytes still to come.
 
     int fd;
     bool is_init;
+    bool is_accepted; // Made by AcceptConnection(), rather than CreateClient().
+
+    Transport transport;
+    UdpChannel * channel; // UDP sequencing and reliability state.
+
+    // Readiness, as reported by a Poller. Polling is edge-triggered, so a
+    // flag stays set until a read or write comes back short.
+    bool is_polled;
+    bool is_readable;
+    bool is_writable;
+    bool is_hungup;
+};
+
+// Poller event flags.
+#define NET_EVENT_READ      0x01
+#define NET_EVENT_WRITE     0x02
+#define NET_EVENT_HANGUP    0x04
+
+struct NetEvent {
+    Socket * socket;
+    int flags;
+};
+
+/// Edge-triggered readiness notification for a set of sockets (epoll on
+/// Linux, kqueue elsewhere).
+struct Poller {
+    int fd;
+    bool is_init;
+};
+
+/// System calls made on sockets and pollers, counted per thread.
+struct NetCounters {
+    u64 reads; // recv() and readv()
+    u64 writes; // send() and writev()
+    u64 waits; // PollerWait()
 };
 
 bool InitNetwork(const char * log_name);
-Socket CreateClient(const char * ip, const char * port);
-Socket CreateServer(const char * port);
+Socket CreateClient(const char * ip,
+                    const char * port,
+                    Transport transport = TRANSPORT_TCP);
+Socket CreateServer(const char * port, Transport transport = TRANSPORT_TCP);
+
+/// Accept one waiting connection into `out`. Doesn't block.
+/// - returns: `false` on error. If no connection was waiting, returns `true`
+///   and leaves `out->is_init` false.
 bool AcceptConnection(const Socket * server, Socket * out);
 int NetWrite(const Socket * socket, void * data, int size);
 bool NetWriteAll(const Socket * socket, void * data, int size);
+
+/// Read into `slices` in order, with one syscall.
+/// - returns: The number of bytes read, 0 if there was nothing to read, -1 on
+///   error or once a TCP peer has closed the connection.
+int NetReadScatter(const Socket * socket, const NetSlice * slices, int count);
+
+/// Send `slices` in order, with one syscall. On a UDP socket, this is one
+/// datagram.
+/// - returns: The number of bytes sent, 0 if the socket is full, -1 on error.
+int NetWriteGather(const Socket * socket, const NetSlice * slices, int count);
 int NetRead(const Socket * socket, void * buffer, int size);
 bool NetReadAll(const Socket * socket, void * buffer, int size);
 void CloseSocket(const Socket * socket);
+
+Poller CreatePoller(void);
+
+/// Start watching `socket` for readability, writability and hangup. The socket
+/// must stay at the same address until it is removed.
+bool PollerAdd(const Poller * poller, Socket * socket);
+bool PollerRemove(const Poller * poller, Socket * socket);
+
+/// Wait up to `timeout_ms` (0: don't block, -1: forever) for sockets to become
+/// ready. Sets the readiness flags of each ready socket and fills `events`.
+/// - returns: The number of events, or -1 on error.
+int PollerWait(const Poller * poller,
+               NetEvent * events,
+               int max_events,
+               int timeout_ms);
+void ClosePoller(const Poller * poller);
 const char * GetNetError(void);
 void ShutdownNet(void);
 void NetLog(const char * format, ...);
 
+/// Monotonic time in seconds.
+double NetTime(void);
+
+/// Fill `buffer` from the system's secure random source, for values a peer
+/// mustn't be able to guess.
+/// - returns: `false` on error.
+bool NetRandomBytes(void * buffer, int size);
+
+/// - returns: The calling thread's system call counts so far.
+NetCounters GetNetCounters(void);
+
 #endif /* network_h */
@@ -7,67 +7,483 @@
 
 #include "packet.hh"
 #include "net.hh"
+#include "udp.hh"
 #include <string.h>
 #include <stdio.h>
 
-bool PacketRead(Socket * socket, Buffer * buffer)
+#define RING_MASK (NET_BUFFER_SIZE - 1)
+
+// Copy `size` bytes out of the receive ring, starting at offset `from`.
+static void RingCopy(const Socket * socket, u32 from, void * out, int size)
+{
+    u32 start = from & RING_MASK;
+    int first = min(size, (int)(NET_BUFFER_SIZE - start));
+
+    memcpy(out, socket->read_buf + start, first);
+    memcpy((char *)out + first, socket->read_buf, size - first);
+}
+
+bool PacketPush(Socket * socket, const void * data, PacketSize size)
+{
+    u32 used = socket->read_tail - socket->read_head;
+    int total_size = sizeof(size) + size;
+
+    if ( NET_BUFFER_SIZE - used < (u32)total_size ) {
+        return false;
+    }
+
+    const void * pieces[2] = { &size, data };
+    int sizes[2] = { sizeof(size), size };
+
+    for ( int i = 0; i < 2; i++ ) {
+        u32 start = socket->read_tail & RING_MASK;
+        int first = min(sizes[i], (int)(NET_BUFFER_SIZE - start));
+
+        memcpy(socket->read_buf + start, pieces[i], first);
+        memcpy(socket->read_buf, (char *)pieces[i] + first, sizes[i] - first);
+        socket->read_tail += sizes[i];
+    }
+
+    return true;
+}
+
+static bool ReadStream(Socket * socket)
 {
-    char * read_buf = socket->read_buf;
+    // A polled socket is only read once the poller says it has data.
+    if ( socket->is_polled && !socket->is_readable ) {
+        return true;
+    }
 
-    // Read as much as the socket buffer allows.
-    int bytes_read = 0;
+    u32 used = socket->read_tail - socket->read_head;
+    int space = NET_BUFFER_SIZE - used;
 
-    if ( NET_BUFFER_SIZE - socket->read_size > 0 ) {
-        bytes_read = NetRead(socket,
-                             read_buf + socket->read_size,
-                             NET_BUFFER_SIZE - socket->read_size);
+    if ( space == 0 ) {
+        return true; // Still readable, once some packets are taken out.
     }
 
+    // The free part of the ring is at most two pieces: read both at once.
+    u32 start = socket->read_tail & RING_MASK;
+    int first = min(space, (int)(NET_BUFFER_SIZE - start));
+
+    NetSlice slices[2] = {
+        { socket->read_buf + start, first },
+        { socket->read_buf, space - first },
+    };
+
+    int bytes_read = NetReadScatter(socket, slices, space > first ? 2 : 1);
+
     if ( bytes_read == -1 ) {
-        fprintf(stderr, "Packet read: NetRead failed\n");
+        fprintf(stderr, "Packet read: NetRead failed: %s\n", GetNetError());
+        socket->is_hungup = true;
+        socket->is_readable = false;
         return false;
     }
 
-    socket->read_size += bytes_read;
+    // A short read means the socket is drained: wait for the next edge.
+    if ( bytes_read < space ) {
+        socket->is_readable = false;
+    }
+
+    socket->read_tail += bytes_read;
+
+    return true;
+}
+
+static bool FillRing(Socket * socket)
+{
+    if ( socket->transport == TRANSPORT_UDP ) {
+        // Once is enough: a failed peer stays hung up until it's closed.
+        bool was_hungup = socket->is_hungup;
+
+        if ( !UdpReceive(socket) ) {
+            if ( !was_hungup ) {
+                fprintf(stderr, "Packet read: UdpReceive failed: %s\n", GetNetError());
+            }
+            return false;
+        }
+
+        return true;
+    }
+
+    return ReadStream(socket);
+}
+
+// Move what the ring has of the large frame into `large_frame`.
+// - returns: `true` once the frame is complete.
+static bool ReassembleLargeFrame(Socket * socket)
+{
+    int available = socket->read_tail - socket->read_head;
+    int n = min(available, socket->large_frame_left);
+
+    BufferGrowIfNeeded(&socket->large_frame, n);
+    RingCopy(socket,
+             socket->read_head,
+             socket->large_frame.data + socket->large_frame.size,
+             n);
+
+    socket->large_frame.size += n;
+    socket->large_frame_left -= n;
+    socket->read_head += n;
+
+    return socket->large_frame_left == 0;
+}
+
+// Take the next complete packet out of the receive ring, without reading the
+// socket. The packet is at `*data`, unless it wraps around the end of the
+// ring, in which case it's appended to `spill` at `*spill_offset`.
+static bool NextPacket(Socket * socket,
+                       const char ** data,
+                       PacketSize * size,
+                       Buffer * spill,
+                       size_t * spill_offset)
+{
+    *spill_offset = SIZE_MAX;
+
+    if ( socket->large_frame_left > 0 ) {
+        if ( !ReassembleLargeFrame(socket) ) {
+            return false;
+        }
+
+        *data = socket->large_frame.data;
+        *size = (PacketSize)socket->large_frame.size;
+        return true;
+    }
 
     // Do we have an entire header?
-    if ( socket->read_size < sizeof(PacketSize) ) {
+    u32 available = socket->read_tail - socket->read_head;
+    if ( available < sizeof(PacketSize) ) {
         return false; // Nope.
     }
 
     PacketSize packet_size;
-    memcpy(&packet_size, read_buf, sizeof(packet_size));
+    RingCopy(socket, socket->read_head, &packet_size, sizeof(packet_size));
+    u32 total_size = sizeof(PacketSize) + packet_size;
+
+    if ( total_size > NET_BUFFER_SIZE ) {
+        // This will never fit in the ring: collect it piece by piece, once
+        // the last large frame handed out is done with.
+        if ( socket->large_frame.size > 0 ) {
+            return false;
+        }
+
+        if ( socket->large_frame.data == nullptr ) {
+            BufferInit(&socket->large_frame, packet_size);
+        }
+
+        socket->read_head += sizeof(PacketSize);
+        socket->large_frame_left = packet_size;
+
+        return NextPacket(socket, data, size, spill, spill_offset);
+    }
 
     // Do we have the entire packet after the size?
-    size_t total_size = sizeof(PacketSize) + packet_size;
-    if ( socket->read_size < total_size ) {
+    if ( available < total_size ) {
         return false; // Nope.
     }
 
     // We have an entire packet. Rejoice.
 
-    BufferWrite(buffer, read_buf + sizeof(PacketSize), packet_size);
+    u32 start = (socket->read_head + sizeof(PacketSize)) & RING_MASK;
+
+    if ( start + packet_size <= NET_BUFFER_SIZE ) {
+        *data = socket->read_buf + start;
+    } else {
+        BufferGrowIfNeeded(spill, packet_size);
+        *spill_offset = spill->size;
+        RingCopy(socket,
+                 socket->read_head + sizeof(PacketSize),
+                 spill->data + spill->size,
+                 packet_size);
+        spill->size += packet_size;
+    }
+
+    *size = packet_size;
+    socket->read_head += total_size;
+
+    return true;
+}
+
+int PacketReadBatch(Socket * socket, PacketBatch * batch)
+{
+    if ( batch->spill.data == nullptr ) {
+        BufferInit(&batch->spill, NET_BUFFER_SIZE);
+    }
+
+    batch->count = 0;
+    BufferClear(&batch->spill);
+
+    if ( socket->large_frame_left == 0 ) {
+        BufferClear(&socket->large_frame); // Handed out last time.
+    }
+
+    if ( !FillRing(socket) ) {
+        return -1;
+    }
+
+    // Spilled packets are located by offset until `spill` stops growing.
+    size_t spill_offsets[PACKET_BATCH_SIZE];
+
+    while ( batch->count < PACKET_BATCH_SIZE ) {
+        int i = batch->count;
+
+        if ( NextPacket(socket,
+                        &batch->packets[i].data,
+                        &batch->packets[i].size,
+                        &batch->spill,
+                        &spill_offsets[i]) ) {
+            batch->count++;
+            continue;
+        }
+
+        // While nothing in the batch points into the ring, a large frame can
+        // keep reading into it until it's done.
+        if ( i == 0
+            && socket->large_frame_left > 0
+            && (!socket->is_polled || socket->is_readable) ) {
+            u32 tail = socket->read_tail;
+
+            if ( !FillRing(socket) ) {
+                return -1;
+            }
+
+            if ( socket->read_tail != tail ) {
+                continue;
+            }
+        }
+
+        break;
+    }
+
+    for ( int i = 0; i < batch->count; i++ ) {
+        if ( spill_offsets[i] != SIZE_MAX ) {
+            batch->packets[i].data = batch->spill.data + spill_offsets[i];
+        }
+    }
+
+    return batch->count;
+}
+
+bool PacketRead(Socket * socket, Buffer * buffer)
+{
+    if ( socket->large_frame_left == 0 ) {
+        BufferClear(&socket->large_frame); // Handed out last time.
+    }
+
+    if ( !FillRing(socket) ) {
+        return false;
+    }
+
+    const char * data;
+    PacketSize size;
+    size_t spill_offset;
 
-    // Move anything after this packet to the front of the buffer.
-    memmove(read_buf, read_buf + total_size, socket->read_size - total_size);
-    socket->read_size -= total_size;
+    // A packet that wraps around the ring is copied straight to `buffer`.
+    if ( !NextPacket(socket, &data, &size, buffer, &spill_offset) ) {
+        return false;
+    }
+
+    if ( spill_offset == SIZE_MAX ) {
+        BufferWrite(buffer, data, size);
+    }
 
     return true;
 }
 
-bool PacketWrite(Socket * socket, Buffer * buffer)
+// Each thread has its own pool. A frame goes back to the pool of whichever
+// thread releases it last, which needn't be the one that made it.
+static thread_local Frame * _free_frames;
+
+Frame * NewFrame(void)
+{
+    Frame * frame = _free_frames;
+
+    if ( frame ) {
+        _free_frames = frame->next_free;
+    } else {
+        frame = (Frame *)calloc(1, sizeof(*frame));
+        BufferInit(&frame->payload, 256);
+    }
+
+    BufferClear(&frame->payload);
+    frame->refs = 1;
+    frame->next_free = nullptr;
+
+    return frame;
+}
+
+void RetainFrame(Frame * frame)
+{
+    frame->refs++;
+}
+
+void ReleaseFrame(Frame * frame)
+{
+    if ( --frame->refs == 0 ) {
+        frame->next_free = _free_frames;
+        _free_frames = frame;
+    }
+}
+
+static void Dequeue(SendQueue * queue)
+{
+    ReleaseFrame(queue->packets[queue->head].frame);
+    queue->head = (queue->head + 1) % NET_SEND_QUEUE_LENGTH;
+    queue->count--;
+    queue->offset = 0;
+}
+
+// Remove unreliable packets that are superseded by a newer one. A packet
+// that's partly sent has to go out whole, or the stream is corrupted.
+static void DropStalePackets(SendQueue * queue)
+{
+    int kept = 0;
+
+    for ( int i = 0; i < queue->count; i++ ) {
+        QueuedPacket * packet
+            = &queue->packets[(queue->head + i) % NET_SEND_QUEUE_LENGTH];
+
+        if ( packet->is_droppable && !(i == 0 && queue->offset > 0) ) {
+            queue->bytes -= packet->size;
+            ReleaseFrame(packet->frame);
+            continue;
+        }
+
+        queue->packets[(queue->head + kept) % NET_SEND_QUEUE_LENGTH] = *packet;
+        kept++;
+    }
+
+    queue->count = kept;
+}
+
+void PacketClearQueue(Socket * socket)
+{
+    SendQueue * queue = &socket->send_queue;
+
+    while ( queue->count > 0 ) {
+        Dequeue(queue);
+    }
+
+    queue->bytes = 0;
+}
+
+bool PacketFlush(Socket * socket)
 {
-    PacketSize size = buffer->size;
+    SendQueue * queue = &socket->send_queue;
+
+    if ( queue->count == 0 || (socket->is_polled && !socket->is_writable) ) {
+        return true;
+    }
 
-    BufferWrite(&socket->write_buf, &size, sizeof(size)); // Write size
-    BufferWrite(&socket->write_buf, buffer->data, size); // Write payload
+    // Header and payload of each packet straight from their frames.
+    NetSlice slices[NET_MAX_SLICES];
+    int nslices = 0;
+    int skip = queue->offset;
+
+    for ( int i = 0; i < queue->count; i++ ) {
+        Frame * frame
+            = queue->packets[(queue->head + i) % NET_SEND_QUEUE_LENGTH].frame;
+
+        if ( skip < (int)sizeof(frame->header) ) {
+            slices[nslices].data = (char *)&frame->header + skip;
+            slices[nslices].size = sizeof(frame->header) - skip;
+            nslices++;
+            skip = 0;
+        } else {
+            skip -= sizeof(frame->header);
+        }
+
+        if ( frame->payload.size > (size_t)skip ) {
+            slices[nslices].data = frame->payload.data + skip;
+            slices[nslices].size = (int)frame->payload.size - skip;
+            nslices++;
+        }
+
+        skip = 0;
+    }
 
-    // Send buffer contents.
-    if ( !NetWriteAll(socket, socket->write_buf.data, (int)socket->write_buf.size) ) {
+    int sent = NetWriteGather(socket, slices, nslices);
+    if ( sent == -1 ) {
+        // Nothing more can be sent: close it once what arrived has been read.
+        socket->is_hungup = true;
         return false;
     }
 
-    BufferClear(&socket->write_buf);
+    // A short write means the socket is full: wait for the next edge.
+    if ( sent < queue->bytes ) {
+        socket->is_writable = false;
+    }
+
+    queue->bytes -= sent;
+
+    while ( sent > 0 ) {
+        int left = queue->packets[queue->head].size - queue->offset;
+
+        if ( sent >= left ) {
+            sent -= left;
+            Dequeue(queue);
+        } else {
+            queue->offset += sent;
+            sent = 0;
+        }
+    }
 
     return true;
 }
+
+bool PacketWriteFrame(Socket * socket, Frame * frame, Delivery delivery)
+{
+    if ( frame->payload.size > 0xFFFF ) {
+        fprintf(stderr,
+                "PacketWrite: packet too large (%zu bytes)\n",
+                frame->payload.size);
+        return false;
+    }
+
+    frame->header = (PacketSize)frame->payload.size;
+
+    if ( socket->transport == TRANSPORT_UDP ) {
+        return UdpSend(socket, frame, delivery);
+    }
+
+    SendQueue * queue = &socket->send_queue;
+
+    if ( delivery == DELIVERY_UNRELIABLE ) {
+        DropStalePackets(queue);
+    }
+
+    int total_size = sizeof(frame->header) + frame->header;
+
+    if ( queue->count == NET_SEND_QUEUE_LENGTH
+        || queue->bytes + total_size > NET_SEND_QUEUE_LIMIT ) {
+        // The peer isn't keeping up. Hang up rather than queue without limit.
+        fprintf(stderr, "PacketWrite: send queue full, dropping connection\n");
+        socket->is_hungup = true;
+        return false;
+    }
+
+    QueuedPacket * packet
+        = &queue->packets[(queue->head + queue->count) % NET_SEND_QUEUE_LENGTH];
+
+    RetainFrame(frame);
+    packet->frame = frame;
+    packet->size = total_size;
+    packet->is_droppable = delivery == DELIVERY_UNRELIABLE;
+
+    queue->count++;
+    queue->bytes += total_size;
+
+    // Send what the socket will take now. The rest goes out on a later
+    // PacketFlush() or PacketWrite().
+    return PacketFlush(socket);
+}
+
+bool PacketWrite(Socket * socket, Buffer * buffer, Delivery delivery)
+{
+    Frame * frame = NewFrame();
+    BufferWrite(&frame->payload, buffer->data, buffer->size);
+
+    bool result = PacketWriteFrame(socket, frame, delivery);
+    ReleaseFrame(frame);
+
+    return result;
+}
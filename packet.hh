@@ -13,7 +13,66 @@
 
 typedef u16 PacketSize;
 
+/// A packet encoded once and shared, by reference count, between the send
+/// queues of any number of sockets. Don't change `payload` once the frame has
+/// been written to a socket.
+struct Frame {
+    Buffer payload;
+    PacketSize header; // Payload size, as it goes on the wire.
+    int refs;
+    Frame * next_free;
+};
+
+/// Get an empty frame with one reference from the frame pool.
+Frame * NewFrame(void);
+void RetainFrame(Frame * frame);
+void ReleaseFrame(Frame * frame);
+
+#define PACKET_BATCH_SIZE 32
+
+/// Packets received by one PacketReadBatch() call. Each points into the
+/// socket's receive ring where possible, or into `spill` for packets that wrap
+/// around the end of the ring or are larger than it.
+struct PacketBatch {
+    int count;
+    struct {
+        const char * data;
+        PacketSize size;
+    } packets[PACKET_BATCH_SIZE];
+    Buffer spill;
+};
+
+/// Read what the socket has and extract every complete packet, up to
+/// `PACKET_BATCH_SIZE`, in one pass. The packets stay valid until the next
+/// read from this socket.
+/// - returns: The number of packets, or -1 on error.
+int PacketReadBatch(Socket * socket, PacketBatch * batch);
+
+/// Read one packet and append it to `buffer`.
+/// - returns: `false` if there was no complete packet, or on error.
 bool PacketRead(Socket * socket, Buffer * buffer);
-bool PacketWrite(Socket * socket, Buffer * buffer);
+
+/// Append a whole packet to the socket's receive ring, for transports that
+/// receive whole messages.
+/// - returns: `false` if the ring doesn't have room for it.
+bool PacketPush(Socket * socket, const void * data, PacketSize size);
+
+/// Send the contents of `buffer` as one packet. Never blocks: what the socket
+/// can't take now waits in its send queue. Over TCP, queued unreliable packets
+/// are dropped when a newer one is written, and a peer that lets the queue
+/// reach `NET_SEND_QUEUE_LIMIT` is marked as hung up.
+bool PacketWrite(Socket * socket,
+                 Buffer * buffer,
+                 Delivery delivery = DELIVERY_RELIABLE);
+
+/// Queue `frame` on the socket without copying it. The socket holds its own
+/// reference until the frame is sent.
+bool PacketWriteFrame(Socket * socket,
+                      Frame * frame,
+                      Delivery delivery = DELIVERY_RELIABLE);
+
+/// Send as much of the socket's send queue as it will take.
+bool PacketFlush(Socket * socket);
+void PacketClearQueue(Socket * socket);
 
 #endif /* packet_hh */
@@ -1,4 +1,4 @@
-#include "misc.hh"
+#include "random.hh"
 #include <time.h>
 #include <stdlib.h>
 
@@ -16,13 +16,13 @@ void Randomize(void)
 
 // https://lemire.me/blog/
 
-static inline u32 Wyhash32(void)
+static inline u32 Wyhash32(u32 * next)
 {
     uint64_t tmp;
     uint32_t m1, m2;
 
-    next += 0xE120FC15;
-    tmp  = (uint64_t)next * 0x4A39B70D;
+    *next += 0xE120FC15;
+    tmp  = (uint64_t)*next * 0x4A39B70D;
     m1   = (uint32_t)(( tmp >> 32) ^ tmp );
     tmp  = (uint64_t)m1 * 0x12FAD5C9;
     m2   = (uint32_t)( (tmp >> 32) ^ tmp );
@@ -32,18 +32,18 @@ static inline u32 Wyhash32(void)
 
 u32 Rand32(void)
 {
-    return Wyhash32();
+    return Wyhash32(&next);
 }
 
 /// Returns a psuedo random interger between `min` and `max`, inclusive.
 u32 Rand(u32 min, u32 max)
 {
-    return Wyhash32() % (max - min + 1) + min;
+    return Wyhash32(&next) % (max - min + 1) + min;
 }
 
 static inline float _RandomFloat(void)
 {
-    return (float)((double)Wyhash32() / (double)0xFFFFFFFF);
+    return (float)((double)Wyhash32(&next) / (double)0xFFFFFFFF);
 }
 
 float RandF(float min, float max)
@@ -55,3 +55,28 @@ bool Chance(float percent)
 {
     return _RandomFloat() < percent;
 }
+
+Rng InitRng(u32 seed)
+{
+    return (Rng){ .next = seed };
+}
+
+u32 Rand32(Rng * rng)
+{
+    return Wyhash32(&rng->next);
+}
+
+u32 Rand(Rng * rng, u32 min, u32 max)
+{
+    return Wyhash32(&rng->next) % (max - min + 1) + min;
+}
+
+void Shuffle(int * values, int count, Rng * rng)
+{
+    for ( int i = count - 1; i > 0; i-- ) {
+        int j = Rand(rng, 0, i);
+        int temp = values[i];
+        values[i] = values[j];
+        values[j] = temp;
+    }
+}
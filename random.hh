@@ -10,6 +10,12 @@
 
 #include "misc.hh"
 
+/// An independent random number stream, for state that has to be copied or
+/// reproduced along with its owner.
+struct Rng {
+    u32 next;
+};
+
 void SeedRand(u32 seed);
 void Randomize(void);
 u32 Rand32(void);
@@ -17,4 +23,11 @@ u32 Rand(u32 min, u32 max);
 float RandF(float min, float max);
 bool Chance(float percent);
 
+Rng InitRng(u32 seed);
+u32 Rand32(Rng * rng);
+u32 Rand(Rng * rng, u32 min, u32 max);
+
+/// Put `values` in a random order drawn from `rng`.
+void Shuffle(int * values, int count, Rng * rng);
+
 #endif /* random_h */
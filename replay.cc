@@ -0,0 +1,250 @@
+//
+//  replay.cc
+//  NetTest2
+//
+
+#include "replay.hh"
+
+#include "map.hh"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Where the header's tick count is, which is filled in last, and where the
+// tick entries start.
+#define NTICKS_OFFSET 19
+#define HEADER_SIZE 27
+
+static void WriteVarint(FILE * file, u32 value)
+{
+    while ( value >= 0x80 ) {
+        fputc((int)(value & 0x7F) | 0x80, file);
+        value >>= 7;
+    }
+
+    fputc((int)value, file);
+}
+
+bool OpenReplay(ReplayWriter * writer,
+                const char * path,
+                int nplayers,
+                float dt,
+                u32 seed)
+{
+    writer->file = fopen(path, "wb");
+    writer->nticks = 0;
+    writer->idle_ticks = 0;
+
+    if ( writer->file == NULL ) {
+        fprintf(stderr, "Could not create replay %s\n", path);
+        return false;
+    }
+
+    u32 magic = REPLAY_MAGIC;
+    u16 version = REPLAY_VERSION;
+    u8 count = (u8)nplayers;
+    u32 unfinished = 0;
+
+    fwrite(&magic, sizeof(magic), 1, writer->file);
+    fwrite(&version, sizeof(version), 1, writer->file);
+    fwrite(&count, sizeof(count), 1, writer->file);
+    fwrite(&dt, sizeof(dt), 1, writer->file);
+    fwrite(&seed, sizeof(seed), 1, writer->file);
+    fwrite(&map_g.hash, sizeof(map_g.hash), 1, writer->file);
+    fwrite(&unfinished, sizeof(unfinished), 1, writer->file); // Ticks.
+    fwrite(&unfinished, sizeof(unfinished), 1, writer->file); // Final hash.
+
+    return true;
+}
+
+void RecordTick(ReplayWriter * writer, const Action actions[MAX_PLAYERS], int nplayers)
+{
+    if ( writer->file == NULL ) {
+        return;
+    }
+
+    writer->nticks++;
+    if ( writer->nticks % REPLAY_FLUSH_TICKS == 0 ) {
+        fflush(writer->file);
+    }
+
+    u8 mask = 0;
+    for ( int i = 0; i < nplayers; i++ ) {
+        if ( actions[i] != A_NONE ) {
+            mask |= 1 << i;
+        }
+    }
+
+    if ( mask == 0 ) {
+        writer->idle_ticks++;
+        return;
+    }
+
+    WriteVarint(writer->file, writer->idle_ticks);
+    fputc(mask, writer->file);
+
+    for ( int i = 0; i < nplayers; i++ ) {
+        if ( mask & (1 << i) ) {
+            fputc(actions[i], writer->file);
+        }
+    }
+
+    writer->idle_ticks = 0;
+}
+
+void CloseReplay(ReplayWriter * writer, u32 final_hash)
+{
+    if ( writer->file == NULL ) {
+        return;
+    }
+
+    WriteVarint(writer->file, writer->idle_ticks);
+    fputc(0, writer->file);
+
+    fseek(writer->file, NTICKS_OFFSET, SEEK_SET);
+    fwrite(&writer->nticks, sizeof(writer->nticks), 1, writer->file);
+    fwrite(&final_hash, sizeof(final_hash), 1, writer->file);
+
+    if ( ferror(writer->file) ) {
+        fprintf(stderr, "CloseReplay: write failed\n");
+    }
+
+    fclose(writer->file);
+    writer->file = NULL;
+}
+
+bool LoadReplay(Replay * replay, const char * path)
+{
+    memset(replay, 0, sizeof(*replay));
+
+    FILE * file = fopen(path, "rb");
+    if ( file == NULL ) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    replay->data = (u8 *)malloc(size > 0 ? size : 1);
+    if ( replay->data == NULL ) {
+        fprintf(stderr, "Could not allocate %ld bytes for %s\n", size, path);
+        fclose(file);
+        return false;
+    }
+
+    replay->size = fread(replay->data, 1, size > 0 ? size : 0, file);
+    fclose(file);
+
+    u32 magic;
+    u16 version;
+    u8 nplayers;
+    const u8 * p = replay->data;
+
+    if ( replay->size < HEADER_SIZE ) {
+        fprintf(stderr, "%s is too short to be a replay\n", path);
+        FreeReplay(replay);
+        return false;
+    }
+
+    memcpy(&magic, p + 0, sizeof(magic));
+    memcpy(&version, p + 4, sizeof(version));
+    memcpy(&nplayers, p + 6, sizeof(nplayers));
+    memcpy(&replay->dt, p + 7, sizeof(replay->dt));
+    memcpy(&replay->seed, p + 11, sizeof(replay->seed));
+    memcpy(&replay->map_hash, p + 15, sizeof(replay->map_hash));
+    memcpy(&replay->nticks, p + NTICKS_OFFSET, sizeof(replay->nticks));
+    memcpy(&replay->final_hash, p + 23, sizeof(replay->final_hash));
+
+    if ( magic != REPLAY_MAGIC || version != REPLAY_VERSION ) {
+        fprintf(stderr, "%s isn't a version %d replay\n", path, REPLAY_VERSION);
+        FreeReplay(replay);
+        return false;
+    }
+
+    if ( nplayers < 1 || nplayers > MAX_PLAYERS || replay->dt <= 0.0f ) {
+        fprintf(stderr, "%s has a bad header\n", path);
+        FreeReplay(replay);
+        return false;
+    }
+
+    replay->nplayers = nplayers;
+    RewindReplay(replay);
+
+    return true;
+}
+
+void RewindReplay(Replay * replay)
+{
+    replay->pos = HEADER_SIZE;
+    replay->idle_left = 0;
+    replay->has_gap = false;
+}
+
+static bool ReadVarint(Replay * replay, u32 * value)
+{
+    *value = 0;
+
+    for ( int shift = 0; shift < 32; shift += 7 ) {
+        if ( replay->pos >= replay->size ) {
+            return false;
+        }
+
+        u8 byte = replay->data[replay->pos++];
+        *value |= (u32)(byte & 0x7F) << shift;
+
+        if ( (byte & 0x80) == 0 ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool NextReplayTick(Replay * replay, Action actions[MAX_PLAYERS])
+{
+    memset(actions, A_NONE, MAX_PLAYERS * sizeof(Action));
+
+    if ( !replay->has_gap ) {
+        if ( !ReadVarint(replay, &replay->idle_left) ) {
+            return false; // Cut off: play what there is.
+        }
+
+        replay->has_gap = true;
+    }
+
+    if ( replay->idle_left > 0 ) {
+        replay->idle_left--;
+        return true;
+    }
+
+    if ( replay->pos >= replay->size ) {
+        return false;
+    }
+
+    u8 mask = replay->data[replay->pos++];
+    if ( mask == 0 ) {
+        return false; // The end.
+    }
+
+    for ( int i = 0; i < replay->nplayers; i++ ) {
+        if ( mask & (1 << i) ) {
+            if ( replay->pos >= replay->size ) {
+                return false;
+            }
+
+            actions[i] = replay->data[replay->pos++];
+        }
+    }
+
+    replay->has_gap = false;
+
+    return true;
+}
+
+void FreeReplay(Replay * replay)
+{
+    free(replay->data);
+    replay->data = NULL;
+}
@@ -0,0 +1,85 @@
+//
+//  replay.hh
+//  NetTest2
+//
+
+#ifndef replay_hh
+#define replay_hh
+
+#include "game.hh"
+
+#include <stdio.h>
+
+// A match recorded as its seed and every player's action each tick, which is
+// all it takes to run the simulation again exactly as it went.
+//
+// File layout, little-endian:
+//
+//     u32 magic, u16 version, u8 nplayers, f32 tick length, u32 seed,
+//     u32 map hash, u32 ticks, u32 final state hash (0 if the recording
+//     didn't finish)
+//
+// followed by one entry per tick on which anyone acted: the number of ticks
+// since the last entry on which no one did (LEB128), a byte with bit `n` set
+// if player `n` acted, and their actions. An entry with no bits set ends the
+// file. Players spend most ticks waiting out their move timer, so a match
+// takes a few tens of bytes per second.
+
+#define REPLAY_MAGIC 0x5232544E // "NT2R"
+#define REPLAY_VERSION 3 // Bumped whenever the simulation changes what it does.
+
+// Recorded ticks between writes to disk. A server that's killed loses at most
+// this many, and the rest plays back as a cut-off recording.
+#define REPLAY_FLUSH_TICKS 256
+
+struct ReplayWriter {
+    FILE * file; // NULL when not recording.
+    u32 nticks;
+    u32 idle_ticks; // Since the last entry.
+};
+
+struct Replay {
+    int nplayers;
+    float dt;
+    u32 seed;
+    u32 map_hash; // Of the map it was played on (see Map).
+    u32 nticks; // 0 if the recording didn't finish.
+    u32 final_hash;
+
+    u8 * data; // The whole file.
+    size_t size;
+    size_t pos; // Next unread byte of the tick entries.
+    u32 idle_left; // Idle ticks before the next entry.
+    bool has_gap; // `idle_left` has been read for the next entry.
+};
+
+/// Start recording a match on map_g to `path`.
+/// - returns: `false` if the file couldn't be created.
+bool OpenReplay(ReplayWriter * writer,
+                const char * path,
+                int nplayers,
+                float dt,
+                u32 seed);
+
+/// Record the actions of the tick about to be simulated. Does nothing if
+/// `writer` isn't recording.
+void RecordTick(ReplayWriter * writer, const Action actions[MAX_PLAYERS], int nplayers);
+
+/// Finish the file, noting the hash of the match's last state (see
+/// HashMatchState()) so playback can check it got the same result.
+void CloseReplay(ReplayWriter * writer, u32 final_hash);
+
+/// Read a whole replay file.
+/// - returns: `false` if it's missing or isn't a replay.
+bool LoadReplay(Replay * replay, const char * path);
+
+/// Go back to the first tick.
+void RewindReplay(Replay * replay);
+
+/// Get the actions of the next tick.
+/// - returns: `false` after the last tick.
+bool NextReplayTick(Replay * replay, Action actions[MAX_PLAYERS]);
+
+void FreeReplay(Replay * replay);
+
+#endif /* replay_hh */
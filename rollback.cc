@@ -0,0 +1,393 @@
+//
+//  rollback.cc
+//  NetTest2
+//
+
+#include "rollback.hh"
+
+#include "packet.hh"
+#include "random.hh"
+
+#include <stdio.h>
+#include <string.h>
+
+static Buffer _buffer;
+static PacketBatch _batch;
+
+void InitRollback(Rollback * rollback, int nplayers, float dt)
+{
+    memset(rollback, 0, sizeof(*rollback));
+    rollback->nplayers = nplayers;
+    rollback->dt = dt;
+}
+
+u32 RollbackConfirmed(const Rollback * rollback)
+{
+    u32 confirmed = rollback->ninputs[0];
+    for ( int i = 1; i < rollback->nplayers; i++ ) {
+        confirmed = min(confirmed, rollback->ninputs[i]);
+    }
+
+    return confirmed;
+}
+
+bool RollbackInput(Rollback * rollback, int player, u32 frame, Action action)
+{
+    if ( frame != rollback->ninputs[player] ) {
+        return false;
+    }
+
+    // Frames from here on may still be needed, for relaying or re-simulating.
+    u32 oldest = min(RollbackConfirmed(rollback), rollback->resim_frame);
+    if ( frame >= oldest + ROLLBACK_FRAMES ) {
+        return false;
+    }
+
+    if ( frame < rollback->frame && action != A_NONE ) {
+        // It ran predicted idle.
+        rollback->resim_frame = min(rollback->resim_frame, frame);
+    }
+
+    rollback->inputs[frame % ROLLBACK_FRAMES][player] = action;
+    rollback->ninputs[player]++;
+
+    return true;
+}
+
+/// The inputs to run `frame` with. Anyone we haven't heard from is predicted
+/// to be idle: moves are single actions rather than held keys, so repeating
+/// their last one would be wrong far more often.
+static void GetActions(const Rollback * rollback, u32 frame, Action * actions)
+{
+    for ( int i = 0; i < rollback->nplayers; i++ ) {
+        if ( frame < rollback->ninputs[i] ) {
+            actions[i] = rollback->inputs[frame % ROLLBACK_FRAMES][i];
+        } else {
+            actions[i] = A_NONE;
+        }
+    }
+}
+
+bool RollbackAdvance(Rollback * rollback,
+                     MatchState * state,
+                     int local_player,
+                     Action local_action)
+{
+    if ( rollback->frame >= RollbackConfirmed(rollback) + ROLLBACK_MAX_AHEAD ) {
+        return false;
+    }
+
+    Action actions[MAX_PLAYERS] = { 0 };
+
+    if ( rollback->resim_frame < rollback->frame ) {
+        double start = NetTime();
+
+        // Sounds from frames run again have already played, or are too late.
+        enum Sound sound = state->sound;
+        *state = rollback->saved[rollback->resim_frame % ROLLBACK_FRAMES];
+
+        for ( u32 f = rollback->resim_frame; f < rollback->frame; f++ ) {
+            rollback->saved[f % ROLLBACK_FRAMES] = *state;
+            GetActions(rollback, f, actions);
+            UpdateMatch(state, actions, rollback->dt);
+        }
+
+        state->sound = sound;
+
+        double sec = NetTime() - start;
+        rollback->nrollbacks++;
+        rollback->nresimulated += rollback->frame - rollback->resim_frame;
+        rollback->max_resim_sec = max(rollback->max_resim_sec, sec);
+    }
+
+    if ( local_player != -1 ) {
+        RollbackInput(rollback, local_player, rollback->frame, local_action);
+    }
+
+    GetActions(rollback, rollback->frame, actions);
+    rollback->saved[rollback->frame % ROLLBACK_FRAMES] = *state;
+    UpdateMatch(state, actions, rollback->dt);
+    rollback->frame++;
+    rollback->resim_frame = rollback->frame;
+
+    // States before the confirmed frame won't change again.
+    u32 last_final = min(RollbackConfirmed(rollback), rollback->frame - 1);
+    while ( rollback->nhashed <= last_final ) {
+        const MatchState * saved = &rollback->saved[rollback->nhashed % ROLLBACK_FRAMES];
+        rollback->hashes[rollback->nhashed % ROLLBACK_HASHES] = HashMatchState(saved);
+        rollback->nhashed++;
+    }
+
+    return true;
+}
+
+void WriteRollbackInputs(Buffer * buffer,
+                         const Rollback * rollback,
+                         int player,
+                         u32 first)
+{
+    u32 end = rollback->ninputs[player];
+
+    if ( first > end ) {
+        first = end;
+    } else if ( end - first > ROLLBACK_FRAMES ) {
+        // Older ones are gone, but a peer that far behind would have stalled
+        // everyone before it got there.
+        first = end - ROLLBACK_FRAMES;
+    }
+
+    u8 count = (u8)(end - first);
+    BufferWrite(buffer, &first, sizeof(first));
+    BufferWrite(buffer, &count, sizeof(count));
+
+    for ( u32 f = first; f < end; f++ ) {
+        BufferWrite(buffer, &rollback->inputs[f % ROLLBACK_FRAMES][player], sizeof(Action));
+    }
+}
+
+bool ReadRollbackInputs(BufferReader * reader, Rollback * rollback, int player)
+{
+    u32 first;
+    u8 count;
+    if ( !ReaderGet(reader, &first) || !ReaderGet(reader, &count) ) {
+        return false;
+    }
+
+    for ( int i = 0; i < count; i++ ) {
+        Action action;
+        if ( !ReaderGet(reader, &action) ) {
+            return false;
+        }
+
+        RollbackInput(rollback, player, first + i, action);
+    }
+
+    return true;
+}
+
+#pragma mark - Network
+
+static void BeginMessage(u8 type)
+{
+    if ( _buffer.data == NULL ) {
+        BufferInit(&_buffer, 256);
+    }
+
+    BufferClear(&_buffer);
+    BufferWrite(&_buffer, &type, sizeof(type));
+}
+
+/// Seed the match and tell every peer to start, once every seat is taken.
+/// - returns: `true` if the match has started.
+static bool StartMatch(Match * match, Rollback * rollback, float dt)
+{
+    if ( rollback->is_started ) {
+        return true;
+    }
+
+    int first_remote = match->has_local_player ? 1 : 0;
+    int nplayers = match->state.nplayers;
+
+    for ( int i = first_remote; i < nplayers; i++ ) {
+        if ( !match->connections[i].is_init ) {
+            return false;
+        }
+    }
+
+    u32 seed = Rand32();
+    InitMatch(&match->state, nplayers, seed);
+    InitRollback(rollback, nplayers, dt);
+
+    BeginMessage(RM_START);
+    BufferWrite(&_buffer, &seed, sizeof(seed));
+
+    for ( int i = first_remote; i < nplayers; i++ ) {
+        if ( !PacketWrite(&match->connections[i], &_buffer) ) {
+            fprintf(stderr, "StartMatch: packet write failed\n");
+        }
+    }
+
+    printf("Every seat is taken. Starting.\n");
+    rollback->is_started = true;
+
+    return true;
+}
+
+/// Compare peer `i`'s hash with ours, once ours for that frame is final.
+static void CheckPeerHash(Rollback * rollback, int i)
+{
+    PeerHash * peer = &rollback->peer_hashes[i];
+
+    if ( !peer->is_pending || peer->frame >= rollback->nhashed ) {
+        return;
+    }
+
+    peer->is_pending = false;
+
+    if ( rollback->nhashed - peer->frame > ROLLBACK_HASHES ) {
+        return; // Ours is gone.
+    }
+
+    u32 hash = rollback->hashes[peer->frame % ROLLBACK_HASHES];
+    if ( hash != peer->hash && !peer->is_desynced ) {
+        fprintf(stderr, "Desync: player %d's state differs from ours at frame %u\n",
+                i + 1, peer->frame);
+        NetLog("Desync: player %d at frame %u (%08x, ours %08x)",
+               i + 1, peer->frame, peer->hash, hash);
+        peer->is_desynced = true;
+    }
+}
+
+void RollbackServerUpdate(Match * match, Rollback * rollback, Action local_action)
+{
+    int first_remote = match->has_local_player ? 1 : 0;
+    int nplayers = match->state.nplayers;
+
+    // The seed isn't known until every peer can be given it.
+    if ( !StartMatch(match, rollback, 1.0f / tick_rate_g) ) {
+        return;
+    }
+
+    for ( int i = first_remote; i < nplayers; i++ ) {
+        Socket * connection = &match->connections[i];
+
+        if ( connection->is_init && rollback->is_dropped[i] ) {
+            // The lobby gave back its seat, but the match has moved on.
+            printf("Player %d can't rejoin a rollback match.\n", i + 1);
+            CloseConnection(match, i);
+        }
+
+        if ( connection->is_init ) {
+            int count = PacketReadBatch(connection, &_batch);
+            for ( int j = 0; j < count; j++ ) {
+                BufferReader reader = MakeReader(_batch.packets[j].data,
+                                                 _batch.packets[j].size);
+                u8 type = 0;
+                ReaderGet(&reader, &type);
+                if ( type != CM_ROLLBACK ) {
+                    continue;
+                }
+
+                for ( int p = 0; p < nplayers; p++ ) {
+                    u32 ack;
+                    if ( ReaderGet(&reader, &ack) ) {
+                        rollback->acks[i][p] = max(rollback->acks[i][p], ack);
+                    }
+                }
+
+                PeerHash * peer = &rollback->peer_hashes[i];
+                u32 frame;
+                u32 hash;
+                if ( ReadRollbackInputs(&reader, rollback, i)
+                    && ReaderGet(&reader, &frame)
+                    && ReaderGet(&reader, &hash)
+                    && !peer->is_pending ) {
+                    peer->frame = frame;
+                    peer->hash = hash;
+                    peer->is_pending = true;
+                }
+            }
+
+            if ( connection->is_hungup && !connection->is_readable ) {
+                CloseConnection(match, i);
+                rollback->is_dropped[i] = true;
+            }
+        }
+
+        if ( rollback->is_dropped[i] ) {
+            // Speak for them so the others don't wait.
+            while ( rollback->ninputs[i] <= rollback->frame
+                   && RollbackInput(rollback, i, rollback->ninputs[i], A_NONE) );
+        }
+    }
+
+    int local_player = match->has_local_player ? 0 : -1;
+    RollbackAdvance(rollback, &match->state, local_player, local_action);
+
+    for ( int i = first_remote; i < nplayers; i++ ) {
+        CheckPeerHash(rollback, i);
+    }
+
+    // Send every peer the inputs it's missing.
+    for ( int i = first_remote; i < nplayers; i++ ) {
+        Socket * connection = &match->connections[i];
+        if ( !connection->is_init ) {
+            continue;
+        }
+
+        BeginMessage(RM_INPUTS);
+        BufferWrite(&_buffer, &rollback->ninputs[i], sizeof(rollback->ninputs[i]));
+
+        for ( int p = 0; p < nplayers; p++ ) {
+            if ( p != i ) {
+                WriteRollbackInputs(&_buffer, rollback, p, rollback->acks[i][p]);
+            }
+        }
+
+        if ( !PacketWrite(connection, &_buffer, DELIVERY_UNRELIABLE)
+            || !PacketFlush(connection) ) {
+            fprintf(stderr, "RollbackServerUpdate: packet write failed\n");
+        }
+    }
+}
+
+void RollbackClientUpdate(Socket * socket,
+                          Rollback * rollback,
+                          MatchState * state,
+                          int player_index,
+                          Action action)
+{
+    int count = PacketReadBatch(socket, &_batch);
+    for ( int i = 0; i < count; i++ ) {
+        BufferReader reader = MakeReader(_batch.packets[i].data,
+                                         _batch.packets[i].size);
+        u8 type = 0;
+        ReaderGet(&reader, &type);
+
+        if ( type == RM_START ) {
+            u32 seed = 0;
+            ReaderGet(&reader, &seed);
+            InitMatch(state, state->nplayers, seed);
+            InitRollback(rollback, state->nplayers, 1.0f / tick_rate_g);
+            rollback->is_started = true;
+        } else if ( type == RM_INPUTS && rollback->is_started ) {
+            u32 ack;
+            if ( !ReaderGet(&reader, &ack) ) {
+                continue;
+            }
+            rollback->host_ack = max(rollback->host_ack, ack);
+
+            for ( int p = 0; p < state->nplayers; p++ ) {
+                if ( p != player_index && !ReadRollbackInputs(&reader, rollback, p) ) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if ( !rollback->is_started ) {
+        PacketFlush(socket);
+        return;
+    }
+
+    RollbackAdvance(rollback, state, player_index, action);
+
+    // What we have of everyone's inputs, so the host knows what to relay,
+    // and ours that the host doesn't have.
+    BeginMessage(CM_ROLLBACK);
+    for ( int p = 0; p < state->nplayers; p++ ) {
+        BufferWrite(&_buffer, &rollback->ninputs[p], sizeof(rollback->ninputs[p]));
+    }
+    WriteRollbackInputs(&_buffer, rollback, player_index, rollback->host_ack);
+
+    if ( rollback->nhashed > 0 ) {
+        u32 frame = rollback->nhashed - 1;
+        BufferWrite(&_buffer, &frame, sizeof(frame));
+        BufferWrite(&_buffer, &rollback->hashes[frame % ROLLBACK_HASHES], sizeof(u32));
+    }
+
+    if ( !PacketWrite(socket, &_buffer, DELIVERY_UNRELIABLE)
+        || !PacketFlush(socket) ) {
+        fprintf(stderr, "RollbackClientUpdate: packet write failed\n");
+    }
+}
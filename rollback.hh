@@ -0,0 +1,117 @@
+//
+//  rollback.hh
+//  NetTest2
+//
+
+#ifndef rollback_hh
+#define rollback_hh
+
+#include "buffer.hh"
+#include "match.hh"
+
+// Rollback netcode: every peer runs the whole simulation from the same seed,
+// and peers send each other only their inputs.
+//
+// A peer doesn't wait for remote inputs. When one hasn't arrived, it predicts
+// the player stayed idle and runs the frame anyway, keeping the state from
+// before each frame. When the real input turns up and differs from the
+// prediction, it restores the state from before that frame and runs every
+// frame since again with what it now knows. A frame is a fraction of a
+// millisecond to simulate, so catching up a few frames fits easily in one
+// tick.
+//
+// A peer may only predict ROLLBACK_MAX_AHEAD frames past the oldest input
+// it's missing. After that it stalls until inputs arrive, so nothing it has
+// to restore ever falls out of the buffers.
+//
+// Once every input before a frame is known, the state before it is final and
+// every peer should have the same one. Clients send the host the hash of
+// their newest final state, and the host reports any that differ from its own.
+
+#define ROLLBACK_MAX_AHEAD 8 // Frames a peer may predict.
+#define ROLLBACK_FRAMES (ROLLBACK_MAX_AHEAD * 2) // Inputs and states kept.
+#define ROLLBACK_HASHES 64 // Hashes of final states kept, to check peers.
+
+// First byte of a packet from a rollback host.
+enum RollbackMessage : u8 {
+    RM_START, // Followed by the match seed (u32). Every seat is taken.
+    RM_INPUTS, // Followed by how many of our inputs the host has (u32), then
+               // the inputs of every other player.
+};
+
+/// A peer's hash of its final state before `frame`, for the host to check.
+struct PeerHash {
+    u32 frame;
+    u32 hash;
+    bool is_pending; // Not checked yet: the host's state isn't final.
+    bool is_desynced; // Already reported.
+};
+
+struct Rollback {
+    u32 frame; // Next frame to simulate.
+    u32 ninputs[MAX_PLAYERS]; // Each player's input is known before this.
+    Action inputs[ROLLBACK_FRAMES][MAX_PLAYERS]; // By frame, once known.
+    MatchState saved[ROLLBACK_FRAMES]; // By frame: the state before it ran.
+    u32 resim_frame; // Oldest frame that ran with a wrong prediction.
+    u32 hashes[ROLLBACK_HASHES]; // By frame: HashMatchState() of the final
+                                 // state before it.
+    u32 nhashed; // Frames with a final hash.
+    int nplayers;
+    float dt;
+
+    // Kept by the network code.
+    bool is_started; // Every peer has the seed.
+    bool is_dropped[MAX_PLAYERS]; // Left after the start, idle from then on.
+    u32 acks[MAX_PLAYERS][MAX_PLAYERS]; // Host: inputs each peer has, by player.
+    u32 host_ack; // Client: how many of our inputs the host has.
+    PeerHash peer_hashes[MAX_PLAYERS]; // Host: what each peer's state hashed to.
+
+    int nrollbacks;
+    int nresimulated; // Frames run again, in all.
+    double max_resim_sec; // Longest catch-up before one frame.
+};
+
+void InitRollback(Rollback * rollback, int nplayers, float dt);
+
+/// - returns: The frame before which every player's input is known.
+u32 RollbackConfirmed(const Rollback * rollback);
+
+/// Add `player`'s input for `frame`. Inputs must come in order: one already
+/// known is ignored, as is one after a gap or too far ahead to store.
+/// - returns: `true` if it was added.
+bool RollbackInput(Rollback * rollback, int player, u32 frame, Action action);
+
+/// Correct any frames that ran with wrong predictions, then run the next one,
+/// with `local_action` as the input of `local_player` (-1 for none).
+/// - returns: `false` if the peer is too far ahead and has to wait.
+bool RollbackAdvance(Rollback * rollback,
+                     MatchState * state,
+                     int local_player,
+                     Action local_action);
+
+/// Append `player`'s known inputs from frame `first` on: the first frame
+/// (u32), a count (u8) and that many actions.
+void WriteRollbackInputs(Buffer * buffer,
+                         const Rollback * rollback,
+                         int player,
+                         u32 first);
+
+/// Read what WriteRollbackInputs() wrote and add the inputs for `player`.
+/// - returns: `false` if the message was cut short.
+bool ReadRollbackInputs(BufferReader * reader, Rollback * rollback, int player);
+
+/// Host side of a rollback match. Waits for every seat to be taken and sends
+/// the seed, then each tick relays every player's inputs to the peers that
+/// don't have them yet and runs a frame. A player who leaves is idle for the
+/// rest of the match.
+void RollbackServerUpdate(Match * match, Rollback * rollback, Action local_action);
+
+/// Client side: read the host's inputs, run a frame with `action` for player
+/// `player_index`, and send the host our inputs it doesn't have yet.
+void RollbackClientUpdate(Socket * socket,
+                          Rollback * rollback,
+                          MatchState * state,
+                          int player_index,
+                          Action action);
+
+#endif /* rollback_hh */
@@ -0,0 +1,252 @@
+//
+//  scheduler.cc
+//  NetTest2
+//
+
+#include "scheduler.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <SDL3/SDL.h>
+
+// After a stall, drop the lost time rather than run a burst of ticks.
+#define MAX_TICK_LAG_SEC 0.25
+
+static bool PopBack(Worker * worker, int * match_index)
+{
+    std::lock_guard<std::mutex> guard(worker->lock);
+
+    if ( worker->ready.empty() ) {
+        return false;
+    }
+
+    *match_index = worker->ready.back();
+    worker->ready.pop_back();
+
+    return true;
+}
+
+static bool StealFront(Worker * worker, int * match_index)
+{
+    std::lock_guard<std::mutex> guard(worker->lock);
+
+    if ( worker->ready.empty() ) {
+        return false;
+    }
+
+    *match_index = worker->ready.front();
+    worker->ready.pop_front();
+
+    return true;
+}
+
+/// Take new connections, pick up readiness changes for the shard's
+/// connections, then queue all of its matches.
+static void StartTick(Scheduler * scheduler, int w)
+{
+    Worker * worker = &scheduler->workers[w];
+
+    std::vector<LobbyJoin> joins;
+    {
+        std::lock_guard<std::mutex> guard(worker->lock);
+        joins.swap(worker->joins);
+    }
+
+    for ( const LobbyJoin & join : joins ) {
+        if ( !AddConnection(&scheduler->matches[join.match_index],
+                            join.player_index,
+                            join.socket,
+                            join.token,
+                            &worker->poller) ) {
+            fprintf(stderr, "Could not add player %d to match %d: %s\n",
+                    join.player_index + 1, join.match_index + 1, GetNetError());
+        }
+        free(join.socket);
+    }
+
+    NetEvent events[NET_MAX_EVENTS];
+    int count;
+    do {
+        count = PollerWait(&worker->poller, events, NET_MAX_EVENTS, 0);
+        if ( count == -1 ) {
+            fprintf(stderr, "Worker %d: PollerWait failed: %s\n",
+                    w, GetNetError());
+        }
+    } while ( count == NET_MAX_EVENTS );
+
+    int nqueued = 0;
+    std::lock_guard<std::mutex> guard(worker->lock);
+
+    for ( int i = w; i < scheduler->nmatches; i += scheduler->nworkers ) {
+        worker->ready.push_back(i);
+        nqueued++;
+    }
+
+    worker->pending.store(nqueued, std::memory_order_relaxed);
+}
+
+/// Run one queued match tick, our own if there is one, otherwise one stolen
+/// from another worker.
+/// - returns: `false` if there was nothing to run.
+static bool RunOneTick(Scheduler * scheduler, int w)
+{
+    Worker * self = &scheduler->workers[w];
+    int match_index;
+    int owner = w;
+
+    if ( !PopBack(self, &match_index) ) {
+        bool found = false;
+
+        for ( int i = 1; i < scheduler->nworkers && !found; i++ ) {
+            owner = (w + i) % scheduler->nworkers;
+            found = StealFront(&scheduler->workers[owner], &match_index);
+        }
+
+        if ( !found ) {
+            return false;
+        }
+
+        self->ticks_stolen++;
+    }
+
+    ServerUpdate(&scheduler->matches[match_index], A_NONE, scheduler->tick_sec);
+
+    // Publish the match's changes before the owner is allowed to poll.
+    scheduler->workers[owner].pending.fetch_sub(1, std::memory_order_release);
+
+    return true;
+}
+
+static void WorkerLoop(Scheduler * scheduler, int w, void (* main_task)(void))
+{
+    Worker * worker = &scheduler->workers[w];
+    u64 frequency = SDL_GetPerformanceFrequency();
+    u64 tick_counts = (u64)((double)frequency * scheduler->tick_sec);
+    u64 max_lag = (u64)((double)frequency * MAX_TICK_LAG_SEC);
+
+    worker->next_tick = SDL_GetPerformanceCounter();
+
+    while ( scheduler->is_running.load(std::memory_order_relaxed) ) {
+        u64 now = SDL_GetPerformanceCounter();
+        bool is_idle = worker->pending.load(std::memory_order_acquire) == 0;
+
+        if ( is_idle && now >= worker->next_tick ) {
+            if ( main_task ) {
+                main_task();
+            }
+
+            StartTick(scheduler, w);
+
+            worker->next_tick += tick_counts;
+            if ( now > worker->next_tick + max_lag ) {
+                worker->next_tick = now;
+            }
+        }
+
+        if ( RunOneTick(scheduler, w) ) {
+            continue;
+        }
+
+        if ( w == 0 && !is_running_g ) {
+            scheduler->is_running.store(false, std::memory_order_relaxed);
+        }
+
+        if ( is_idle ) {
+            // Nothing to do until the next tick: wait on our own connections
+            // for up to a millisecond, then look for work to steal again.
+            NetEvent events[NET_MAX_EVENTS];
+            u64 wait = worker->next_tick > now ? worker->next_tick - now : 0;
+            int timeout_ms = wait * 1000 >= frequency ? 1 : 0;
+            if ( PollerWait(&worker->poller, events, NET_MAX_EVENTS, timeout_ms) == -1 ) {
+                fprintf(stderr, "Worker %d: PollerWait failed: %s\n",
+                        w, GetNetError());
+            }
+        } else {
+            // Our last matches are running on other workers.
+            std::this_thread::yield();
+        }
+    }
+}
+
+bool InitScheduler(Scheduler * scheduler,
+                   Match * matches,
+                   int nmatches,
+                   int nworkers,
+                   float tick_sec)
+{
+    scheduler->matches = matches;
+    scheduler->nmatches = nmatches;
+    scheduler->nworkers = nworkers;
+    scheduler->tick_sec = tick_sec;
+    scheduler->is_running = true;
+    scheduler->workers = new Worker[nworkers](); // Zeroed.
+
+    for ( int i = 0; i < nworkers; i++ ) {
+        Worker * worker = &scheduler->workers[i];
+
+        worker->poller = CreatePoller();
+        if ( !worker->poller.is_init ) {
+            fprintf(stderr, "CreatePoller failed: %s\n", GetNetError());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void SchedulerJoin(Scheduler * scheduler, const LobbyJoin * join)
+{
+    Worker * worker = &scheduler->workers[join->match_index % scheduler->nworkers];
+
+    std::lock_guard<std::mutex> guard(worker->lock);
+    worker->joins.push_back(*join);
+}
+
+void RunScheduler(Scheduler * scheduler, void (* main_task)(void))
+{
+    printf("Running %d matches on %d worker threads\n",
+           scheduler->nmatches, scheduler->nworkers);
+
+    std::thread * threads = new std::thread[scheduler->nworkers];
+
+    for ( int i = 1; i < scheduler->nworkers; i++ ) {
+        threads[i] = std::thread(WorkerLoop, scheduler, i, nullptr);
+    }
+
+    WorkerLoop(scheduler, 0, main_task);
+
+    for ( int i = 1; i < scheduler->nworkers; i++ ) {
+        threads[i].join();
+    }
+
+    delete[] threads;
+
+    for ( int i = 0; i < scheduler->nworkers; i++ ) {
+        printf("Worker %d stole %d ticks\n",
+               i, scheduler->workers[i].ticks_stolen);
+    }
+}
+
+void CloseScheduler(Scheduler * scheduler)
+{
+    if ( scheduler->workers == NULL ) {
+        return;
+    }
+
+    for ( int i = 0; i < scheduler->nworkers; i++ ) {
+        Worker * worker = &scheduler->workers[i];
+
+        for ( const LobbyJoin & join : worker->joins ) {
+            CloseSocket(join.socket);
+            free(join.socket);
+        }
+
+        if ( worker->poller.is_init ) {
+            ClosePoller(&worker->poller);
+        }
+    }
+
+    delete[] scheduler->workers;
+    scheduler->workers = NULL;
+}
@@ -0,0 +1,71 @@
+//
+//  scheduler.hh
+//  NetTest2
+//
+
+#ifndef scheduler_hh
+#define scheduler_hh
+
+#include "lobby.hh"
+#include "match.hh"
+#include "net.hh"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Runs the ticks of many matches on a pool of worker threads.
+//
+// Each worker owns a shard of matches (match `i` belongs to worker
+// `i % nworkers`) and a Poller their connections are registered with. Once
+// per tick the worker polls for readiness and queues every match in its shard.
+// Workers take ticks from the back of their own queue, and when that's empty
+// steal from the front of another worker's, so one busy shard doesn't hold
+// back its matches while other cores sit idle.
+//
+// A worker only polls when every match in its shard has finished its tick, so
+// a match's sockets are never touched by two threads at once. New connections
+// from the lobby are handed to the owning worker the same way.
+
+struct Worker {
+    Poller poller;
+
+    std::mutex lock; // Guards `ready` and `joins`.
+    std::deque<int> ready; // Indices of matches waiting to run this tick.
+    std::vector<LobbyJoin> joins; // Connections to add before the next tick.
+    std::atomic<int> pending; // Matches in the shard that haven't finished.
+
+    u64 next_tick; // Performance counter time of the next tick.
+    int ticks_stolen; // Ticks this worker ran from other shards.
+};
+
+struct Scheduler {
+    Match * matches;
+    int nmatches;
+    Worker * workers;
+    int nworkers;
+
+    float tick_sec;
+    std::atomic<bool> is_running;
+};
+
+/// Create `nworkers` workers, each with a Poller, to run `matches`.
+/// - returns: `false` on error.
+bool InitScheduler(Scheduler * scheduler,
+                   Match * matches,
+                   int nmatches,
+                   int nworkers,
+                   float tick_sec);
+
+/// Queue a seated connection for the worker that owns its match.
+void SchedulerJoin(Scheduler * scheduler, const LobbyJoin * join);
+
+/// Run every match until `is_running_g` is cleared. Worker 0 runs on the
+/// calling thread, and calls `main_task` (if not `NULL`) once per tick, for
+/// work that isn't part of any match.
+void RunScheduler(Scheduler * scheduler, void (* main_task)(void));
+
+void CloseScheduler(Scheduler * scheduler);
+
+#endif /* scheduler_hh */
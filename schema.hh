@@ -0,0 +1,211 @@
+//
+//  schema.hh
+//  NetTest2
+//
+
+#ifndef schema_hh
+#define schema_hh
+
+#include "buffer.hh"
+#include "misc.hh"
+
+// Bit-packed serialization described at compile time.
+//
+// A schema lists a struct's fields with the number of bits and the range each
+// one needs:
+//
+//     typedef Schema<Ring,
+//         SCHEMA_FIELD(Ring, x, 5, 0),
+//         SCHEMA_FIELD(Ring, y, 5, 0),
+//         SCHEMA_FIELD(Ring, type, 4, 0)
+//     > RingSchema;
+//
+// RingSchema::Pack() and Unpack() expand to straight-line code for exactly
+// those fields. Fields that aren't listed, like padding, never go on the wire.
+// Values are stored as `value - min` and clamped to the range `min` to
+// `min + 2^bits - 1`. Bits are written least significant first, so the
+// format doesn't depend on struct layout or host byte order.
+
+// MARK: - Bit Streams
+
+struct BitWriter {
+    Buffer * buffer;
+    u64 scratch;
+    int scratch_bits;
+};
+
+struct BitReader {
+    const u8 * data;
+    size_t size;
+    size_t offset;
+    u64 scratch;
+    int scratch_bits;
+    bool is_overflow;
+};
+
+inline BitWriter MakeBitWriter(Buffer * buffer)
+{
+    BitWriter writer = {
+        .buffer = buffer,
+        .scratch = 0,
+        .scratch_bits = 0,
+    };
+
+    return writer;
+}
+
+inline BitReader MakeBitReader(const void * data, size_t size)
+{
+    BitReader reader = {
+        .data = (const u8 *)data,
+        .size = size,
+        .offset = 0,
+        .scratch = 0,
+        .scratch_bits = 0,
+        .is_overflow = false,
+    };
+
+    return reader;
+}
+
+/// Write the low `bits` bits of `value`. `bits` may be 1 to 32.
+inline void BitWrite(BitWriter * writer, u32 value, int bits)
+{
+    u64 mask = (1ull << bits) - 1;
+    writer->scratch |= (value & mask) << writer->scratch_bits;
+    writer->scratch_bits += bits;
+
+    if ( writer->scratch_bits >= 32 ) {
+        u8 word[4] = {
+            (u8)writer->scratch,
+            (u8)(writer->scratch >> 8),
+            (u8)(writer->scratch >> 16),
+            (u8)(writer->scratch >> 24),
+        };
+        BufferWrite(writer->buffer, word, sizeof(word));
+        writer->scratch >>= 32;
+        writer->scratch_bits -= 32;
+    }
+}
+
+/// Write out any partial byte. The stream is padded with zero bits.
+inline void BitFlush(BitWriter * writer)
+{
+    while ( writer->scratch_bits > 0 ) {
+        u8 byte = (u8)writer->scratch;
+        BufferWrite(writer->buffer, &byte, 1);
+        writer->scratch >>= 8;
+        writer->scratch_bits -= 8;
+    }
+
+    writer->scratch = 0;
+    writer->scratch_bits = 0;
+}
+
+/// Read `bits` bits (1 to 32). Reading past the end returns zero bits and sets
+/// `is_overflow`.
+inline u32 BitRead(BitReader * reader, int bits)
+{
+    while ( reader->scratch_bits < bits ) {
+        if ( reader->offset < reader->size ) {
+            u64 byte = reader->data[reader->offset++];
+            reader->scratch |= byte << reader->scratch_bits;
+        } else {
+            reader->is_overflow = true;
+        }
+        reader->scratch_bits += 8;
+    }
+
+    u32 value = (u32)(reader->scratch & ((1ull << bits) - 1));
+    reader->scratch >>= bits;
+    reader->scratch_bits -= bits;
+
+    return value;
+}
+
+// MARK: - Schemas
+
+/// One quantized value of `Bits` bits, from `Min` to `Min + 2^Bits - 1`.
+template <int Bits, int Min>
+struct Quantized {
+    static_assert(Bits >= 1 && Bits <= 32, "Quantized: bad bit width");
+
+    template <typename T>
+    static void Pack(BitWriter * writer, T value)
+    {
+        const s64 lo = Min;
+        const s64 hi = lo + (s64)((1ull << Bits) - 1);
+
+        s64 v = value;
+        v = v < lo ? lo : v;
+        v = v > hi ? hi : v;
+        BitWrite(writer, (u32)(v - Min), Bits);
+    }
+
+    template <typename T>
+    static void Unpack(BitReader * reader, T * value)
+    {
+        *value = (T)((s64)BitRead(reader, Bits) + Min);
+    }
+};
+
+/// A member of struct `S`, stored as a Quantized<Bits, Min>.
+template <typename S, typename M, M S::* Member, int Bits, int Min>
+struct SchemaField {
+    static void Pack(BitWriter * writer, const S * object)
+    {
+        Quantized<Bits, Min>::Pack(writer, object->*Member);
+    }
+
+    static void Unpack(BitReader * reader, S * object)
+    {
+        Quantized<Bits, Min>::Unpack(reader, &(object->*Member));
+    }
+
+    static bool Equal(const S * a, const S * b)
+    {
+        return a->*Member == b->*Member;
+    }
+
+    static const int bits = Bits;
+};
+
+#define SCHEMA_FIELD(S, member, bits, min) \
+    SchemaField<S, decltype(S::member), &S::member, bits, min>
+
+/// The fields of `S` that go on the wire, in order.
+template <typename S, typename... Fields>
+struct Schema {
+    static void Pack(BitWriter * writer, const S * object)
+    {
+        int expand[] = { (Fields::Pack(writer, object), 0)... };
+        (void)expand;
+    }
+
+    static void Unpack(BitReader * reader, S * object)
+    {
+        int expand[] = { (Fields::Unpack(reader, object), 0)... };
+        (void)expand;
+    }
+
+    /// - returns: `true` if every field in the schema is the same.
+    static bool Equal(const S * a, const S * b)
+    {
+        bool equal = true;
+        int expand[] = { (equal &= Fields::Equal(a, b), 0)... };
+        (void)expand;
+        return equal;
+    }
+
+    static constexpr int Bits(void)
+    {
+        int total = 0;
+        int bits[] = { Fields::bits... };
+        for ( int b : bits ) {
+            total += b;
+        }
+        return total;
+    }
+};
+
+#endif /* schema_hh */
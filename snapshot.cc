@@ -0,0 +1,251 @@
+//
+//  snapshot.cc
+//  NetTest2
+//
+
+#include "snapshot.hh"
+
+#include "map.hh"
+#include "udp.hh"
+
+#include <string.h>
+
+// Encoded snapshot, as one bit stream:
+//
+//   32 bits  tick
+//    5 bits  age          tick - baseline tick, or 0 for a full snapshot
+//   24 bits  changed      one bit per field, see FIELD_*
+//   ...                   each changed field, in FIELD_* order
+
+enum {
+    FIELD_PLAYERS = 0,
+    FIELD_NRINGS = FIELD_PLAYERS + MAX_PLAYERS,
+    FIELD_RINGS,
+    FIELD_SOCKETS = FIELD_RINGS + MAX_RINGS,
+    FIELD_DISPOSAL = FIELD_SOCKETS + NUM_SOCKETS,
+    FIELD_SOUND,
+    FIELD_INPUT_SEQS,
+    NUM_FIELDS,
+};
+
+#define AGE_BITS 5
+#define RING_TYPE_BITS 4
+
+static_assert(SNAPSHOT_HISTORY <= (1 << AGE_BITS), "age doesn't fit");
+static_assert(NUM_RING_TYPES <= (1 << RING_TYPE_BITS), "ring type doesn't fit");
+static_assert(NUM_FIELDS <= 32, "too many snapshot fields for the mask");
+
+// Draw offsets are at most a tile either way. Health can go below zero when a
+// player keeps getting hit; anything under -16 is clamped.
+typedef Schema<Player,
+    SCHEMA_FIELD(Player, x, MAP_COORD_BITS, 0),
+    SCHEMA_FIELD(Player, y, MAP_COORD_BITS, 0),
+    SCHEMA_FIELD(Player, offx, 5, -TILE_SIZE),
+    SCHEMA_FIELD(Player, offy, 5, -TILE_SIZE),
+    SCHEMA_FIELD(Player, health, 5, -16),
+    SCHEMA_FIELD(Player, held, RING_TYPE_BITS, 0),
+    SCHEMA_FIELD(Player, pts, 8, -128)
+> PlayerSchema;
+
+typedef Schema<Ring,
+    SCHEMA_FIELD(Ring, x, MAP_COORD_BITS, 0),
+    SCHEMA_FIELD(Ring, y, MAP_COORD_BITS, 0),
+    SCHEMA_FIELD(Ring, type, RING_TYPE_BITS, 0)
+> RingSchema;
+
+typedef Quantized<3, 0> NumRings;
+typedef Quantized<RING_TYPE_BITS, 0> RingTypeField;
+typedef Quantized<4, 0> SoundType;
+typedef Quantized<16, 0> InputSeq;
+
+static_assert(TILE_SIZE * 2 < 32, "draw offsets don't fit");
+static_assert(MAX_RINGS < 8, "ring count doesn't fit");
+static_assert(S_MATCH_OVER < 16, "sound doesn't fit");
+
+// A snapshot with every field, which is as big as they get, has to go out as
+// one message on either transport.
+constexpr int MAX_SNAPSHOT_BITS = 32 + AGE_BITS + NUM_FIELDS
+    + MAX_PLAYERS * PlayerSchema::Bits()
+    + 3 // NumRings
+    + MAX_RINGS * RingSchema::Bits()
+    + (NUM_SOCKETS + 1) * RING_TYPE_BITS
+    + 4 // SoundType
+    + MAX_PLAYERS * 16; // InputSeq
+
+static_assert((MAX_SNAPSHOT_BITS + 7) / 8 <= UDP_MAX_MESSAGE, "snapshot too large");
+
+void StoreSnapshot(SnapshotHistory * history, const Snapshot * snapshot)
+{
+    history->snapshots[snapshot->tick % SNAPSHOT_HISTORY] = *snapshot;
+}
+
+const Snapshot * FindSnapshot(const SnapshotHistory * history, u32 tick)
+{
+    const Snapshot * snapshot = &history->snapshots[tick % SNAPSHOT_HISTORY];
+
+    if ( tick == 0 || snapshot->tick != tick ) {
+        return NULL;
+    }
+
+    return snapshot;
+}
+
+static u32 ChangedFields(const Snapshot * a, const Snapshot * b)
+{
+    u32 changed = 0;
+
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        if ( !PlayerSchema::Equal(&a->players[i], &b->players[i]) ) {
+            changed |= 1u << (FIELD_PLAYERS + i);
+        }
+    }
+
+    if ( a->nrings != b->nrings ) {
+        changed |= 1u << FIELD_NRINGS;
+    }
+
+    for ( int i = 0; i < MAX_RINGS; i++ ) {
+        if ( !RingSchema::Equal(&a->rings[i], &b->rings[i]) ) {
+            changed |= 1u << (FIELD_RINGS + i);
+        }
+    }
+
+    for ( int i = 0; i < NUM_SOCKETS; i++ ) {
+        if ( a->sockets[i] != b->sockets[i] ) {
+            changed |= 1u << (FIELD_SOCKETS + i);
+        }
+    }
+
+    if ( a->disposal != b->disposal ) {
+        changed |= 1u << FIELD_DISPOSAL;
+    }
+
+    if ( a->sound != b->sound ) {
+        changed |= 1u << FIELD_SOUND;
+    }
+
+    if ( memcmp(a->input_seqs, b->input_seqs, sizeof(a->input_seqs)) != 0 ) {
+        changed |= 1u << FIELD_INPUT_SEQS;
+    }
+
+    return changed;
+}
+
+void EncodeSnapshot(const Snapshot * snapshot,
+                    const Snapshot * baseline,
+                    Buffer * out)
+{
+    u32 age = 0;
+    u32 changed = (1u << NUM_FIELDS) - 1;
+
+    if ( baseline ) {
+        age = snapshot->tick - baseline->tick;
+        changed = ChangedFields(snapshot, baseline);
+    }
+
+    BitWriter writer = MakeBitWriter(out);
+    BitWrite(&writer, snapshot->tick, 32);
+    BitWrite(&writer, age, AGE_BITS);
+    BitWrite(&writer, changed, NUM_FIELDS);
+
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        if ( changed & (1u << (FIELD_PLAYERS + i)) ) {
+            PlayerSchema::Pack(&writer, &snapshot->players[i]);
+        }
+    }
+
+    if ( changed & (1u << FIELD_NRINGS) ) {
+        NumRings::Pack(&writer, snapshot->nrings);
+    }
+
+    for ( int i = 0; i < MAX_RINGS; i++ ) {
+        if ( changed & (1u << (FIELD_RINGS + i)) ) {
+            RingSchema::Pack(&writer, &snapshot->rings[i]);
+        }
+    }
+
+    for ( int i = 0; i < NUM_SOCKETS; i++ ) {
+        if ( changed & (1u << (FIELD_SOCKETS + i)) ) {
+            RingTypeField::Pack(&writer, snapshot->sockets[i]);
+        }
+    }
+
+    if ( changed & (1u << FIELD_DISPOSAL) ) {
+        RingTypeField::Pack(&writer, snapshot->disposal);
+    }
+
+    if ( changed & (1u << FIELD_SOUND) ) {
+        SoundType::Pack(&writer, snapshot->sound);
+    }
+
+    if ( changed & (1u << FIELD_INPUT_SEQS) ) {
+        for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+            InputSeq::Pack(&writer, snapshot->input_seqs[i]);
+        }
+    }
+
+    BitFlush(&writer);
+}
+
+bool DecodeSnapshot(BitReader * reader,
+                    const SnapshotHistory * history,
+                    Snapshot * out)
+{
+    u32 tick = BitRead(reader, 32);
+    u32 age = BitRead(reader, AGE_BITS);
+    u32 changed = BitRead(reader, NUM_FIELDS);
+
+    if ( reader->is_overflow || tick == 0 ) {
+        return false;
+    }
+
+    if ( age ) {
+        const Snapshot * baseline = FindSnapshot(history, tick - age);
+        if ( baseline == NULL ) {
+            return false;
+        }
+        *out = *baseline;
+    } else {
+        memset(out, 0, sizeof(*out));
+    }
+
+    out->tick = tick;
+
+    for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+        if ( changed & (1u << (FIELD_PLAYERS + i)) ) {
+            PlayerSchema::Unpack(reader, &out->players[i]);
+        }
+    }
+
+    if ( changed & (1u << FIELD_NRINGS) ) {
+        NumRings::Unpack(reader, &out->nrings);
+    }
+
+    for ( int i = 0; i < MAX_RINGS; i++ ) {
+        if ( changed & (1u << (FIELD_RINGS + i)) ) {
+            RingSchema::Unpack(reader, &out->rings[i]);
+        }
+    }
+
+    for ( int i = 0; i < NUM_SOCKETS; i++ ) {
+        if ( changed & (1u << (FIELD_SOCKETS + i)) ) {
+            RingTypeField::Unpack(reader, &out->sockets[i]);
+        }
+    }
+
+    if ( changed & (1u << FIELD_DISPOSAL) ) {
+        RingTypeField::Unpack(reader, &out->disposal);
+    }
+
+    if ( changed & (1u << FIELD_SOUND) ) {
+        SoundType::Unpack(reader, &out->sound);
+    }
+
+    if ( changed & (1u << FIELD_INPUT_SEQS) ) {
+        for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+            InputSeq::Unpack(reader, &out->input_seqs[i]);
+        }
+    }
+
+    return !reader->is_overflow;
+}
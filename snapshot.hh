@@ -0,0 +1,57 @@
+//
+//  snapshot.hh
+//  NetTest2
+//
+
+#ifndef snapshot_hh
+#define snapshot_hh
+
+#include "buffer.hh"
+#include "game.hh"
+#include "schema.hh"
+
+// Game state as the server sends it to clients.
+//
+// The server keeps the last SNAPSHOT_HISTORY snapshots. Each client acks the
+// newest one it has, and the server sends only the fields that changed since
+// that one. Without a usable baseline it sends every field. Fields are
+// bit-packed with the schemas in snapshot.cc.
+
+#define SNAPSHOT_HISTORY 32
+
+struct Snapshot {
+    u32 tick; // 0 means empty.
+    Player players[MAX_PLAYERS];
+    u8 nrings;
+    Ring rings[MAX_RINGS];
+    u8 sockets[NUM_SOCKETS];
+    u8 disposal;
+    u8 sound;
+    u16 input_seqs[MAX_PLAYERS]; // Newest input simulated for each player.
+};
+
+/// The last `SNAPSHOT_HISTORY` snapshots, indexed by tick.
+struct SnapshotHistory {
+    Snapshot snapshots[SNAPSHOT_HISTORY];
+};
+
+void StoreSnapshot(SnapshotHistory * history, const Snapshot * snapshot);
+
+/// - returns: The snapshot for `tick`, or `NULL` if it's not in the history.
+const Snapshot * FindSnapshot(const SnapshotHistory * history, u32 tick);
+
+/// Append `snapshot` to `out` as a delta against `baseline`, or with every
+/// field if `baseline` is `NULL`.
+void EncodeSnapshot(const Snapshot * snapshot,
+                    const Snapshot * baseline,
+                    Buffer * out);
+
+/// Read a snapshot encoded by EncodeSnapshot(), looking up its baseline in
+/// `history`.
+/// - returns: `false` if the data is malformed or the baseline is no longer
+///   in the history.
+bool DecodeSnapshot(BitReader * reader,
+                    const SnapshotHistory * history,
+                    Snapshot * out);
+
+#endif /* snapshot_hh */
@@ -0,0 +1,379 @@
+//
+//  bench.cc
+//  NetTest2
+//
+//  Times the pieces of a simulation step, and a whole one, over seeded random
+//  inputs, and counts heap allocations, so a change to the simulation can be
+//  measured before it goes near a server's tick budget.
+//
+//  The pieces are static in match.cc, which is compiled in here to get at them
+//  rather than linked.
+//
+
+#include "../match.cc"
+#include "../packet.hh"
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Read by the server code in match.cc. The game defines it in game.cc.
+float send_rate_g = 60.0f;
+
+#define BENCH_INPUTS 4096 // Pregenerated inputs each benchmark cycles through.
+#define BENCH_DT (1.0f / 60.0f)
+
+// -----------------------------------------------------------------------------
+#pragma mark - Allocation Counting
+
+// malloc, calloc and realloc are replaced with versions that count calls and
+// pass them on to the C library's. Looking those up can itself allocate, which
+// is served from a small static heap.
+
+typedef void * (* MallocFunc)(size_t);
+typedef void * (* CallocFunc)(size_t, size_t);
+typedef void * (* ReallocFunc)(void *, size_t);
+typedef void (* FreeFunc)(void *);
+
+static u64 _nallocs;
+static MallocFunc _malloc;
+static CallocFunc _calloc;
+static ReallocFunc _realloc;
+static FreeFunc _free;
+static bool _is_resolving;
+static char _early_heap[4096];
+static size_t _early_used;
+
+static void ResolveAllocator(void)
+{
+    _is_resolving = true;
+    _malloc = (MallocFunc)dlsym(RTLD_NEXT, "malloc");
+    _calloc = (CallocFunc)dlsym(RTLD_NEXT, "calloc");
+    _realloc = (ReallocFunc)dlsym(RTLD_NEXT, "realloc");
+    _free = (FreeFunc)dlsym(RTLD_NEXT, "free");
+    _is_resolving = false;
+}
+
+static void * EarlyAlloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if ( _early_used + size > sizeof(_early_heap) ) {
+        return NULL;
+    }
+
+    void * result = _early_heap + _early_used; // Zeroed, being static.
+    _early_used += size;
+
+    return result;
+}
+
+static bool IsEarly(void * ptr)
+{
+    return (char *)ptr >= _early_heap && (char *)ptr < _early_heap + sizeof(_early_heap);
+}
+
+extern "C" void * malloc(size_t size)
+{
+    if ( _malloc == NULL ) {
+        if ( _is_resolving ) {
+            return EarlyAlloc(size);
+        }
+        ResolveAllocator();
+    }
+
+    _nallocs++;
+    return _malloc(size);
+}
+
+extern "C" void * calloc(size_t count, size_t size)
+{
+    if ( _calloc == NULL ) {
+        if ( _is_resolving ) {
+            return EarlyAlloc(count * size);
+        }
+        ResolveAllocator();
+    }
+
+    _nallocs++;
+    return _calloc(count, size);
+}
+
+extern "C" void * realloc(void * ptr, size_t size)
+{
+    if ( _realloc == NULL ) {
+        ResolveAllocator();
+    }
+
+    if ( IsEarly(ptr) ) {
+        return NULL; // Never happens: it's only for the lookup.
+    }
+
+    _nallocs++;
+    return _realloc(ptr, size);
+}
+
+extern "C" void free(void * ptr)
+{
+    if ( IsEarly(ptr) ) {
+        return;
+    }
+
+    if ( _free == NULL ) {
+        ResolveAllocator();
+    }
+
+    _free(ptr);
+}
+
+// -----------------------------------------------------------------------------
+#pragma mark - Benchmarks
+
+struct BenchInput {
+    u8 player;
+    s8 dx;
+    s8 dy;
+    u16 x;
+    u16 y;
+    Action actions[MAX_PLAYERS];
+};
+
+static BenchInput _inputs[BENCH_INPUTS];
+static MatchState _state;
+static SnapshotHistory _history;
+static u32 _tick;
+
+/// A match a minute in, with the rings, held rings and filled sockets that
+/// the pieces have to look through.
+static void SetUpMatch(u32 seed)
+{
+    InitMatch(&_state, MAX_PLAYERS, seed);
+
+    Action actions[MAX_PLAYERS];
+    for ( int t = 0; t < 60 * 60; t++ ) {
+        for ( int i = 0; i < MAX_PLAYERS; i++ ) {
+            actions[i] = _inputs[(t + i * 97) % BENCH_INPUTS].actions[i];
+        }
+        UpdateMatch(&_state, actions, BENCH_DT);
+    }
+
+    for ( int s = 0; s < NUM_SOCKETS; s += 2 ) {
+        _state.sockets[s] = (u8)(1 + s % (NUM_RING_TYPES - 1));
+    }
+
+    _state.game_state = GS_PLAY;
+}
+
+static void GenerateInputs(u32 seed)
+{
+    Rng rng = InitRng(seed);
+    static const s8 dirs[4][2] = { { 0, -1 }, { 0, 1 }, { -1, 0 }, { 1, 0 } };
+    static const Action actions[5] = {
+        A_MOVE_UP, A_MOVE_DOWN, A_MOVE_LEFT, A_MOVE_RIGHT, A_NONE
+    };
+
+    for ( int i = 0; i < BENCH_INPUTS; i++ ) {
+        BenchInput * input = &_inputs[i];
+        int dir = Rand(&rng, 0, 3);
+
+        input->player = (u8)Rand(&rng, 0, MAX_PLAYERS - 1);
+        input->dx = dirs[dir][0];
+        input->dy = dirs[dir][1];
+        input->x = (u16)Rand(&rng, 0, map_g.width - 1);
+        input->y = (u16)Rand(&rng, 0, map_g.height - 1);
+
+        for ( int p = 0; p < MAX_PLAYERS; p++ ) {
+            input->actions[p] = actions[Rand(&rng, 0, 4)];
+        }
+    }
+}
+
+static void BenchTryMovePlayer(int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        const BenchInput * input = &_inputs[i % BENCH_INPUTS];
+        Player * player = &_state.players[input->player];
+        TryMovePlayer(&_state, player, player->x + input->dx, player->y + input->dy);
+    }
+}
+
+static void BenchCollideWithPlayer(int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        const BenchInput * input = &_inputs[i % BENCH_INPUTS];
+        Player * self = &_state.players[input->player];
+
+        // Every other try lands on the next player.
+        int x = input->x;
+        int y = input->y;
+        if ( i & 1 ) {
+            const Player * other = &_state.players[(input->player + 1) % MAX_PLAYERS];
+            x = other->x;
+            y = other->y;
+        }
+
+        CollideWithPlayer(&_state, self, x, y, input->dx, input->dy);
+    }
+}
+
+static void BenchSpawnRing(int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        if ( _state.nrings == MAX_RINGS ) {
+            _state.nrings = 0;
+            PlaceOccupants(&_state);
+        }
+        SpawnRing(&_state);
+    }
+}
+
+static void BenchUpdatePoints(int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        if ( _state.game_state != GS_PLAY ) {
+            _state.game_state = GS_PLAY;
+            for ( int p = 0; p < MAX_PLAYERS; p++ ) {
+                _state.players[p].pts = 0;
+            }
+        }
+        UpdatePoints(&_state);
+    }
+}
+
+static void BenchUpdateMatch(int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        if ( _state.game_state != GS_PLAY ) {
+            InitMatch(&_state, MAX_PLAYERS, i);
+        }
+        UpdateMatch(&_state, _inputs[i % BENCH_INPUTS].actions, BENCH_DT);
+    }
+}
+
+/// The snapshot half of ServerUpdate(): save and store a snapshot, then
+/// encode it for four clients, two of which share a baseline.
+static void BenchSerialize(int n)
+{
+    for ( int i = 0; i < n; i++ ) {
+        UpdatePlayer(&_state,
+                     &_state.players[i % MAX_PLAYERS],
+                     _inputs[i % BENCH_INPUTS].actions[0]);
+
+        Snapshot snapshot;
+        SaveSnapshot(&_state, &snapshot, ++_tick);
+        for ( int p = 0; p < MAX_PLAYERS; p++ ) {
+            snapshot.input_seqs[p] = (u16)_tick;
+        }
+        StoreSnapshot(&_history, &snapshot);
+
+        u32 baselines[3] = { _tick - 1, _tick - 3, 0 };
+        for ( int b = 0; b < 3; b++ ) {
+            Frame * frame = NewFrame();
+            EncodeSnapshot(&snapshot, FindSnapshot(&_history, baselines[b]), &frame->payload);
+            ReleaseFrame(frame);
+        }
+    }
+}
+
+struct Benchmark {
+    const char * name;
+    void (* run)(int n);
+    bool is_tick; // Report ticks per second.
+};
+
+static const Benchmark _benchmarks[] = {
+    { "TryMovePlayer", BenchTryMovePlayer, false },
+    { "CollideWithPlayer", BenchCollideWithPlayer, false },
+    { "SpawnRing", BenchSpawnRing, false },
+    { "UpdatePoints", BenchUpdatePoints, false },
+    { "UpdateMatch", BenchUpdateMatch, true },
+    { "Serialize", BenchSerialize, true },
+};
+
+// -----------------------------------------------------------------------------
+
+int main(int argc, char ** argv)
+{
+    u32 seed = 1;
+    double min_sec = 0.25;
+    bool is_csv = false;
+    const char * filter = NULL;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp(argv[i], "-seed") == 0 && i + 1 < argc ) {
+            seed = (u32)atol(argv[++i]);
+        } else if ( strcmp(argv[i], "-sec") == 0 && i + 1 < argc ) {
+            min_sec = atof(argv[++i]);
+        } else if ( strcmp(argv[i], "-csv") == 0 ) {
+            is_csv = true;
+        } else if ( strcmp(argv[i], "-only") == 0 && i + 1 < argc ) {
+            filter = argv[++i];
+        } else if ( strcmp(argv[i], "-map") == 0 && i + 1 < argc ) {
+            if ( !LoadMap(&map_g, argv[++i]) ) {
+                return EXIT_FAILURE;
+            }
+        } else {
+            printf("usage: %s [options]\n", argv[0]);
+            printf("options:\n");
+            printf("  -seed [n]     seed for the inputs and matches (default 1)\n");
+            printf("  -sec [n]      run each benchmark at least this long (default 0.25)\n");
+            printf("  -only [name]  run only benchmarks whose name contains this\n");
+            printf("  -map [file]   run on this map (default: built-in)\n");
+            printf("  -csv          print name,ns_per_op,ops_per_sec,allocs_per_op\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    GenerateInputs(seed);
+
+    if ( is_csv ) {
+        printf("name,ns_per_op,ops_per_sec,allocs_per_op\n");
+    } else {
+        printf("%-20s %12s %16s %12s\n", "benchmark", "ns/op", "per second", "allocs/op");
+    }
+
+    int count = sizeof(_benchmarks) / sizeof(_benchmarks[0]);
+    for ( int b = 0; b < count; b++ ) {
+        const Benchmark * bench = &_benchmarks[b];
+
+        if ( filter && strstr(bench->name, filter) == NULL ) {
+            continue;
+        }
+
+        SetUpMatch(seed);
+        memset(&_history, 0, sizeof(_history));
+        _tick = 0;
+        bench->run(1000); // Warm up.
+
+        // Double the run until it's long enough to time.
+        int n = 1000;
+        double sec;
+        u64 nallocs;
+        for ( ;; ) {
+            SetUpMatch(seed);
+            u64 allocs_before = _nallocs;
+            double start = NetTime();
+            bench->run(n);
+            sec = NetTime() - start;
+            nallocs = _nallocs - allocs_before;
+
+            if ( sec >= min_sec || n >= (1 << 30) ) {
+                break;
+            }
+            n *= 2;
+        }
+
+        double ns = sec * 1e9 / n;
+        double per_sec = n / sec;
+        double allocs = (double)nallocs / n;
+
+        if ( is_csv ) {
+            printf("%s,%.1f,%.0f,%.3f\n", bench->name, ns, per_sec, allocs);
+        } else {
+            printf("%-20s %12.1f %12.0f %-3s %12.3f\n",
+                   bench->name, ns, per_sec, bench->is_tick ? "t/s" : "", allocs);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
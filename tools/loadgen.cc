@@ -0,0 +1,488 @@
+//
+//  loadgen.cc
+//  NetTest2
+//
+//  Connects a swarm of headless clients to a server from one process and
+//  plays them with scripted inputs, to find how many the server can take.
+//  Each bot does what the game's client does on the wire: sends its inputs
+//  with redundancy, decodes every snapshot against its baseline and acks it.
+//
+
+#include "../match.hh"
+#include "../packet.hh"
+#include "../random.hh"
+#include "../snapshot.hh"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Read by the server code in match.cc. The game defines it in game.cc.
+float send_rate_g = 60.0f;
+
+#define BOT_INPUTS 64 // Inputs kept to resend and time. Must divide 65536.
+#define LATENCY_BINS 10000 // Tenths of a millisecond, up to a second.
+
+enum Script {
+    SCRIPT_RANDOM, // Hold a random direction for a while, or stand still.
+    SCRIPT_WALK, // Up, right, down, left, half a second each.
+    SCRIPT_IDLE, // Never move: only snapshots going out.
+};
+
+struct Bot {
+    Socket socket;
+    bool is_connected;
+    bool is_seated; // The server has sent our seat.
+    int player_index;
+
+    SnapshotHistory history; // Snapshots received.
+    u32 tick; // Newest snapshot.
+
+    u16 input_seq; // Next input's seq.
+    u16 acked_seq; // Newest input the server has simulated.
+    Action inputs[BOT_INPUTS]; // By seq.
+    double send_times[BOT_INPUTS]; // By seq.
+
+    Action action; // Held until `hold_ticks` runs out.
+    int hold_ticks;
+    Rng rng;
+};
+
+struct Stats {
+    u64 nsnapshots;
+    u64 nbad_snapshots; // Couldn't be decoded.
+    u64 bytes_in;
+    u64 bytes_out;
+
+    // Input latency: from sending an input to the first snapshot that shows
+    // the server has simulated it.
+    u32 latencies[LATENCY_BINS + 1]; // The last bin is a second or more.
+    u64 nlatencies;
+    double max_latency;
+};
+
+static Stats _total;
+static Stats _second; // Since the last report.
+
+static void RecordLatency(double sec)
+{
+    int bin = min((int)(sec * 10000.0), LATENCY_BINS);
+
+    _total.latencies[bin]++;
+    _total.nlatencies++;
+    _total.max_latency = max(_total.max_latency, sec);
+    _second.latencies[bin]++;
+    _second.nlatencies++;
+    _second.max_latency = max(_second.max_latency, sec);
+}
+
+/// - returns: The latency in milliseconds that `fraction` of inputs beat.
+static double Percentile(const Stats * stats, double fraction)
+{
+    u64 target = (u64)ceil(stats->nlatencies * fraction);
+    u64 count = 0;
+
+    for ( int i = 0; i <= LATENCY_BINS; i++ ) {
+        count += stats->latencies[i];
+        if ( count >= target && count > 0 ) {
+            return (i + 1) * 0.1;
+        }
+    }
+
+    return 0.0;
+}
+
+static bool SendPacket(Bot * bot, Buffer * buffer, Delivery delivery)
+{
+    _second.bytes_out += buffer->size + sizeof(PacketSize);
+    return PacketWrite(&bot->socket, buffer, delivery);
+}
+
+/// Connect and say hello with no token, which asks for any free seat. The
+/// welcome is picked up later by UpdateBot().
+static bool ConnectBot(Bot * bot,
+                       int index,
+                       const char * ip,
+                       const char * port,
+                       Transport transport,
+                       const Poller * poller,
+                       Buffer * buffer)
+{
+    bot->socket = CreateClient(ip, port, transport);
+    if ( !bot->socket.is_init ) {
+        fprintf(stderr, "Bot %d: CreateClient failed: %s\n", index, GetNetError());
+        return false;
+    }
+
+    if ( !PollerAdd(poller, &bot->socket) ) {
+        fprintf(stderr, "Bot %d: PollerAdd failed: %s\n", index, GetNetError());
+        CloseSocket(&bot->socket);
+        return false;
+    }
+
+    // It may have something already.
+    bot->socket.is_readable = true;
+    bot->socket.is_writable = true;
+
+    bot->is_connected = true;
+    bot->input_seq = 1;
+    bot->rng = InitRng(index + 1);
+
+    u8 type = CM_HELLO;
+    u64 token = 0;
+    BufferClear(buffer);
+    BufferWrite(buffer, &type, sizeof(type));
+    BufferWrite(buffer, &token, sizeof(token));
+    SendPacket(bot, buffer, DELIVERY_RELIABLE);
+    PacketFlush(&bot->socket);
+
+    return true;
+}
+
+static Action NextAction(Bot * bot, Script script, u32 ticks)
+{
+    static const Action directions[] = {
+        A_MOVE_UP, A_MOVE_RIGHT, A_MOVE_DOWN, A_MOVE_LEFT
+    };
+
+    switch ( script ) {
+        case SCRIPT_RANDOM:
+            if ( --bot->hold_ticks <= 0 ) {
+                u32 pick = Rand(&bot->rng, 0, 5);
+                bot->action = pick < 4 ? directions[pick] : A_NONE;
+                bot->hold_ticks = Rand(&bot->rng, 5, 60);
+            }
+            return bot->action;
+        case SCRIPT_WALK:
+            return directions[(ticks / 30) % 4];
+        case SCRIPT_IDLE:
+        default:
+            return A_NONE;
+    }
+}
+
+/// Note which of our inputs the server has simulated, as of a snapshot.
+static void AckInputs(Bot * bot, u16 acked_seq, double now)
+{
+    while ( SeqNewer(acked_seq, bot->acked_seq) ) {
+        bot->acked_seq++;
+
+        // Far behind, the send time has been overwritten.
+        if ( (u16)(bot->input_seq - bot->acked_seq) <= BOT_INPUTS ) {
+            RecordLatency(now - bot->send_times[bot->acked_seq % BOT_INPUTS]);
+        }
+    }
+}
+
+/// Read snapshots, ack the newest, and send this tick's input.
+static void UpdateBot(Bot * bot,
+                      Action action,
+                      PacketBatch * batch,
+                      Buffer * buffer,
+                      double now)
+{
+    if ( !bot->is_seated ) {
+        BufferClear(buffer);
+        if ( !PacketRead(&bot->socket, buffer) ) {
+            PacketFlush(&bot->socket); // UDP resends the hello.
+            return;
+        }
+
+        BufferReader reader = MakeReader(buffer->data, buffer->size);
+        int nplayers;
+        u64 token;
+        ReaderGet(&reader, &bot->player_index);
+        ReaderGet(&reader, &nplayers);
+        ReaderGet(&reader, &token);
+
+        if ( reader.is_overflow
+            || bot->player_index < 0
+            || bot->player_index >= MAX_PLAYERS ) {
+            fprintf(stderr, "Bad handshake from server\n");
+            bot->socket.is_hungup = true;
+            return;
+        }
+
+        _second.bytes_in += buffer->size + sizeof(PacketSize);
+        bot->is_seated = true;
+    }
+
+    int count = PacketReadBatch(&bot->socket, batch);
+    u32 applied_tick = bot->tick;
+
+    for ( int i = 0; i < count; i++ ) {
+        _second.bytes_in += batch->packets[i].size + sizeof(PacketSize);
+
+        BitReader reader = MakeBitReader(batch->packets[i].data,
+                                         batch->packets[i].size);
+        Snapshot snapshot;
+        if ( !DecodeSnapshot(&reader, &bot->history, &snapshot) ) {
+            _second.nbad_snapshots++;
+            continue;
+        }
+
+        _second.nsnapshots++;
+        StoreSnapshot(&bot->history, &snapshot);
+
+        if ( snapshot.tick > applied_tick ) {
+            applied_tick = snapshot.tick;
+            AckInputs(bot, snapshot.input_seqs[bot->player_index], now);
+        }
+    }
+
+    if ( applied_tick != bot->tick ) {
+        bot->tick = applied_tick;
+
+        u8 type = CM_ACK;
+        BufferClear(buffer);
+        BufferWrite(buffer, &type, sizeof(type));
+        BufferWrite(buffer, &bot->tick, sizeof(bot->tick));
+        SendPacket(bot, buffer, DELIVERY_UNRELIABLE);
+    }
+
+    // Send inputs the way ClientUpdate() does: the newest plus the ones the
+    // server hasn't simulated yet.
+    u16 seq = bot->input_seq++;
+    bot->inputs[seq % BOT_INPUTS] = action;
+    bot->send_times[seq % BOT_INPUTS] = now;
+
+    u16 unacked = bot->input_seq - bot->acked_seq - 1;
+    u8 ninputs = unacked < INPUT_REDUNDANCY ? (u8)unacked : INPUT_REDUNDANCY;
+    if ( ninputs == 0 ) {
+        ninputs = 1;
+    }
+
+    u8 type = CM_INPUTS;
+    BufferClear(buffer);
+    BufferWrite(buffer, &type, sizeof(type));
+    BufferWrite(buffer, &seq, sizeof(seq));
+    BufferWrite(buffer, &ninputs, sizeof(ninputs));
+    for ( u16 s = bot->input_seq - ninputs; s != bot->input_seq; s++ ) {
+        BufferWrite(buffer, &bot->inputs[s % BOT_INPUTS], sizeof(Action));
+    }
+
+    SendPacket(bot, buffer, DELIVERY_UNRELIABLE);
+    PacketFlush(&bot->socket);
+}
+
+static void AddStats(Stats * total, const Stats * second)
+{
+    total->nsnapshots += second->nsnapshots;
+    total->nbad_snapshots += second->nbad_snapshots;
+    total->bytes_in += second->bytes_in;
+    total->bytes_out += second->bytes_out;
+}
+
+static void PrintLatency(const Stats * stats)
+{
+    if ( stats->nlatencies == 0 ) {
+        printf("no inputs simulated");
+        return;
+    }
+
+    printf("latency p50 %.1f, p90 %.1f, p99 %.1f, max %.1f ms",
+           Percentile(stats, 0.50),
+           Percentile(stats, 0.90),
+           Percentile(stats, 0.99),
+           stats->max_latency * 1000.0);
+}
+
+int main(int argc, char ** argv)
+{
+    if ( argc < 3 ) {
+        printf("usage: %s [ip] [port] [options]\n", argv[0]);
+        printf("options:\n");
+        printf("  -clients [n]  how many to connect (default 100)\n");
+        printf("  -sec [n]      seconds to run (default 10)\n");
+        printf("  -ramp [n]     connections opened per tick (default 10)\n");
+        printf("  -rate [hz]    inputs per second, the server's tick rate (default 60)\n");
+        printf("  -script [s]   random, walk or idle (default random)\n");
+        printf("  -udp          connect over UDP (the server must match)\n");
+        return EXIT_FAILURE;
+    }
+
+    const char * ip = argv[1];
+    const char * port = argv[2];
+    int nbots = 100;
+    float run_sec = 10.0f;
+    int ramp = 10;
+    float tick_rate = 60.0f;
+    Script script = SCRIPT_RANDOM;
+    Transport transport = TRANSPORT_TCP;
+
+    for ( int i = 3; i < argc; i++ ) {
+        if ( strcmp(argv[i], "-clients") == 0 && i + 1 < argc ) {
+            nbots = atoi(argv[++i]);
+        } else if ( strcmp(argv[i], "-sec") == 0 && i + 1 < argc ) {
+            run_sec = (float)atof(argv[++i]);
+        } else if ( strcmp(argv[i], "-ramp") == 0 && i + 1 < argc ) {
+            ramp = atoi(argv[++i]);
+        } else if ( strcmp(argv[i], "-rate") == 0 && i + 1 < argc ) {
+            tick_rate = (float)atof(argv[++i]);
+        } else if ( strcmp(argv[i], "-script") == 0 && i + 1 < argc ) {
+            const char * name = argv[++i];
+            if ( strcmp(name, "random") == 0 ) {
+                script = SCRIPT_RANDOM;
+            } else if ( strcmp(name, "walk") == 0 ) {
+                script = SCRIPT_WALK;
+            } else if ( strcmp(name, "idle") == 0 ) {
+                script = SCRIPT_IDLE;
+            } else {
+                printf("Unknown script %s\n", name);
+                return EXIT_FAILURE;
+            }
+        } else if ( strcmp(argv[i], "-udp") == 0 ) {
+            transport = TRANSPORT_UDP;
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ( nbots < 1 || ramp < 1 || tick_rate <= 0.0f || run_sec <= 0.0f ) {
+        printf("Counts and rates must be positive\n");
+        return EXIT_FAILURE;
+    }
+
+    if ( !InitNetwork("log_loadgen.txt") ) {
+        fprintf(stderr, "InitNetwork failed: %s\n", GetNetError());
+        return EXIT_FAILURE;
+    }
+
+    // Bots are polled at their address, so the array never moves.
+    Bot * bots = (Bot *)calloc(nbots, sizeof(*bots));
+    if ( bots == NULL ) {
+        fprintf(stderr, "Could not allocate %d bots\n", nbots);
+        return EXIT_FAILURE;
+    }
+
+    Poller poller = CreatePoller();
+    if ( !poller.is_init ) {
+        fprintf(stderr, "CreatePoller failed: %s\n", GetNetError());
+        return EXIT_FAILURE;
+    }
+
+    Buffer buffer = { 0 };
+    PacketBatch batch = { 0 };
+    BufferInit(&buffer, 64);
+    BufferInit(&batch.spill, 0);
+
+    printf("Connecting %d bots to %s:%s over %s\n",
+           nbots, ip, port, transport == TRANSPORT_UDP ? "UDP" : "TCP");
+
+    double tick_sec = 1.0 / tick_rate;
+    double start = NetTime();
+    double next_tick = start;
+    double next_report = start + 1.0;
+    int nopened = 0; // Bots connection has been tried for.
+    int nseated = 0;
+    int nlost = 0; // Dropped or turned away.
+    int nlate = 0; // Ticks that ran a whole tick late, once all connected.
+    u32 ticks = 0;
+    bool can_connect = true;
+
+    while ( NetTime() - start < run_sec ) {
+        NetEvent events[NET_MAX_EVENTS];
+        double now = NetTime();
+
+        if ( now < next_tick ) {
+            // Sleep, but note readiness as it comes in.
+            int timeout_ms = (int)((next_tick - now) * 1000.0);
+            PollerWait(&poller, events, NET_MAX_EVENTS, timeout_ms);
+            continue;
+        }
+
+        while ( PollerWait(&poller, events, NET_MAX_EVENTS, 0) == NET_MAX_EVENTS ) {
+        }
+
+        if ( now - next_tick > tick_sec ) {
+            // Connecting over UDP waits for the server, so that doesn't count.
+            nlate += nopened == nbots;
+            next_tick = now; // Don't try to catch up.
+        }
+        next_tick += tick_sec;
+
+        for ( int n = 0; n < ramp && nopened < nbots && can_connect; n++ ) {
+            Bot * bot = &bots[nopened];
+            can_connect = ConnectBot(bot, nopened, ip, port, transport, &poller, &buffer);
+            nopened++;
+        }
+
+        for ( int i = 0; i < nopened; i++ ) {
+            Bot * bot = &bots[i];
+
+            if ( !bot->is_connected ) {
+                continue;
+            }
+
+            bool was_seated = bot->is_seated;
+            UpdateBot(bot, NextAction(bot, script, ticks), &batch, &buffer, now);
+            nseated += bot->is_seated && !was_seated;
+
+            if ( bot->socket.is_hungup ) {
+                if ( bot->is_seated ) {
+                    nseated--;
+                    fprintf(stderr, "Bot %d: dropped by the server\n", i);
+                } else {
+                    fprintf(stderr, "Bot %d: turned away\n", i);
+                }
+
+                PollerRemove(&poller, &bot->socket);
+                CloseSocket(&bot->socket);
+                bot->is_connected = false;
+                bot->is_seated = false;
+                nlost++;
+            }
+        }
+
+        ticks++;
+
+        if ( now >= next_report ) {
+            printf("%3.0f s: %d seated, %.0f snapshots/s (%.1f per bot), "
+                   "in %.0f KB/s, out %.0f KB/s, ",
+                   now - start,
+                   nseated,
+                   (double)_second.nsnapshots,
+                   nseated ? (double)_second.nsnapshots / nseated : 0.0,
+                   _second.bytes_in / 1024.0,
+                   _second.bytes_out / 1024.0);
+            PrintLatency(&_second);
+            printf("\n");
+
+            AddStats(&_total, &_second);
+            memset(&_second, 0, sizeof(_second));
+            next_report += 1.0;
+        }
+    }
+
+    AddStats(&_total, &_second);
+    double sec = NetTime() - start;
+
+    printf("\n%d of %d bots seated at the end, %d lost\n", nseated, nbots, nlost);
+    printf("%.0f snapshots/s, %llu undecodable, in %.0f KB/s, out %.0f KB/s\n",
+           _total.nsnapshots / sec,
+           (unsigned long long)_total.nbad_snapshots,
+           _total.bytes_in / 1024.0 / sec,
+           _total.bytes_out / 1024.0 / sec);
+    printf("Input ");
+    PrintLatency(&_total);
+    printf(" over %llu inputs\n", (unsigned long long)_total.nlatencies);
+
+    if ( nlate > 0 ) {
+        // Then the numbers say as much about this process as the server.
+        printf("%d of %u ticks ran late: the load generator couldn't keep up\n",
+               nlate, ticks);
+    }
+
+    for ( int i = 0; i < nopened; i++ ) {
+        if ( bots[i].is_connected ) {
+            CloseSocket(&bots[i].socket);
+        }
+    }
+
+    ClosePoller(&poller);
+    free(bots);
+
+    return EXIT_SUCCESS;
+}
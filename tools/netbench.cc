@@ -0,0 +1,522 @@
+//
+//  netbench.cc
+//  NetTest2
+//
+//  Pushes framed packets through real sockets on loopback, in the patterns the
+//  game uses, and reports throughput, system calls per message and one-way
+//  latency, for every payload size and connection count asked for.
+//
+//  One thread sends and another receives, each polling its own end of every
+//  connection, as a server and its clients would. Each packet starts with the
+//  time it was written, so the receiver can tell how long it took.
+//
+
+#include "../net.hh"
+#include "../packet.hh"
+#include "../udp.hh"
+
+#include <atomic>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+#define MAX_LIST 16 // Sizes or connection counts on the command line.
+#define LATENCY_BINS 100000 // Microseconds, up to 100 ms.
+#define ACCEPT_TIMEOUT_SEC 10.0
+
+enum Pattern {
+    PATTERN_SNAPSHOT, // The server sends one shared frame to everyone each
+                      // round, as ServerUpdate() does.
+    PATTERN_ACTION, // Each client sends its own small packet each round, as
+                    // ClientUpdate() does.
+};
+
+static const char * _pattern_names[] = { "snapshot", "action" };
+
+struct Run {
+    Pattern pattern;
+    Transport transport;
+    int size; // Payload bytes, time stamp included.
+    int nconns;
+    float rate; // Rounds per second, or 0 for as fast as possible.
+    const char * port;
+};
+
+/// One thread's end of every connection.
+struct Side {
+    Socket * sockets;
+    int count;
+    Poller poller;
+
+    // Filled in by the thread.
+    u64 nmessages; // Written, or received.
+    u64 nbytes; // Received, headers included.
+    NetCounters counters; // Made during the run.
+};
+
+// Receiver's one-way latency.
+static u32 _latencies[LATENCY_BINS + 1]; // The last bin is 100 ms or more.
+static u64 _nlatencies;
+static double _max_latency;
+
+static std::atomic<bool> _is_running;
+
+static void RecordLatency(double sec)
+{
+    int bin = min((int)(sec * 1000000.0), LATENCY_BINS);
+    _latencies[bin]++;
+    _nlatencies++;
+    _max_latency = max(_max_latency, sec);
+}
+
+/// - returns: The latency in microseconds that `fraction` of messages beat.
+static double Percentile(double fraction)
+{
+    u64 target = (u64)ceil(_nlatencies * fraction);
+    u64 count = 0;
+
+    for ( int i = 0; i <= LATENCY_BINS; i++ ) {
+        count += _latencies[i];
+        if ( count >= target && count > 0 ) {
+            return i + 1;
+        }
+    }
+
+    return 0.0;
+}
+
+static NetCounters CountersSince(NetCounters start)
+{
+    NetCounters now = GetNetCounters();
+    NetCounters result = {
+        .reads = now.reads - start.reads,
+        .writes = now.writes - start.writes,
+        .waits = now.waits - start.waits,
+    };
+
+    return result;
+}
+
+static void WritePayload(Buffer * buffer, int size)
+{
+    static const char filler[0xFFFF] = { 0 };
+
+    double now = NetTime();
+    BufferWrite(buffer, &now, sizeof(now));
+    BufferWrite(buffer, filler, size - sizeof(now));
+}
+
+static void SendLoop(Side * side, const Run * run)
+{
+    NetCounters start = GetNetCounters();
+    PacketBatch batch = { 0 };
+    Buffer buffer = { 0 };
+    BufferInit(&batch.spill, 0);
+    BufferInit(&buffer, run->size);
+
+    double interval = run->rate > 0.0f ? 1.0 / run->rate : 0.0;
+    double next_round = NetTime();
+
+    while ( _is_running.load(std::memory_order_relaxed) ) {
+        NetEvent events[NET_MAX_EVENTS];
+
+        if ( interval > 0.0 ) {
+            double now = NetTime();
+            if ( now < next_round ) {
+                int timeout_ms = (int)((next_round - now) * 1000.0);
+                PollerWait(&side->poller, events, NET_MAX_EVENTS, timeout_ms);
+                continue;
+            }
+            next_round += interval;
+        }
+
+        while ( PollerWait(&side->poller, events, NET_MAX_EVENTS, 0) == NET_MAX_EVENTS ) {
+        }
+
+        if ( run->pattern == PATTERN_SNAPSHOT ) {
+            Frame * frame = NewFrame();
+            WritePayload(&frame->payload, run->size);
+
+            for ( int i = 0; i < side->count; i++ ) {
+                side->nmessages += PacketWriteFrame(&side->sockets[i],
+                                                    frame,
+                                                    DELIVERY_UNRELIABLE);
+            }
+
+            ReleaseFrame(frame);
+        } else {
+            for ( int i = 0; i < side->count; i++ ) {
+                BufferClear(&buffer);
+                WritePayload(&buffer, run->size);
+                side->nmessages += PacketWrite(&side->sockets[i],
+                                               &buffer,
+                                               DELIVERY_UNRELIABLE);
+            }
+        }
+
+        for ( int i = 0; i < side->count; i++ ) {
+            Socket * socket = &side->sockets[i];
+
+            if ( socket->transport == TRANSPORT_UDP ) {
+                PacketReadBatch(socket, &batch); // Acks and keep-alives.
+            } else {
+                PacketFlush(socket); // What didn't fit before.
+            }
+        }
+    }
+
+    side->counters = CountersSince(start);
+    free(batch.spill.data);
+    free(buffer.data);
+}
+
+static void ReceiveLoop(Side * side)
+{
+    NetCounters start = GetNetCounters();
+    PacketBatch batch = { 0 };
+    BufferInit(&batch.spill, 0);
+
+    bool is_behind = false; // A socket has more than one read took.
+
+    while ( _is_running.load(std::memory_order_relaxed) ) {
+        NetEvent events[NET_MAX_EVENTS];
+        PollerWait(&side->poller, events, NET_MAX_EVENTS, is_behind ? 0 : 1);
+
+        is_behind = false;
+
+        for ( int i = 0; i < side->count; i++ ) {
+            Socket * socket = &side->sockets[i];
+            int count = PacketReadBatch(socket, &batch);
+            double now = NetTime();
+
+            for ( int j = 0; j < count; j++ ) {
+                double sent;
+                memcpy(&sent, batch.packets[j].data, sizeof(sent));
+                RecordLatency(now - sent);
+
+                side->nmessages++;
+                side->nbytes += batch.packets[j].size + sizeof(PacketSize);
+            }
+
+            is_behind |= socket->transport == TRANSPORT_TCP && socket->is_readable;
+        }
+    }
+
+    side->counters = CountersSince(start);
+    free(batch.spill.data);
+}
+
+/// Make `count` connections to ourselves. `near` gets the server's end of
+/// each and `far` the client's.
+static bool Connect(const Run * run, Socket * near, Socket * far)
+{
+    Socket listener = CreateServer(run->port, run->transport);
+    if ( !listener.is_init ) {
+        fprintf(stderr, "CreateServer failed: %s\n", GetNetError());
+        return false;
+    }
+
+    // A UDP client waits for its hello to be answered, so accept on the side.
+    int naccepted = 0;
+    std::thread acceptor([&]() {
+        double start = NetTime();
+        while ( naccepted < run->nconns && NetTime() - start < ACCEPT_TIMEOUT_SEC ) {
+            if ( !AcceptConnection(&listener, &near[naccepted]) ) {
+                fprintf(stderr, "AcceptConnection failed: %s\n", GetNetError());
+                return;
+            }
+
+            if ( near[naccepted].is_init ) {
+                naccepted++;
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    });
+
+    int nconnected = 0;
+    for ( ; nconnected < run->nconns; nconnected++ ) {
+        far[nconnected] = CreateClient("127.0.0.1", run->port, run->transport);
+        if ( !far[nconnected].is_init ) {
+            fprintf(stderr, "CreateClient failed: %s\n", GetNetError());
+            break;
+        }
+    }
+
+    acceptor.join();
+    CloseSocket(&listener);
+
+    if ( naccepted < run->nconns || nconnected < run->nconns ) {
+        for ( int i = 0; i < naccepted; i++ ) {
+            CloseSocket(&near[i]);
+        }
+        for ( int i = 0; i < nconnected; i++ ) {
+            CloseSocket(&far[i]);
+        }
+        return false;
+    }
+
+    return true;
+}
+
+static bool InitSide(Side * side, Socket * sockets, int count)
+{
+    memset(side, 0, sizeof(*side));
+    side->sockets = sockets;
+    side->count = count;
+    side->poller = CreatePoller();
+
+    if ( !side->poller.is_init ) {
+        fprintf(stderr, "CreatePoller failed: %s\n", GetNetError());
+        return false;
+    }
+
+    for ( int i = 0; i < count; i++ ) {
+        if ( !PollerAdd(&side->poller, &sockets[i]) ) {
+            fprintf(stderr, "PollerAdd failed: %s\n", GetNetError());
+            return false;
+        }
+
+        // Whatever happened before the poller started watching.
+        sockets[i].is_readable = true;
+        sockets[i].is_writable = true;
+    }
+
+    return true;
+}
+
+static bool DoRun(const Run * run, double sec, bool is_csv)
+{
+    Socket * near = (Socket *)calloc(run->nconns, sizeof(*near));
+    Socket * far = (Socket *)calloc(run->nconns, sizeof(*far));
+
+    if ( near == NULL || far == NULL || !Connect(run, near, far) ) {
+        free(near);
+        free(far);
+        return false;
+    }
+
+    // Snapshots go from the server's end, actions from the clients'.
+    Side sender;
+    Side receiver;
+    bool is_snapshot = run->pattern == PATTERN_SNAPSHOT;
+    bool ok = InitSide(&sender, is_snapshot ? near : far, run->nconns)
+           && InitSide(&receiver, is_snapshot ? far : near, run->nconns);
+
+    if ( ok ) {
+        memset(_latencies, 0, sizeof(_latencies));
+        _nlatencies = 0;
+        _max_latency = 0.0;
+        _is_running = true;
+
+        std::thread receive_thread(ReceiveLoop, &receiver);
+        std::thread send_thread(SendLoop, &sender, run);
+
+        std::this_thread::sleep_for(std::chrono::duration<double>(sec));
+        _is_running = false;
+
+        send_thread.join();
+        receive_thread.join();
+
+        u64 nsyscalls = 0;
+        const NetCounters * c[2] = { &sender.counters, &receiver.counters };
+        for ( int i = 0; i < 2; i++ ) {
+            nsyscalls += c[i]->reads + c[i]->writes + c[i]->waits;
+        }
+
+        double delivered = (double)receiver.nmessages;
+        double per_msg = delivered > 0.0 ? 1.0 / delivered : 0.0;
+        double dropped = sender.nmessages > 0
+            ? 100.0 * (1.0 - delivered / sender.nmessages)
+            : 0.0;
+
+        if ( is_csv ) {
+            printf("%s,%s,%d,%d,%.0f,%.0f,%.0f,%.1f,%.3f,%.3f,%.3f,%.3f,%.0f,%.0f,%.0f,%.0f\n",
+                   _pattern_names[run->pattern],
+                   run->transport == TRANSPORT_UDP ? "udp" : "tcp",
+                   run->size,
+                   run->nconns,
+                   run->rate,
+                   delivered / sec,
+                   receiver.nbytes / sec,
+                   dropped,
+                   nsyscalls * per_msg,
+                   (sender.counters.reads + receiver.counters.reads) * per_msg,
+                   (sender.counters.writes + receiver.counters.writes) * per_msg,
+                   (sender.counters.waits + receiver.counters.waits) * per_msg,
+                   Percentile(0.50),
+                   Percentile(0.99),
+                   Percentile(0.999),
+                   _max_latency * 1000000.0);
+        } else {
+            printf("%-8s %6d %6d %11.0f %9.1f %6.1f%% %9.2f %8.0f %8.0f %8.0f %8.0f\n",
+                   _pattern_names[run->pattern],
+                   run->size,
+                   run->nconns,
+                   delivered / sec,
+                   receiver.nbytes / sec / (1024.0 * 1024.0),
+                   dropped,
+                   nsyscalls * per_msg,
+                   Percentile(0.50),
+                   Percentile(0.99),
+                   Percentile(0.999),
+                   _max_latency * 1000000.0);
+        }
+        fflush(stdout);
+    }
+
+    for ( int i = 0; i < run->nconns; i++ ) {
+        CloseSocket(&near[i]);
+        CloseSocket(&far[i]);
+    }
+
+    if ( sender.poller.is_init ) {
+        ClosePoller(&sender.poller);
+    }
+
+    if ( receiver.poller.is_init ) {
+        ClosePoller(&receiver.poller);
+    }
+
+    free(near);
+    free(far);
+
+    return ok;
+}
+
+/// Read a comma-separated list of positive numbers.
+/// - returns: How many, or 0 if it's malformed.
+static int ParseList(const char * string, int * values)
+{
+    int count = 0;
+
+    while ( *string && count < MAX_LIST ) {
+        char * end;
+        long value = strtol(string, &end, 10);
+        if ( end == string || value <= 0 || (*end != ',' && *end != '\0') ) {
+            return 0;
+        }
+
+        values[count++] = (int)value;
+        string = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+int main(int argc, char ** argv)
+{
+    int sizes[MAX_LIST] = { 16, 64, 256, 1024 };
+    int nsizes = 4;
+    int conns[MAX_LIST] = { 1, 16, 256 };
+    int nconns = 3;
+    int first_pattern = PATTERN_SNAPSHOT;
+    int last_pattern = PATTERN_ACTION;
+    Transport transport = TRANSPORT_TCP;
+    float rate = 0.0f;
+    double sec = 1.0;
+    int port = 5700;
+    bool is_csv = false;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp(argv[i], "-sizes") == 0 && i + 1 < argc ) {
+            nsizes = ParseList(argv[++i], sizes);
+        } else if ( strcmp(argv[i], "-conns") == 0 && i + 1 < argc ) {
+            nconns = ParseList(argv[++i], conns);
+        } else if ( strcmp(argv[i], "-pattern") == 0 && i + 1 < argc ) {
+            const char * name = argv[++i];
+            if ( strcmp(name, "snapshot") == 0 ) {
+                first_pattern = last_pattern = PATTERN_SNAPSHOT;
+            } else if ( strcmp(name, "action") == 0 ) {
+                first_pattern = last_pattern = PATTERN_ACTION;
+            } else {
+                nsizes = 0; // Show the usage.
+            }
+        } else if ( strcmp(argv[i], "-rate") == 0 && i + 1 < argc ) {
+            rate = (float)atof(argv[++i]);
+        } else if ( strcmp(argv[i], "-sec") == 0 && i + 1 < argc ) {
+            sec = atof(argv[++i]);
+        } else if ( strcmp(argv[i], "-port") == 0 && i + 1 < argc ) {
+            port = atoi(argv[++i]);
+        } else if ( strcmp(argv[i], "-udp") == 0 ) {
+            transport = TRANSPORT_UDP;
+        } else if ( strcmp(argv[i], "-csv") == 0 ) {
+            is_csv = true;
+        } else {
+            nsizes = 0;
+            break;
+        }
+    }
+
+    if ( nsizes == 0 || nconns == 0 || sec <= 0.0 || rate < 0.0f ) {
+        printf("usage: %s [options]\n", argv[0]);
+        printf("options:\n");
+        printf("  -pattern [p]  snapshot or action (default both)\n");
+        printf("  -sizes [list] payload bytes, comma-separated (default 16,64,256,1024)\n");
+        printf("  -conns [list] connection counts (default 1,16,256)\n");
+        printf("  -rate [hz]    rounds per second, 0 for flat out (default 0)\n");
+        printf("  -sec [n]      seconds per run (default 1)\n");
+        printf("  -port [n]     first port to use, one more each run (default 5700)\n");
+        printf("  -udp          use the UDP transport\n");
+        printf("  -csv          machine-readable output\n");
+        return EXIT_FAILURE;
+    }
+
+    if ( !InitNetwork("log_netbench.txt") ) {
+        fprintf(stderr, "InitNetwork failed: %s\n", GetNetError());
+        return EXIT_FAILURE;
+    }
+
+    if ( is_csv ) {
+        printf("pattern,transport,size,conns,rate,msgs_per_sec,bytes_per_sec,"
+               "dropped_pct,syscalls_per_msg,reads_per_msg,writes_per_msg,"
+               "waits_per_msg,p50_us,p99_us,p999_us,max_us\n");
+    } else {
+        printf("%s loopback, %s\n",
+               transport == TRANSPORT_UDP ? "UDP" : "TCP",
+               rate > 0.0f ? "paced" : "flat out");
+        printf("%-8s %6s %6s %11s %9s %7s %9s %8s %8s %8s %8s\n",
+               "pattern", "size", "conns", "msgs/s", "MB/s", "dropped",
+               "syscalls", "p50 us", "p99 us", "p999 us", "max us");
+    }
+
+    int run_index = 0;
+
+    for ( int p = first_pattern; p <= last_pattern; p++ ) {
+        for ( int s = 0; s < nsizes; s++ ) {
+            for ( int c = 0; c < nconns; c++ ) {
+                // Closed connections linger on their port for a while.
+                char port_string[16];
+                snprintf(port_string, sizeof(port_string), "%d", port + run_index++);
+
+                Run run = {
+                    .pattern = (Pattern)p,
+                    .transport = transport,
+                    .size = max(sizes[s], (int)sizeof(double)),
+                    .nconns = conns[c],
+                    .rate = rate,
+                    .port = port_string,
+                };
+
+                if ( transport == TRANSPORT_UDP && run.size > UDP_MAX_MESSAGE ) {
+                    fprintf(stderr, "Skipping %d bytes: over one datagram\n", run.size);
+                    continue;
+                }
+
+                if ( run.size > 0xFFFF ) {
+                    fprintf(stderr, "Skipping %d bytes: too large for a packet\n", run.size);
+                    continue;
+                }
+
+                if ( !DoRun(&run, sec, is_csv) ) {
+                    fprintf(stderr, "Run failed: %s %d bytes, %d connections\n",
+                            _pattern_names[p], run.size, run.nconns);
+                }
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,128 @@
+//
+//  replay.cc
+//  NetTest2
+//
+//  Plays a recorded match through the simulation with no window, network or
+//  pacing, as fast as it will go, and checks the result against the one
+//  recorded.
+//
+
+#include "../match.hh"
+#include "../replay.hh"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Read by the server code in match.cc. The game defines it in game.cc.
+float send_rate_g = 60.0f;
+
+static void PrintState(const MatchState * state, u32 tick)
+{
+    printf("Tick %u: state hash %08x\n", tick, HashMatchState(state));
+
+    for ( int i = 0; i < state->nplayers; i++ ) {
+        const Player * p = &state->players[i];
+        printf("  player %d: at %d, %d health %d holding %d points %d\n",
+               i + 1, p->x, p->y, p->health, p->held, p->pts);
+    }
+
+    for ( int i = 0; i < state->nrings; i++ ) {
+        const Ring * r = &state->rings[i];
+        printf("  ring %d: at %d, %d type %d\n", i + 1, r->x, r->y, r->type);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    if ( argc < 2 ) {
+        printf("usage: %s [file] [options]\n", argv[0]);
+        printf("options:\n");
+        printf("  -runs [n]     play it n times and report the fastest (default 1)\n");
+        printf("  -until [n]    stop after tick n and print the state\n");
+        printf("  -map [file]   the map it was played on (default: built-in)\n");
+        return EXIT_FAILURE;
+    }
+
+    int nruns = 1;
+    u32 until = 0;
+
+    for ( int i = 2; i < argc; i++ ) {
+        if ( strcmp(argv[i], "-runs") == 0 && i + 1 < argc ) {
+            nruns = atoi(argv[++i]);
+        } else if ( strcmp(argv[i], "-until") == 0 && i + 1 < argc ) {
+            until = (u32)atol(argv[++i]);
+        } else if ( strcmp(argv[i], "-map") == 0 && i + 1 < argc ) {
+            if ( !LoadMap(&map_g, argv[++i]) ) {
+                return EXIT_FAILURE;
+            }
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    Replay replay;
+    if ( !LoadReplay(&replay, argv[1]) ) {
+        return EXIT_FAILURE;
+    }
+
+    printf("%s: %d players, seed %u, %zu bytes\n",
+           argv[1], replay.nplayers, replay.seed, replay.size);
+
+    if ( replay.map_hash != map_g.hash ) {
+        printf("It was played on a different map (see -map)\n");
+        FreeReplay(&replay);
+        return EXIT_FAILURE;
+    }
+
+    MatchState state;
+    u32 nticks = 0;
+    double best_sec = 0.0;
+
+    for ( int run = 0; run < nruns; run++ ) {
+        RewindReplay(&replay);
+        InitMatch(&state, replay.nplayers, replay.seed);
+        nticks = 0;
+
+        Action actions[MAX_PLAYERS];
+        double start = NetTime();
+
+        while ( (until == 0 || nticks < until) && NextReplayTick(&replay, actions) ) {
+            UpdateMatch(&state, actions, replay.dt);
+            nticks++;
+        }
+
+        double sec = NetTime() - start;
+        if ( run == 0 || sec < best_sec ) {
+            best_sec = sec;
+        }
+    }
+
+    printf("%u ticks (%.0f s of play) in %.3f ms: %.0f ticks/s\n",
+           nticks,
+           nticks * replay.dt,
+           best_sec * 1000.0,
+           best_sec > 0.0 ? nticks / best_sec : 0.0);
+
+    int result = EXIT_SUCCESS;
+
+    if ( until != 0 ) {
+        PrintState(&state, nticks);
+    } else if ( replay.nticks == 0 ) {
+        printf("The recording didn't finish: nothing to check against\n");
+    } else if ( nticks != replay.nticks ) {
+        printf("Recorded %u ticks but only %u could be read\n", replay.nticks, nticks);
+        result = EXIT_FAILURE;
+    } else if ( HashMatchState(&state) != replay.final_hash ) {
+        printf("Desync: the final state differs from the recording\n");
+        PrintState(&state, nticks);
+        result = EXIT_FAILURE;
+    } else {
+        printf("The final state matches the recording\n");
+    }
+
+    FreeReplay(&replay);
+
+    return result;
+}
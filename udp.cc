@@ -0,0 +1,434 @@
+//
+//  udp.cc
+//  NetTest2
+//
+
+#include "udp.hh"
+#include "packet.hh"
+
+#include <string.h>
+#include <stdio.h>
+
+#define DATAGRAM_DATA 0x01 // First byte of a datagram with a header.
+
+// Header flags
+#define F_ACK           0x01 // Ack fields are valid.
+#define F_RELIABLE      0x02 // Carries a reliable message.
+#define F_UNRELIABLE    0x04 // Carries an unreliable message.
+
+#define ACK_BITS 32
+#define ACK_DELAY_SEC (1.0 / 30.0) // Longest we hold an ack with no data to send.
+#define KEEPALIVE_SEC 1.0
+#define MIN_RESEND_SEC 0.05
+
+struct DatagramHeader {
+    u8 type;
+    u8 flags;
+    u16 seq;
+    u16 ack;
+    u32 ack_bits; // Bit n set: datagram `ack - 1 - n` was received.
+    u16 id; // Reliable message id. Unreliable: reliable messages sent before.
+    PacketSize size; // Message size.
+};
+
+// Packed size of DatagramHeader on the wire.
+#define HEADER_SIZE 14
+
+struct SentMessage {
+    Frame * frame;
+    u16 seq; // Datagram this was last sent in.
+    double sent_time;
+    bool is_resent;
+};
+
+struct ReceivedMessage {
+    Buffer data;
+    bool in_use;
+};
+
+struct UdpChannel {
+    u16 send_seq; // Sequence number of the next datagram.
+    u16 recv_seq; // Newest datagram received.
+    u32 recv_bits; // Bit n set: datagram `recv_seq - 1 - n` was received.
+    bool has_received;
+
+    u16 send_id; // Id of the next reliable message.
+    u16 send_base; // Oldest unacked reliable message.
+    u16 recv_id; // Id of the next reliable message to deliver.
+    SentMessage sent[UDP_WINDOW]; // Indexed by id % UDP_WINDOW.
+    ReceivedMessage received[UDP_WINDOW]; // Arrived early, waiting their turn.
+
+    u16 unreliable_seq; // Datagram of the newest unreliable message delivered.
+    bool has_unreliable;
+
+    double last_send_time;
+    double last_recv_time;
+    double rtt;
+    bool ack_pending;
+};
+
+static float _loss_chance;
+static thread_local u32 _loss_state = 0x9E3779B9;
+
+/// - returns: `true` if an outgoing datagram should be dropped, to act out
+///   a lossy network (see UdpSimulateLoss()).
+static bool SimulateLoss(void)
+{
+    if ( _loss_chance <= 0.0f ) {
+        return false;
+    }
+
+    // Xorshift: keep the game's random sequence out of this.
+    _loss_state ^= _loss_state << 13;
+    _loss_state ^= _loss_state >> 17;
+    _loss_state ^= _loss_state << 5;
+
+    return (float)_loss_state / (float)0xFFFFFFFF < _loss_chance;
+}
+
+void UdpSimulateLoss(float chance)
+{
+    _loss_chance = chance;
+}
+
+static UdpChannel * GetChannel(Socket * socket)
+{
+    if ( socket->channel == nullptr ) {
+        socket->channel = (UdpChannel *)calloc(1, sizeof(UdpChannel));
+        socket->channel->rtt = 0.1;
+        socket->channel->last_recv_time = NetTime();
+    }
+
+    return socket->channel;
+}
+
+void UdpFreeChannel(UdpChannel * channel)
+{
+    for ( int i = 0; i < UDP_WINDOW; i++ ) {
+        if ( channel->sent[i].frame ) {
+            ReleaseFrame(channel->sent[i].frame);
+        }
+
+        free(channel->received[i].data.data);
+    }
+
+    free(channel);
+}
+
+static void PutHeader(char * out, const DatagramHeader * h)
+{
+    memcpy(out + 0, &h->type, 1);
+    memcpy(out + 1, &h->flags, 1);
+    memcpy(out + 2, &h->seq, 2);
+    memcpy(out + 4, &h->ack, 2);
+    memcpy(out + 6, &h->ack_bits, 4);
+    memcpy(out + 10, &h->id, 2);
+    memcpy(out + 12, &h->size, 2);
+}
+
+static void GetHeader(const char * in, DatagramHeader * h)
+{
+    memcpy(&h->type, in + 0, 1);
+    memcpy(&h->flags, in + 1, 1);
+    memcpy(&h->seq, in + 2, 2);
+    memcpy(&h->ack, in + 4, 2);
+    memcpy(&h->ack_bits, in + 6, 4);
+    memcpy(&h->id, in + 10, 2);
+    memcpy(&h->size, in + 12, 2);
+}
+
+/// Send a datagram carrying `frame` (or just acks, if `flags` is 0).
+static bool SendDatagram(Socket * socket,
+                         UdpChannel * c,
+                         u8 flags,
+                         u16 id,
+                         const Frame * frame)
+{
+    int size = frame ? (int)frame->payload.size : 0;
+
+    DatagramHeader header = {
+        .type = DATAGRAM_DATA,
+        .flags = flags,
+        .seq = c->send_seq++,
+        .ack = c->recv_seq,
+        .ack_bits = c->recv_bits,
+        .id = id,
+        .size = (PacketSize)size
+    };
+
+    if ( c->has_received ) {
+        header.flags |= F_ACK;
+    }
+
+    char header_data[HEADER_SIZE];
+    PutHeader(header_data, &header);
+
+    c->last_send_time = NetTime();
+    c->ack_pending = false;
+
+    if ( SimulateLoss() ) {
+        return true;
+    }
+
+    // Gather the header and the frame's payload into one datagram.
+    NetSlice slices[2] = {
+        { header_data, HEADER_SIZE },
+        { size ? frame->payload.data : nullptr, size },
+    };
+
+    // A full socket buffer (0) drops the datagram, same as the network would.
+    return NetWriteGather(socket, slices, size ? 2 : 1) != -1;
+}
+
+bool UdpSend(Socket * socket, Frame * frame, Delivery delivery)
+{
+    UdpChannel * c = GetChannel(socket);
+
+    if ( frame->payload.size > UDP_MAX_MESSAGE ) {
+        fprintf(stderr,
+                "UdpSend: message too large (%zu bytes)\n",
+                frame->payload.size);
+        return false;
+    }
+
+    if ( delivery == DELIVERY_UNRELIABLE ) {
+        return SendDatagram(socket, c, F_UNRELIABLE, c->send_id, frame);
+    }
+
+    if ( (u16)(c->send_id - c->send_base) >= UDP_WINDOW ) {
+        fprintf(stderr, "UdpSend: too many unacked reliable messages\n");
+        return false;
+    }
+
+    // Hold on to the frame until it's acked, for resending.
+    u16 id = c->send_id++;
+    SentMessage * m = &c->sent[id % UDP_WINDOW];
+
+    RetainFrame(frame);
+    m->frame = frame;
+    m->seq = c->send_seq;
+    m->sent_time = NetTime();
+    m->is_resent = false;
+
+    return SendDatagram(socket, c, F_RELIABLE, id, frame);
+}
+
+static bool IsAcked(u16 seq, u16 ack, u32 ack_bits)
+{
+    if ( seq == ack ) {
+        return true;
+    }
+
+    u16 age = ack - seq;
+    return age >= 1 && age <= ACK_BITS && (ack_bits & (1u << (age - 1)));
+}
+
+static void ProcessAcks(UdpChannel * c, u16 ack, u32 ack_bits, double now)
+{
+    for ( u16 id = c->send_base; id != c->send_id; id++ ) {
+        SentMessage * m = &c->sent[id % UDP_WINDOW];
+
+        if ( m->frame && IsAcked(m->seq, ack, ack_bits) ) {
+            // Resent messages don't say which send was acked: skip those.
+            if ( !m->is_resent ) {
+                c->rtt = Lerp(c->rtt, now - m->sent_time, 0.125f);
+            }
+
+            ReleaseFrame(m->frame);
+            m->frame = nullptr;
+        }
+    }
+
+    while ( c->send_base != c->send_id
+           && !c->sent[c->send_base % UDP_WINDOW].frame ) {
+        c->send_base++;
+    }
+}
+
+static bool WasReceived(const UdpChannel * c, u16 seq)
+{
+    if ( !c->has_received || SeqNewer(seq, c->recv_seq) ) {
+        return false;
+    }
+
+    u16 age = c->recv_seq - seq;
+    if ( age == 0 || age > ACK_BITS ) {
+        return true; // Duplicate, or too old to ack: treat as received.
+    }
+
+    return c->recv_bits & (1u << (age - 1));
+}
+
+static void MarkReceived(UdpChannel * c, u16 seq)
+{
+    if ( !c->has_received ) {
+        c->recv_seq = seq;
+        c->recv_bits = 0;
+        c->has_received = true;
+    } else if ( SeqNewer(seq, c->recv_seq) ) {
+        u16 shift = seq - c->recv_seq;
+        c->recv_bits = shift >= ACK_BITS ? 0 : c->recv_bits << shift;
+        if ( shift <= ACK_BITS ) {
+            c->recv_bits |= 1u << (shift - 1); // The previous newest.
+        }
+        c->recv_seq = seq;
+    } else {
+        c->recv_bits |= 1u << ((u16)(c->recv_seq - seq) - 1);
+    }
+
+    c->ack_pending = true;
+}
+
+static void DeliverReliable(Socket * socket, UdpChannel * c)
+{
+    for ( ;; ) {
+        ReceivedMessage * m = &c->received[c->recv_id % UDP_WINDOW];
+
+        if ( !m->in_use
+            || !PacketPush(socket, m->data.data, (PacketSize)m->data.size) ) {
+            break;
+        }
+
+        m->in_use = false;
+        c->recv_id++;
+    }
+}
+
+static void ProcessDatagram(Socket * socket,
+                            UdpChannel * c,
+                            const char * datagram,
+                            int size,
+                            double now)
+{
+    if ( size == 1
+        && (u8)datagram[0] == NET_DATAGRAM_HELLO
+        && socket->is_accepted ) {
+        // The client didn't get our answer to its hello: answer again.
+        u8 hello = NET_DATAGRAM_HELLO;
+        NetWrite(socket, &hello, sizeof(hello));
+        return;
+    }
+
+    if ( size < HEADER_SIZE ) {
+        return;
+    }
+
+    DatagramHeader header;
+    GetHeader(datagram, &header);
+
+    if ( header.type != DATAGRAM_DATA
+        || header.size > size - HEADER_SIZE
+        || WasReceived(c, header.seq) ) {
+        // Duplicates still need acking, in case our ack was lost.
+        c->ack_pending = true;
+        return;
+    }
+
+    const char * message = datagram + HEADER_SIZE;
+
+    if ( header.flags & F_RELIABLE ) {
+        u16 ahead = header.id - c->recv_id;
+
+        if ( (s16)ahead < 0 ) {
+            // Already delivered: the sender missed our ack.
+        } else if ( ahead >= UDP_WINDOW ) {
+            return; // No room. Don't ack, so it gets resent.
+        } else {
+            ReceivedMessage * m = &c->received[header.id % UDP_WINDOW];
+            if ( m->data.data == nullptr ) {
+                BufferInit(&m->data, header.size);
+            }
+
+            BufferClear(&m->data);
+            BufferWrite(&m->data, message, header.size);
+            m->in_use = true;
+
+            // Deliver now, so that an unreliable message later in the same
+            // read doesn't overtake it.
+            DeliverReliable(socket, c);
+        }
+    } else if ( header.flags & F_UNRELIABLE ) {
+        // Drop it if a newer one got here first, or if it would overtake a
+        // reliable message sent before it, like a welcome that was lost.
+        bool is_stale = c->has_unreliable && !SeqNewer(header.seq, c->unreliable_seq);
+        bool is_early = (s16)(header.id - c->recv_id) > 0;
+
+        if ( !is_stale && !is_early ) {
+            if ( PacketPush(socket, message, header.size) ) {
+                c->unreliable_seq = header.seq;
+                c->has_unreliable = true;
+            }
+        }
+    }
+
+    if ( header.flags & F_ACK ) {
+        ProcessAcks(c, header.ack, header.ack_bits, now);
+    }
+
+    MarkReceived(c, header.seq);
+    c->last_recv_time = now;
+}
+
+bool UdpReceive(Socket * socket)
+{
+    UdpChannel * c = GetChannel(socket);
+    double now = NetTime();
+
+    // Each recv() returns one datagram: read until there are no more.
+    if ( !socket->is_polled || socket->is_readable ) {
+        char datagram[NET_MAX_DATAGRAM];
+
+        for ( ;; ) {
+            int n = NetRead(socket, datagram, sizeof(datagram));
+
+            if ( n == -1 ) {
+                // e.g., ECONNREFUSED. Nothing more will come, so it can be
+                // closed once what was delivered has been read.
+                socket->is_hungup = true;
+                socket->is_readable = false;
+                return false;
+            }
+
+            if ( n == 0 ) {
+                socket->is_readable = false;
+                break;
+            }
+
+            ProcessDatagram(socket, c, datagram, n, now);
+        }
+    }
+
+    DeliverReliable(socket, c);
+
+    // Resend reliable messages that have gone unacked for too long.
+    double resend_sec = max(MIN_RESEND_SEC, c->rtt * 2.0);
+
+    for ( u16 id = c->send_base; id != c->send_id; id++ ) {
+        SentMessage * m = &c->sent[id % UDP_WINDOW];
+
+        if ( m->frame && now - m->sent_time > resend_sec ) {
+            m->seq = c->send_seq;
+            m->sent_time = now;
+            m->is_resent = true;
+
+            if ( !SendDatagram(socket, c, F_RELIABLE, id, m->frame) ) {
+                return false;
+            }
+        }
+    }
+
+    // Nothing else went out to carry our acks, or to keep the peer from
+    // timing us out.
+    if ( (c->ack_pending && now - c->last_send_time > ACK_DELAY_SEC)
+        || now - c->last_send_time > KEEPALIVE_SEC ) {
+        if ( !SendDatagram(socket, c, 0, 0, nullptr) ) {
+            return false;
+        }
+    }
+
+    if ( now - c->last_recv_time > UDP_TIMEOUT_SEC ) {
+        socket->is_hungup = true;
+    }
+
+    return true;
+}
@@ -0,0 +1,47 @@
+//
+//  udp.hh
+//  NetTest2
+//
+
+#ifndef udp_hh
+#define udp_hh
+
+#include "misc.hh"
+#include "net.hh"
+#include "packet.hh"
+
+// Sequencing and reliability for TRANSPORT_UDP sockets.
+//
+// Every datagram has a sequence number and acks the last 33 datagrams
+// received from the peer. Each datagram carries at most one message.
+// Reliable messages are resent until a datagram carrying them is acked, and
+// are delivered in order. Unreliable messages are sent once, and dropped on
+// arrival if a newer one was already delivered, so a late snapshot never
+// overwrites a fresh one.
+//
+// Delivered messages are pushed into the socket's receive ring as frames, the
+// same as data read from a TCP stream, for PacketRead() to pick up.
+
+#define UDP_WINDOW 64 // Max reliable messages awaiting an ack.
+#define UDP_MAX_MESSAGE (NET_MAX_DATAGRAM - 16)
+#define UDP_TIMEOUT_SEC 10.0 // Hang up when nothing arrives for this long.
+
+/// Send `frame` as one message in a datagram. Reliable frames are retained
+/// until acked.
+/// - returns: `false` on a socket error, if the payload is over
+///   `UDP_MAX_MESSAGE`, or if `UDP_WINDOW` reliable messages are still waiting
+///   to be acked.
+bool UdpSend(Socket * socket, Frame * frame, Delivery delivery);
+
+/// Read all pending datagrams and deliver their messages to `read_buf`, then
+/// resend unacked messages and send acks or keep-alives as needed.
+/// Sets `is_hungup` when the peer has timed out.
+bool UdpReceive(Socket * socket);
+
+void UdpFreeChannel(UdpChannel * channel);
+
+/// Drop this fraction (0-1) of outgoing datagrams, to exercise the reliability
+/// layer over loopback.
+void UdpSimulateLoss(float chance);
+
+#endif /* udp_hh */
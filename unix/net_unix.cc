@@ -1,5 +1,7 @@
 #include "../net.hh"
 #include "../misc.hh"
+#include "../packet.hh"
+#include "../udp.hh"
 
 #include <assert.h>
 #include <errno.h>
@@ -9,15 +11,43 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <limits.h>
 #include <netdb.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#define CONNECT_TIMEOUT_SEC 300
+#define HELLO_RESEND_SEC 0.25
+#define HELLO_MEMORY 16 // Clients whose hellos were answered lately.
+#define HELLO_MEMORY_SEC 2.0
+
 static FILE* log_file;
 
-// TODO: use __thread or similar if we go multithreaded!
-static char err_str[NET_ERROR_MESSAGE_LEN] = "No error";
+// Per thread, since server worker threads each have their own sockets.
+static thread_local char err_str[NET_ERROR_MESSAGE_LEN] = "No error";
+static thread_local NetCounters counters;
+
+// Where hellos were answered from the server socket, to skip resends that
+// were already waiting behind the first one.
+struct AnsweredHello {
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    double time;
+};
+
+static thread_local AnsweredHello answered_hellos[HELLO_MEMORY];
+static thread_local int next_answered_hello;
 
 static void set_err(const char * format, ...)
 {
@@ -38,6 +68,21 @@ bool InitNetwork(const char * log_name)
         return false;
     }
 
+    // Writing to a connection the peer has closed raises SIGPIPE, which kills
+    // the process. Have the write fail with EPIPE instead.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every connection is a descriptor, and the default soft limit can be as
+    // low as 256. Take as many as we're allowed.
+    struct rlimit limit;
+    if ( getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max ) {
+        limit.rlim_cur = limit.rlim_max;
+#ifdef OPEN_MAX
+        limit.rlim_cur = min(limit.rlim_max, (rlim_t)OPEN_MAX); // macOS refuses more.
+#endif
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
     return true;
 }
 
@@ -60,20 +105,88 @@ static bool SetNonBlocking(int socket)
     return true;
 }
 
-Socket CreateClient(const char * ip, const char * port)
+// Let more than one socket bind to the same port.
+static bool SharePort(int socket)
+{
+    int on = 1;
+    if ( setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ) {
+        set_err("setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
+        return false;
+    }
+
+#if !defined(__linux__)
+    // BSD sockets only share a unicast port with this.
+    if ( setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1 ) {
+        set_err("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+// UDP has no connection to make: send hellos to the server's port until it
+// answers, then connect() to where the answer came from.
+static bool ConnectDatagram(int fd, const struct addrinfo * server_info)
+{
+    u8 hello = NET_DATAGRAM_HELLO;
+    double start = NetTime();
+
+    while ( NetTime() - start < CONNECT_TIMEOUT_SEC ) {
+        if ( sendto(fd,
+                    &hello, sizeof(hello), 0,
+                    server_info->ai_addr,
+                    server_info->ai_addrlen) == -1 ) {
+            set_err("sendto() failed: %s", strerror(errno));
+            return false;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        int rc = poll(&pfd, 1, (int)(HELLO_RESEND_SEC * 1000));
+        if ( rc == -1 ) {
+            set_err("poll failed: %s\n", strerror(errno));
+            return false;
+        } else if ( rc == 0 ) {
+            continue; // Resend.
+        }
+
+        struct sockaddr_storage from;
+        socklen_t from_len = sizeof(from);
+        u8 reply;
+
+        ssize_t n = recvfrom(fd,
+                             &reply, sizeof(reply), 0,
+                             (struct sockaddr *)&from, &from_len);
+
+        if ( n == sizeof(reply) && reply == NET_DATAGRAM_HELLO ) {
+            if ( connect(fd, (struct sockaddr *)&from, from_len) == -1 ) {
+                set_err("connect error: %s", strerror(errno));
+                return false;
+            }
+
+            return true;
+        }
+    }
+
+    set_err("client connection timed out");
+    return false;
+}
+
+Socket CreateClient(const char * ip, const char * port, Transport transport)
 {
     assert(port != nullptr);
     assert(ip != nullptr);
 
     Socket result = { 0 };
-    BufferInit(&result.write_buf, 1024); // TODO: extract init code commont to both client and server
+    result.transport = transport;
 
     struct addrinfo hints = {
         .ai_family = AF_UNSPEC, // don't care IPv4 or IPv6
-        .ai_socktype = SOCK_STREAM // TCP stream sockets
+        .ai_socktype = transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM
     };
 
-    struct addrinfo *server_info;  // will point to the results
+    struct addrinfo *server_info = nullptr;  // will point to the results
 
     int rc = getaddrinfo(ip, port, &hints, &server_info);
     if ( rc != 0 ) {
@@ -91,45 +204,50 @@ Socket CreateClient(const char * ip, const char * port)
         goto done;
     }
 
-    // TODO: use func
-    // Set socket to non blocking.
-    {
-        int flags = fcntl(result.fd, F_GETFL);
-        if ( flags == -1 ) {
-            set_err("fcntl(F_GETFL) failed: %s", strerror(errno));
-            goto done;
-        }
-
-        flags |= O_NONBLOCK;
-        if ( fcntl(result.fd, F_SETFL, flags) != 0 ) {
-            set_err("fcntl(F_SETFL) failed: %s", strerror(errno));
-            goto done;
-        }
+    if ( !SetNonBlocking(result.fd) ) {
+        goto error;
     }
 
-    if ( connect(result.fd, server_info->ai_addr, (int)server_info->ai_addrlen) == -1 ) {
+    if ( transport == TRANSPORT_UDP ) {
+        if ( !ConnectDatagram(result.fd, server_info) ) {
+            goto error;
+        }
+    } else if ( connect(result.fd, server_info->ai_addr, (int)server_info->ai_addrlen) == -1 ) {
         if ( errno == EINPROGRESS ) {
 
-            fd_set set;
-            FD_ZERO(&set);
-            FD_SET(result.fd, &set);
-            struct timeval timeout = { 300, 0 };
+            struct pollfd pfd = { .fd = result.fd, .events = POLLOUT };
 
-            int rc = select(result.fd + 1, nullptr, &set, nullptr, &timeout);
+            int rc = poll(&pfd, 1, CONNECT_TIMEOUT_SEC * 1000);
             if ( rc == -1 ) {
-                set_err("select failed: %s\n", strerror(errno));
-                goto done;
+                set_err("poll failed: %s\n", strerror(errno));
+                goto error;
             } else if ( rc == 0 ) {
                 set_err("client connection timed out");
-                goto done;
+                goto error;
+            }
+
+            // Writable either way: see whether it actually connected.
+            int so_error = 0;
+            socklen_t so_error_len = sizeof(so_error);
+            if ( getsockopt(result.fd, SOL_SOCKET, SO_ERROR, &so_error, &so_error_len) == -1 ) {
+                so_error = errno;
+            }
+
+            if ( so_error != 0 ) {
+                set_err("connect error: %s", strerror(so_error));
+                goto error;
             }
         } else {
             set_err("connect error: %s", strerror(errno));
-            goto done;
+            goto error;
         }
     }
 
     result.is_init = true;
+
+    goto done;
+error:
+    close(result.fd);
 done:
     if ( server_info ) {
         freeaddrinfo(server_info);
@@ -138,20 +256,20 @@ done:
     return result;
 }
 
-Socket CreateServer(const char * port)
+Socket CreateServer(const char * port, Transport transport)
 {
     assert(port != nullptr);
 
     Socket result = { 0 };
-    BufferInit(&result.write_buf, 1024);
+    result.transport = transport;
 
     struct addrinfo hints = {
+        .ai_flags = AI_PASSIVE,
         .ai_family = AF_UNSPEC, // don't care IPv4 or IPv6
-        .ai_socktype = SOCK_STREAM, // TCP stream sockets
-        .ai_flags = AI_PASSIVE
+        .ai_socktype = transport == TRANSPORT_UDP ? SOCK_DGRAM : SOCK_STREAM
     };
 
-    struct addrinfo *server_info;  // will point to the results
+    struct addrinfo *server_info = nullptr;  // will point to the results
 
     // See beej's network guide for more details.
     // Lookup network info for server type socket.
@@ -171,19 +289,13 @@ Socket CreateServer(const char * port)
     }
 
     // Set socket to non blocking, so we can call accept() without blocking.
-    {
-        int server_socket_flags = fcntl(result.fd, F_GETFL);
-        if (server_socket_flags == -1){
-            set_err("fcntl(F_GETFL) failed: %s", strerror(errno));
-            goto error;
-        }
+    if ( !SetNonBlocking(result.fd) ) {
+        goto error;
+    }
 
-        server_socket_flags |= O_NONBLOCK;
-        rc = fcntl(result.fd, F_SETFL, server_socket_flags);
-        if (rc != 0){
-            set_err("fcntl(F_SETFL) failed: %s", strerror(errno));
-            goto error;
-        }
+    // Each UDP client gets a socket of its own on this same port.
+    if ( transport == TRANSPORT_UDP && !SharePort(result.fd) ) {
+        goto error;
     }
 
     // Bind to a specific port.
@@ -195,11 +307,14 @@ Socket CreateServer(const char * port)
         goto error;
     }
 
-    // Listen on the socket for incoming connections.
-    rc = listen(result.fd, SERVER_ACCEPT_QUEUE_LIMIT);
-    if (rc != 0) {
-        set_err("listen() failed: %s", strerror(errno));
-        goto done;
+    // Listen on the socket for incoming connections. There's nothing to
+    // listen() for with UDP: connection requests are datagrams.
+    if ( transport == TRANSPORT_TCP ) {
+        rc = listen(result.fd, SERVER_ACCEPT_QUEUE_LIMIT);
+        if (rc != 0) {
+            set_err("listen() failed: %s", strerror(errno));
+            goto done;
+        }
     }
 
     result.is_init = true;
@@ -215,18 +330,125 @@ done:
     return result;
 }
 
+/// - returns: `true` if a hello from `from` was answered in the last
+///   HELLO_MEMORY_SEC, and remembers this one if not.
+static bool WasHelloAnswered(const struct sockaddr_storage * from,
+                             socklen_t from_len,
+                             double now)
+{
+    for ( int i = 0; i < HELLO_MEMORY; i++ ) {
+        const AnsweredHello * answered = &answered_hellos[i];
+
+        if ( answered->from_len == from_len
+            && now - answered->time < HELLO_MEMORY_SEC
+            && memcmp(&answered->from, from, from_len) == 0 ) {
+            return true;
+        }
+    }
+
+    AnsweredHello * answered = &answered_hellos[next_answered_hello];
+    next_answered_hello = (next_answered_hello + 1) % HELLO_MEMORY;
+
+    memcpy(&answered->from, from, from_len);
+    answered->from_len = from_len;
+    answered->time = now;
+
+    return false;
+}
+
+// Answer a hello datagram from a new client. Each client gets its own socket,
+// connected to it, so that connections can be read and polled separately.
+//
+// The socket is bound to the server's port, and the system delivers a
+// client's datagrams to the socket connected to it rather than the server
+// socket. So the answer comes from the port the client sent its hello to,
+// which is the only one a NAT in front of the client will let through. Any
+// hello the client sends after this arrives at its own socket, which answers
+// it again (see udp.cc).
+static bool AcceptDatagram(const Socket * server, Socket * out)
+{
+    struct sockaddr_storage from;
+    socklen_t from_len;
+    u8 hello;
+    double now = NetTime();
+
+    // Skip anything that isn't a connection request, so that returning with no
+    // connection means there are none left.
+    for ( ;; ) {
+        from_len = sizeof(from);
+        ssize_t n = recvfrom(server->fd,
+                             &hello, sizeof(hello), 0,
+                             (struct sockaddr *)&from, &from_len);
+
+        if ( n == -1 ) {
+            if ( errno == EWOULDBLOCK || errno == EAGAIN ) {
+                return true; // No connection requests.
+            }
+
+            set_err("recvfrom() failed: %s", strerror(errno));
+            return false;
+        }
+
+        if ( n == sizeof(hello)
+            && hello == NET_DATAGRAM_HELLO
+            && !WasHelloAnswered(&from, from_len, now) ) {
+            break;
+        }
+    }
+
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    if ( getsockname(server->fd, (struct sockaddr *)&local, &local_len) == -1 ) {
+        set_err("getsockname() failed: %s", strerror(errno));
+        return false;
+    }
+
+    out->fd = socket(from.ss_family, SOCK_DGRAM, 0);
+    if ( out->fd == -1 ) {
+        set_err("socket() failed: %s", strerror(errno));
+        return false;
+    }
+
+    if ( !SetNonBlocking(out->fd) || !SharePort(out->fd) ) {
+        close(out->fd);
+        return false;
+    }
+
+    if ( bind(out->fd, (struct sockaddr *)&local, local_len) == -1
+        || connect(out->fd, (struct sockaddr *)&from, from_len) == -1
+        || send(out->fd, &hello, sizeof(hello), 0) == -1 ) {
+        set_err("failed to answer hello: %s", strerror(errno));
+        close(out->fd);
+        return false;
+    }
+
+    out->transport = TRANSPORT_UDP;
+    out->is_accepted = true;
+    out->is_init = true;
+    return true;
+}
+
 bool AcceptConnection(const Socket * server, Socket * out)
 {
     assert(server != nullptr);
     assert(!out->is_init);
 
+    if ( server->transport == TRANSPORT_UDP ) {
+        return AcceptDatagram(server, out);
+    }
+
+#if defined(__linux__)
+    // Non-blocking from the start, without two more syscalls per connection.
+    out->fd = accept4(server->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     out->fd = accept(server->fd, nullptr, nullptr);
+#endif
     out->is_init = false;
 
     if ( out->fd == -1 ) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
+        if ( errno == EWOULDBLOCK || errno == EAGAIN ) {
             // accept didn't fail, but there was no connection:
-            return true; // TODO: distinguish return of fail vs none available
+            return true;
         }
 
         // accept failed:
@@ -234,7 +456,16 @@ bool AcceptConnection(const Socket * server, Socket * out)
         return false;
     }
 
-    BufferInit(&out->write_buf, 1024);
+#if !defined(__linux__)
+    // Only BSD sockets inherit O_NONBLOCK from the listening socket.
+    if ( !SetNonBlocking(out->fd) ) {
+        close(out->fd);
+        return false;
+    }
+#endif
+
+    out->transport = TRANSPORT_TCP;
+    out->is_accepted = true;
     out->is_init = true;
     return true;
 }
@@ -245,6 +476,7 @@ int NetWrite(const Socket * socket, void * data, int size)
     assert(data != nullptr);
     assert(size > 0);
 
+    counters.writes++;
     ssize_t size_sent = send(socket->fd, data, size, 0);
 
     if ( size_sent == -1 ) {
@@ -259,6 +491,33 @@ int NetWrite(const Socket * socket, void * data, int size)
     return (int)size_sent;
 }
 
+int NetWriteGather(const Socket * socket, const NetSlice * slices, int count)
+{
+    assert(socket != nullptr);
+    assert(slices != nullptr);
+    assert(count > 0 && count <= NET_MAX_SLICES);
+
+    struct iovec iov[NET_MAX_SLICES];
+    for ( int i = 0; i < count; i++ ) {
+        iov[i].iov_base = (void *)slices[i].data;
+        iov[i].iov_len = slices[i].size;
+    }
+
+    counters.writes++;
+    ssize_t size_sent = writev(socket->fd, iov, count);
+
+    if ( size_sent == -1 ) {
+        if ( errno == EWOULDBLOCK || errno == EAGAIN ) {
+            return 0;
+        }
+
+        set_err("Failed to send data: %s", strerror(errno));
+        return -1;
+    }
+
+    return (int)size_sent;
+}
+
 // TODO: here and unix: move to net_common.c
 bool NetWriteAll(const Socket * socket, void * data, int size)
 {
@@ -285,6 +544,7 @@ int NetRead(const Socket * socket, void * buffer, int size)
     assert(buffer != nullptr);
     assert(size > 0);
 
+    counters.reads++;
     ssize_t received = recv(socket->fd, buffer, size, 0);
     if ( received < 0 ) {
         if ( errno == EWOULDBLOCK || errno == EAGAIN ) {
@@ -296,6 +556,44 @@ int NetRead(const Socket * socket, void * buffer, int size)
         return -1;
     }
 
+    if ( received == 0 && socket->transport == TRANSPORT_TCP ) {
+        set_err("Connection closed by peer");
+        return -1;
+    }
+
+    return (int)received;
+}
+
+int NetReadScatter(const Socket * socket, const NetSlice * slices, int count)
+{
+    assert(socket != nullptr);
+    assert(slices != nullptr);
+    assert(count > 0 && count <= NET_MAX_SLICES);
+
+    struct iovec iov[NET_MAX_SLICES];
+    for ( int i = 0; i < count; i++ ) {
+        iov[i].iov_base = (void *)slices[i].data;
+        iov[i].iov_len = slices[i].size;
+    }
+
+    counters.reads++;
+    ssize_t received = readv(socket->fd, iov, count);
+    if ( received < 0 ) {
+        if ( errno == EWOULDBLOCK || errno == EAGAIN ) {
+            // Received nothing, but socket was non-blocking so it's okay.
+            return 0;
+        }
+
+        set_err("Error receiving data: %s", strerror(errno));
+        return -1;
+    }
+
+    // End of stream, which would otherwise look the same as nothing to read.
+    if ( received == 0 && socket->transport == TRANSPORT_TCP ) {
+        set_err("Connection closed by peer");
+        return -1;
+    }
+
     return (int)received;
 }
 
@@ -322,6 +620,211 @@ void CloseSocket(const Socket * socket)
 {
     assert(socket != nullptr);
     close(socket->fd);
+
+    PacketClearQueue((Socket *)socket);
+    free(socket->large_frame.data);
+
+    if ( socket->channel ) {
+        UdpFreeChannel(socket->channel);
+    }
+}
+
+Poller CreatePoller(void)
+{
+    Poller result = { 0 };
+
+#if defined(__linux__)
+    result.fd = epoll_create1(EPOLL_CLOEXEC);
+    if ( result.fd == -1 ) {
+        set_err("epoll_create1() failed: %s", strerror(errno));
+        return result;
+    }
+#else
+    result.fd = kqueue();
+    if ( result.fd == -1 ) {
+        set_err("kqueue() failed: %s", strerror(errno));
+        return result;
+    }
+#endif
+
+    result.is_init = true;
+    return result;
+}
+
+bool PollerAdd(const Poller * poller, Socket * socket)
+{
+    assert(poller != nullptr);
+    assert(socket != nullptr);
+
+#if defined(__linux__)
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = socket;
+
+    if ( epoll_ctl(poller->fd, EPOLL_CTL_ADD, socket->fd, &ev) == -1 ) {
+        set_err("epoll_ctl(ADD) failed: %s", strerror(errno));
+        return false;
+    }
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], socket->fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, socket);
+    EV_SET(&changes[1], socket->fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, socket);
+
+    if ( kevent(poller->fd, changes, 2, nullptr, 0, nullptr) == -1 ) {
+        set_err("kevent(EV_ADD) failed: %s", strerror(errno));
+        return false;
+    }
+#endif
+
+    socket->is_polled = true;
+    socket->is_readable = false;
+    socket->is_writable = false;
+    socket->is_hungup = false;
+
+    return true;
+}
+
+bool PollerRemove(const Poller * poller, Socket * socket)
+{
+    assert(poller != nullptr);
+    assert(socket != nullptr);
+
+    socket->is_polled = false;
+
+#if defined(__linux__)
+    if ( epoll_ctl(poller->fd, EPOLL_CTL_DEL, socket->fd, nullptr) == -1 ) {
+        set_err("epoll_ctl(DEL) failed: %s", strerror(errno));
+        return false;
+    }
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], socket->fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&changes[1], socket->fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+
+    if ( kevent(poller->fd, changes, 2, nullptr, 0, nullptr) == -1 ) {
+        set_err("kevent(EV_DELETE) failed: %s", strerror(errno));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+int PollerWait(const Poller * poller,
+               NetEvent * events,
+               int max_events,
+               int timeout_ms)
+{
+    assert(poller != nullptr);
+    assert(events != nullptr);
+    assert(max_events > 0);
+
+    max_events = min(max_events, NET_MAX_EVENTS);
+    counters.waits++;
+
+#if defined(__linux__)
+    struct epoll_event ready[NET_MAX_EVENTS];
+
+    int n = epoll_wait(poller->fd, ready, max_events, timeout_ms);
+    if ( n == -1 ) {
+        if ( errno == EINTR ) {
+            return 0;
+        }
+
+        set_err("epoll_wait() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    for ( int i = 0; i < n; i++ ) {
+        Socket * socket = (Socket *)ready[i].data.ptr;
+        int flags = 0;
+
+        if ( ready[i].events & EPOLLIN ) {
+            flags |= NET_EVENT_READ;
+        }
+
+        if ( ready[i].events & EPOLLOUT ) {
+            flags |= NET_EVENT_WRITE;
+        }
+
+        if ( ready[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR) ) {
+            flags |= NET_EVENT_HANGUP;
+        }
+
+        events[i].socket = socket;
+        events[i].flags = flags;
+    }
+#else
+    struct kevent ready[NET_MAX_EVENTS];
+    struct timespec timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L
+    };
+
+    int nready = kevent(poller->fd,
+                        nullptr, 0,
+                        ready, max_events,
+                        timeout_ms < 0 ? nullptr : &timeout);
+    if ( nready == -1 ) {
+        if ( errno == EINTR ) {
+            return 0;
+        }
+
+        set_err("kevent() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // kqueue reports read and write separately: merge them per socket.
+    int n = 0;
+    for ( int i = 0; i < nready; i++ ) {
+        Socket * socket = (Socket *)ready[i].udata;
+        int flags = 0;
+
+        if ( ready[i].filter == EVFILT_READ ) {
+            flags |= NET_EVENT_READ;
+        } else if ( ready[i].filter == EVFILT_WRITE ) {
+            flags |= NET_EVENT_WRITE;
+        }
+
+        if ( ready[i].flags & (EV_EOF | EV_ERROR) ) {
+            flags |= NET_EVENT_HANGUP;
+        }
+
+        if ( n > 0 && events[n - 1].socket == socket ) {
+            events[n - 1].flags |= flags;
+        } else {
+            events[n].socket = socket;
+            events[n].flags = flags;
+            n++;
+        }
+    }
+#endif
+
+    for ( int i = 0; i < n; i++ ) {
+        Socket * socket = events[i].socket;
+
+        if ( events[i].flags & NET_EVENT_READ ) {
+            socket->is_readable = true;
+        }
+
+        if ( events[i].flags & NET_EVENT_WRITE ) {
+            socket->is_writable = true;
+        }
+
+        if ( events[i].flags & NET_EVENT_HANGUP ) {
+            // Let the reader see the EOF or error.
+            socket->is_readable = true;
+            socket->is_hungup = true;
+        }
+    }
+
+    return n;
+}
+
+void ClosePoller(const Poller * poller)
+{
+    assert(poller != nullptr);
+    close(poller->fd);
 }
 
 const char * GetNetError(void)
@@ -338,7 +841,40 @@ void NetLog(const char * format, ...)
 {
     va_list args;
     va_start(args, format);
+    flockfile(log_file); // Keep lines from different threads whole.
     vfprintf(log_file, format, args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
     va_end(args);
 }
+
+double NetTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+}
+
+bool NetRandomBytes(void * buffer, int size)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 ) {
+        set_err("Could not open /dev/urandom: %s", strerror(errno));
+        return false;
+    }
+
+    bool ok = read(fd, buffer, size) == size;
+    if ( !ok ) {
+        set_err("Could not read /dev/urandom: %s", strerror(errno));
+    }
+
+    close(fd);
+
+    return ok;
+}
+
+NetCounters GetNetCounters(void)
+{
+    return counters;
+}